@@ -0,0 +1,202 @@
+/*
+ * arena.c
+ *
+ * Slabs of small blocks. See arena.h.
+ */
+
+#include "arena.h"
+
+#include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* size of the slabs that small blocks are carved from */
+#define SLAB_SIZE (1 << 16)
+
+struct ArenaSlab
+{
+    struct ArenaSlab *next;
+    /* keeps the blocks aligned for any type */
+    max_align_t data[];
+};
+
+/* A block that is too big for the slabs. The block itself follows the
+ * header. */
+struct ArenaLarge
+{
+    struct ArenaLarge *prev;
+    struct ArenaLarge *next;
+    size_t size;
+    max_align_t data[];
+};
+
+/* Returns the index of the size class that a block of size bytes belongs
+ * to. size must be at most ARENA_MAX_SMALL. */
+static size_t size_class(size_t size)
+{
+    return size == 0 ? 0 : (size - 1) / ARENA_CLASS_STEP;
+}
+
+/* Returns the block size of the given class. */
+static size_t class_size(size_t class)
+{
+    return (class + 1) * ARENA_CLASS_STEP;
+}
+
+void arena_init(Arena *arena)
+{
+    assert(arena != NULL);
+
+    memset(arena, 0, sizeof(*arena));
+}
+
+/* Allocates a block that is too big for the slabs. */
+static void *arena_alloc_large(Arena *arena, size_t size)
+{
+    struct ArenaLarge *block = malloc(sizeof(*block) + size);
+    if (!block) {
+        return NULL;
+    }
+
+    block->prev = NULL;
+    block->next = arena->large;
+    block->size = size;
+    if (arena->large) {
+        arena->large->prev = block;
+    }
+    arena->large = block;
+
+    arena->stats.large_bytes += size;
+    arena->stats.used_bytes += size;
+    return block->data;
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    ArenaClass *cls;
+    size_t block_size;
+    void *ptr;
+
+    assert(arena != NULL);
+
+    ++arena->stats.num_allocs;
+    if (size > ARENA_MAX_SMALL) {
+        return arena_alloc_large(arena, size);
+    }
+
+    cls = &arena->classes[size_class(size)];
+    block_size = class_size(size_class(size));
+
+    if (cls->free) {
+        ptr = cls->free;
+        memcpy(&cls->free, ptr, sizeof(cls->free));
+    } else {
+        if ((size_t) (cls->end - cls->next) < block_size) {
+            struct ArenaSlab *slab = malloc(sizeof(*slab) + SLAB_SIZE);
+            if (!slab) {
+                --arena->stats.num_allocs;
+                return NULL;
+            }
+            slab->next = arena->slabs;
+            arena->slabs = slab;
+            cls->next = (char *) slab->data;
+            cls->end = cls->next + SLAB_SIZE;
+
+            ++arena->stats.num_slabs;
+            arena->stats.slab_bytes += SLAB_SIZE;
+        }
+        ptr = cls->next;
+        cls->next += block_size;
+    }
+
+    arena->stats.used_bytes += block_size;
+    return ptr;
+}
+
+void *arena_realloc(Arena *arena, void *ptr, size_t old_size, size_t new_size)
+{
+    void *new_ptr;
+
+    assert(arena != NULL);
+
+    if (!ptr) {
+        return arena_alloc(arena, new_size);
+    }
+
+    /* blocks of the same class are already big enough */
+    if (old_size <= ARENA_MAX_SMALL && new_size <= ARENA_MAX_SMALL
+        && size_class(old_size) == size_class(new_size)) {
+        return ptr;
+    }
+
+    if (!(new_ptr = arena_alloc(arena, new_size))) {
+        return NULL;
+    }
+    memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    arena_free(arena, ptr, old_size);
+    return new_ptr;
+}
+
+void arena_free(Arena *arena, void *ptr, size_t size)
+{
+    assert(arena != NULL);
+
+    if (!ptr) {
+        return;
+    }
+
+    ++arena->stats.num_frees;
+    if (size > ARENA_MAX_SMALL) {
+        struct ArenaLarge *block = (struct ArenaLarge *)
+                ((char *) ptr - offsetof(struct ArenaLarge, data));
+        assert(block->size == size);
+
+        if (block->prev) {
+            block->prev->next = block->next;
+        } else {
+            arena->large = block->next;
+        }
+        if (block->next) {
+            block->next->prev = block->prev;
+        }
+        arena->stats.large_bytes -= size;
+        arena->stats.used_bytes -= size;
+        free(block);
+    } else {
+        ArenaClass *cls = &arena->classes[size_class(size)];
+        memcpy(ptr, &cls->free, sizeof(cls->free));
+        cls->free = ptr;
+        arena->stats.used_bytes -= class_size(size_class(size));
+    }
+}
+
+void arena_release(Arena *arena)
+{
+    struct ArenaSlab *slab;
+    struct ArenaLarge *block;
+    ArenaStats stats;
+
+    assert(arena != NULL);
+
+    slab = arena->slabs;
+    while (slab) {
+        struct ArenaSlab *next = slab->next;
+        free(slab);
+        slab = next;
+    }
+
+    block = arena->large;
+    while (block) {
+        struct ArenaLarge *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    /* the counters of past allocations are kept */
+    stats = arena->stats;
+    arena_init(arena);
+    arena->stats.num_allocs = stats.num_allocs;
+    arena->stats.num_frees = stats.num_frees;
+    arena->stats.num_releases = stats.num_releases + 1;
+}
@@ -0,0 +1,115 @@
+/**
+ * @file arena.h
+ * @author dreamyeyed
+ *
+ * An Arena hands out small blocks of memory from big slabs. Blocks are
+ * grouped into size classes that are 16 bytes apart, and every class has a
+ * free list of its own, so freed blocks are reused without going back to
+ * malloc. Blocks that are too big for any class are allocated with malloc,
+ * but the arena still keeps track of them.
+ *
+ * Everything allocated from an arena can be released at once without
+ * freeing the blocks one by one.
+ */
+#pragma once
+
+#include <stddef.h>
+
+/** blocks up to this size come from slabs */
+#define ARENA_MAX_SMALL 256
+
+/** distance between two size classes */
+#define ARENA_CLASS_STEP 16
+
+#define ARENA_NUM_CLASSES (ARENA_MAX_SMALL / ARENA_CLASS_STEP)
+
+/**
+ * Numbers that describe how much memory an arena uses.
+ */
+typedef struct ArenaStats
+{
+    /** number of slabs */
+    size_t num_slabs;
+    /** bytes in all slabs */
+    size_t slab_bytes;
+    /** bytes in blocks that were too big for the slabs */
+    size_t large_bytes;
+    /** bytes in blocks that are in use, rounded up to their size classes */
+    size_t used_bytes;
+    /** number of allocations since the arena was created */
+    size_t num_allocs;
+    /** number of blocks freed one by one since the arena was created */
+    size_t num_frees;
+    /** number of times everything was released at once */
+    size_t num_releases;
+} ArenaStats;
+
+/**
+ * Blocks of one size class.
+ */
+typedef struct ArenaClass
+{
+    /** freed blocks, linked through their first bytes */
+    void *free;
+    /** next unused block in the newest slab */
+    char *next;
+    /** end of the newest slab */
+    char *end;
+} ArenaClass;
+
+typedef struct Arena
+{
+    /** all slabs, newest first */
+    struct ArenaSlab *slabs;
+    /** big blocks allocated with malloc */
+    struct ArenaLarge *large;
+    /** the size classes */
+    ArenaClass classes[ARENA_NUM_CLASSES];
+    /** allocation statistics */
+    ArenaStats stats;
+} Arena;
+
+/**
+ * Initializes an empty arena. It doesn't allocate anything yet.
+ *
+ * @param arena
+ */
+void arena_init(Arena *arena);
+
+/**
+ * Allocates a block.
+ *
+ * @param arena
+ * @param size size of the block in bytes
+ * @return pointer to the block, or NULL in case of error
+ */
+void *arena_alloc(Arena *arena, size_t size);
+
+/**
+ * Resizes a block like realloc.
+ *
+ * @param arena
+ * @param ptr the block, or NULL
+ * @param old_size the size that ptr was allocated with
+ * @param new_size the new size
+ * @return pointer to the resized block, or NULL in case of error (in which
+ * case ptr is still valid)
+ */
+void *arena_realloc(Arena *arena, void *ptr, size_t old_size, size_t new_size);
+
+/**
+ * Frees a block so that it can be reused.
+ *
+ * @param arena
+ * @param ptr the block, or NULL
+ * @param size the size that ptr was allocated with
+ */
+void arena_free(Arena *arena, void *ptr, size_t size);
+
+/**
+ * Frees every block allocated from the arena at once. The arena can still
+ * be used after this.
+ *
+ * @param arena
+ */
+void arena_release(Arena *arena);
@@ -7,8 +7,14 @@
 #include "cursesio.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/select.h>
+#include <unistd.h>
 
 #include "util.h"
 
@@ -38,62 +44,355 @@ static int read_u8_char(char *buf)
 
 /* Calculates the x-position of cursor on the given line. Tabs make this
  * surprisingly difficult. Wide characters are not handled yet. */
-static size_t actual_column(const char *line, size_t cursor_x)
+static size_t actual_column(const TextSpan *spans, size_t cursor_x)
 {
     size_t column = 0;
+    int i;
 
-    while (cursor_x-- > 0) {
-        if (*line == '\t') {
-            column += TABSIZE - column % TABSIZE;
-        } else {
-            ++column;
+    for (i = 0; i < 2; ++i) {
+        const char *line = spans[i].text;
+        const char *end = line + spans[i].num_bytes;
+
+        while (line < end && cursor_x > 0) {
+            if (*line == '\t') {
+                column += TABSIZE - column % TABSIZE;
+            } else {
+                ++column;
+            }
+            do {
+                ++line;
+            } while (line < end && is_u8_cont_byte(*line));
+            --cursor_x;
         }
-        do {
-            ++line;
-        } while (is_u8_cont_byte(*line));
     }
 
     return column;
 }
 
+/* Shortens spans so that they fit in max_cols columns when printed at the
+ * column start. */
+static void clip_spans(TextSpan *spans, size_t start, size_t max_cols)
+{
+    size_t column = start;
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        const char *line = spans[i].text;
+        const char *end = line + spans[i].num_bytes;
+
+        while (line < end) {
+            size_t next = *line == '\t' ? column + TABSIZE - column % TABSIZE
+                                        : column + 1;
+            if (next > start + max_cols) {
+                spans[i].num_bytes = line - spans[i].text;
+                if (i == 0) {
+                    spans[1].num_bytes = 0;
+                }
+                return;
+            }
+            column = next;
+            do {
+                ++line;
+            } while (line < end && is_u8_cont_byte(*line));
+        }
+    }
+}
+
+/* Prints the parts of a line at the current position. Null characters
+ * would end the output of addnstr(), so they are shown as a highlighted @. */
+static void print_spans(const TextSpan *spans)
+{
+    int i;
+
+    for (i = 0; i < 2; ++i) {
+        const char *text = spans[i].text;
+        const char *end = text + spans[i].num_bytes;
+
+        while (text < end) {
+            const char *nul = memchr(text, '\0', end - text);
+            if (!nul) {
+                addnstr(text, end - text);
+                break;
+            }
+            if (nul > text) {
+                addnstr(text, nul - text);
+            }
+            addch('@' | A_REVERSE);
+            text = nul + 1;
+        }
+    }
+}
+
+/* Marks rows from first to last (exclusive) with damage, unless they
+ * already need more than that. */
+static void damage_rows(LoonyWindow *win, long first, long last,
+                        RowDamage damage)
+{
+    long i;
+
+    if (first < 0) {
+        first = 0;
+    }
+    if (last > (long) win->num_rows) {
+        last = win->num_rows;
+    }
+    for (i = first; i < last; ++i) {
+        if (win->row_damage[i] < damage) {
+            win->row_damage[i] = damage;
+        }
+    }
+}
+
+/* Moves the rows from first to the bottom of the text area up by n rows (or
+ * down, if n is negative) and marks the rows that became empty. */
+static void scroll_rows(LoonyWindow *win, long first, long n)
+{
+    long rows = win->num_rows;
+
+    setscrreg(first, rows - 1);
+    scrollok(stdscr, TRUE);
+    scrl(n);
+    scrollok(stdscr, FALSE);
+    setscrreg(0, rows - 1);
+
+    if (n > 0) {
+        memmove(win->row_damage + first, win->row_damage + first + n,
+                rows - first - n);
+        damage_rows(win, rows - n, rows, ROW_FULL);
+    } else {
+        memmove(win->row_damage + first - n, win->row_damage + first,
+                rows - first + n);
+        damage_rows(win, first, first - n, ROW_FULL);
+    }
+}
+
+/* Works out which rows of the window must be drawn again. Returns 0 if the
+ * rows can be updated one by one, or 1 if everything must be drawn. */
+static int find_damaged_rows(LoonyWindow *win, size_t win_h)
+{
+    TextDamage damage;
+    long rows = win_h - 1;
+    long pos;
+
+    textbuf_take_damage(loonywin_get_buffer(win), &damage);
+
+    if (win->num_rows != (size_t) rows) {
+        unsigned char *new_damage = realloc(win->row_damage, rows);
+        if (!new_damage) {
+            return 1;
+        }
+        win->row_damage = new_damage;
+        win->num_rows = rows;
+        win->redraw_needed = 1;
+    }
+    memset(win->row_damage, ROW_CLEAN, rows);
+
+    /* Line numbers change when the buffer scrolls and when lines are added
+     * or removed. Both at once are rare enough to just draw everything. */
+    if (win->redraw_needed || damage.all
+        || (win->scroll_delta != 0 && damage.shift != 0)
+        || labs(win->scroll_delta) >= rows) {
+        return 1;
+    }
+
+    if (win->scroll_delta != 0) {
+        scroll_rows(win, 0, win->scroll_delta);
+    }
+
+    if (damage.shift != 0) {
+        pos = (long) damage.shift_pos - win->firstrow;
+        if (pos < 0 || pos + labs(damage.shift) >= rows) {
+            /* the lines at the top moved, or everything below pos did */
+            damage_rows(win, pos, rows, ROW_FULL);
+        } else {
+            scroll_rows(win, pos, -damage.shift);
+            damage_rows(win, pos, rows, ROW_GUTTER);
+        }
+    }
+
+    if (damage.first <= damage.last && damage.last >= (size_t) win->firstrow) {
+        pos = (long) damage.first - win->firstrow;
+        damage_rows(win, pos,
+                    damage.last - win->firstrow >= (size_t) rows
+                    ? rows : (long) (damage.last - win->firstrow) + 1,
+                    ROW_FULL);
+    }
+    return 0;
+}
+
 void display_win(LoonyWindow *win)
 {
     size_t win_h, win_w; /* window size */
-    int line_digits; /* how much space required for line numbers? */
     size_t i;
     TextBuffer *buf;
-    size_t curr_line_num;
-    const char *curr_line_text;
+    TextSpan spans[2];
 
     assert(win != NULL);
 
     buf = loonywin_get_buffer(win);
-    curr_line_num = textbuf_line_num(buf);
-    curr_line_text = textbuf_get_line(buf, curr_line_num);
 
     getmaxyx(win->window, win_h, win_w);
 
-    if (win->redraw_needed) {
-        erase();
+    if (find_damaged_rows(win, win_h)) {
+        if (win->num_rows != win_h - 1) {
+            return; /* out of memory */
+        }
+        memset(win->row_damage, ROW_FULL, win->num_rows);
+        win->statusbar_dirty = 1;
         win->redraw_needed = 0;
     }
+    win->scroll_delta = 0;
 
-    for (i = 0; i < win_h - 1 && win->firstrow + i < buf->num_lines; ++i) {
+    for (i = 0; i < win->num_rows; ++i) {
         size_t row = win->firstrow + i;
+        if (win->row_damage[i] == ROW_CLEAN) {
+            continue;
+        }
+
+        if (win->row_damage[i] == ROW_GUTTER && row < buf->num_lines) {
+            mvprintw(i, 0, "%*zu", TABSIZE-1, row+1);
+            continue;
+        }
+
         move(i, 0);
         clrtoeol();
-        mvprintw(i, 0,
-                "%*zu\t%s\n", TABSIZE-1, row+1, textbuf_get_line(buf, row));
+        if (row < buf->num_lines) {
+            mvprintw(i, 0, "%*zu\t", TABSIZE-1, row+1);
+            textbuf_get_line_spans(buf, row, spans);
+            clip_spans(spans, TABSIZE,
+                       win_w > (size_t) TABSIZE ? win_w - TABSIZE : 0);
+            print_spans(spans);
+        }
     }
 
     /* draw statusbar */
-    mvaddstr(win_h-1, 0, win->statusbar_text);
+    if (win->statusbar_dirty) {
+        move(win_h-1, 0);
+        clrtoeol();
+        mvaddnstr(win_h-1, 0, win->statusbar_text, win_w - 1);
+        win->statusbar_dirty = 0;
+    }
 
+    textbuf_get_line_spans(buf, textbuf_line_num(buf), spans);
     move(textbuf_line_num(buf) - win->firstrow,
-         TABSIZE + actual_column(curr_line_text, buf->ccol));
+         TABSIZE + actual_column(spans, buf->ccol));
     refresh();
 }
 
+/* Waits until there's a key to read or the wake file descriptor of the
+ * window becomes readable. Returns non-zero if there's a key. */
+static int wait_for_key(LoonyWindow *win)
+{
+    struct timeval tv;
+    fd_set fds;
+    int n;
+
+    FD_ZERO(&fds);
+    FD_SET(STDIN_FILENO, &fds);
+    FD_SET(win->wake_fd, &fds);
+    tv.tv_sec = win->key_timeout / 1000;
+    tv.tv_usec = win->key_timeout % 1000 * 1000;
+
+    n = select((STDIN_FILENO > win->wake_fd ? STDIN_FILENO : win->wake_fd) + 1,
+               &fds, NULL, NULL, win->key_timeout < 0 ? NULL : &tv);
+    if (n < 0) {
+        /* a signal such as SIGWINCH may have brought a key with it */
+        return errno == EINTR;
+    }
+    return n > 0 && FD_ISSET(STDIN_FILENO, &fds);
+}
+
+int get_key(LoonyWindow *win)
+{
+    int c;
+    unsigned long now;
+
+    assert(win != NULL);
+
+    /* see if there's a key waiting without blocking */
+    nodelay(stdscr, TRUE);
+    c = getch();
+    timeout(win->key_timeout);
+
+    now = current_ms();
+    if (c != ERR && now - win->last_frame < win->frame_interval) {
+        return c;
+    }
+
+    if (c != ERR) {
+        ungetch(c);
+    }
+    display_win(win);
+    win->last_frame = now;
+    if (c == ERR && win->wake_fd != -1 && !wait_for_key(win)) {
+        return ERR;
+    }
+    return getch();
+}
+
+void start_bracketed_paste(void)
+{
+    define_key("\033[200~", KEY_PASTE_BEGIN);
+    define_key("\033[201~", KEY_PASTE_END);
+    fputs("\033[?2004h", stdout);
+    fflush(stdout);
+}
+
+void stop_bracketed_paste(void)
+{
+    fputs("\033[?2004l", stdout);
+    fflush(stdout);
+}
+
+void paste_at_cursor(LoonyWindow *win)
+{
+    char *text = NULL;
+    size_t size = 0;
+    size_t num_bytes = 0;
+    int c;
+
+    assert(win != NULL);
+
+    /* The paste may arrive in pieces slower than the key timeout, and the
+     * rest of it would be taken for commands. getch() only returns ERR now
+     * if reading fails. get_key sets the timeout again. */
+    timeout(-1);
+    while ((c = getch()) != KEY_PASTE_END && c != ERR) {
+        if (c > 0xff) {
+            continue; /* something that curses took for a special key */
+        }
+
+        if (num_bytes == size) {
+            size_t new_size = size ? size * 2 : 4096;
+            char *new_text = realloc(text, new_size);
+            if (!new_text) {
+                skip_paste();
+                break;
+            }
+            text = new_text;
+            size = new_size;
+        }
+        /* terminals send the Enter key as a carriage return */
+        text[num_bytes++] = c == '\r' ? '\n' : c;
+    }
+
+    if (num_bytes > 0) {
+        textbuf_insert_len_at_cursor(loonywin_get_buffer(win), text,
+                                     num_bytes);
+        loonywin_follow_cursor(win);
+    }
+    free(text);
+}
+
+void skip_paste(void)
+{
+    int c;
+
+    timeout(-1);
+    while ((c = getch()) != KEY_PASTE_END && c != ERR) {
+    }
+}
+
 void write_new_line(LoonyWindow *win, size_t pos)
 {
     int win_h, win_w;
@@ -105,7 +404,7 @@ void write_new_line(LoonyWindow *win, size_t pos)
     buf = loonywin_get_buffer(win);
 
     if (pos >= win_h && pos - win->firstrow >= win_h) {
-        win->firstrow += 1;
+        loonywin_scroll(win, 1);
     }
 
     textbuf_insert_line(buf, textline_init(""), pos);
@@ -121,13 +420,28 @@ void insert_at_cursor(LoonyWindow *win)
     assert(win != NULL);
 
     buf = loonywin_get_buffer(win);
-    display_win(win);
 
-    while ((c = getch()) != 27) { /* 27 = escape */
+    for (;;) {
         char tmp[5];
-        int line = textbuf_line_num(buf);
-        int col = textbuf_col_num(buf);
-        if (c == KEY_BACKSPACE) {
+        int line, col;
+
+        if (win->wait_fn) {
+            win->wait_fn(win->wait_data, win);
+        }
+        c = get_key(win);
+        if (c == 27) { /* 27 = escape */
+            return;
+        } else if (c == ERR) {
+            /* get_key gave up waiting; there's no key to insert */
+            continue;
+        }
+
+        line = textbuf_line_num(buf);
+        col = textbuf_col_num(buf);
+        if (c == KEY_PASTE_BEGIN) {
+            paste_at_cursor(win);
+            continue;
+        } else if (c == KEY_BACKSPACE) {
             if (col > 0) {
                 textbuf_move_cursor(buf, 0, -1);
                 textbuf_delete_char(buf);
@@ -146,6 +460,40 @@ void insert_at_cursor(LoonyWindow *win)
             }
             textbuf_insert_at_cursor(buf, tmp);
         }
-        display_win(win);
+        loonywin_follow_cursor(win);
+    }
+}
+
+int read_prompt(LoonyWindow *win, const char *prompt, char *text, size_t size)
+{
+    char status[STATUSBAR_LENGTH];
+    size_t len = 0;
+    int c;
+
+    assert(win != NULL);
+    assert(prompt != NULL);
+    assert(text != NULL);
+    assert(size > 0);
+
+    text[0] = '\0';
+    for (;;) {
+        snprintf(status, sizeof(status), "%s%s", prompt, text);
+        loonywin_set_statusbar(win, status);
+        c = get_key(win);
+        if (c == 27) { /* 27 = escape */
+            return 1;
+        } else if (c == '\n') {
+            return 0;
+        } else if (c == KEY_BACKSPACE) {
+            /* remove the whole last character */
+            while (len > 0 && (text[--len] & 0xC0) == 0x80) {
+            }
+            text[len] = '\0';
+        } else if (c == KEY_PASTE_BEGIN) {
+            skip_paste();
+        } else if (c >= ' ' && c <= 0xFF && len + 1 < size) {
+            text[len++] = c;
+            text[len] = '\0';
+        }
     }
 }
@@ -18,6 +18,50 @@
  */
 void display_win(LoonyWindow *win);
 
+/**
+ * Reads the next key. The window is drawn before waiting for a key, but when
+ * keys are coming in faster than they can be drawn (for example, when text
+ * is pasted or a key is held down), drawing is skipped until no more keys
+ * are waiting or the frame interval of the window has passed.
+ *
+ * @param win the window to be displayed
+ * @return the key, like getch(), or ERR if the key timeout of the window
+ * passed or its wake file descriptor became readable without a key
+ */
+int get_key(LoonyWindow *win);
+
+/** key code for the start of pasted text */
+#define KEY_PASTE_BEGIN (KEY_MAX + 1)
+
+/** key code for the end of pasted text */
+#define KEY_PASTE_END (KEY_MAX + 2)
+
+/**
+ * Asks the terminal to mark pasted text, so that it can be recognized and
+ * inserted all at once. getch() returns KEY_PASTE_BEGIN before the pasted
+ * text and KEY_PASTE_END after it.
+ */
+void start_bracketed_paste(void);
+
+/**
+ * Tells the terminal to stop marking pasted text.
+ */
+void stop_bracketed_paste(void);
+
+/**
+ * Reads pasted text up to KEY_PASTE_END and inserts it at the cursor as one
+ * edit. Call this after getting KEY_PASTE_BEGIN.
+ *
+ * @param win the window where the text should be added
+ */
+void paste_at_cursor(LoonyWindow *win);
+
+/**
+ * Reads pasted text up to KEY_PASTE_END and throws it away, so that it isn't
+ * taken for commands. Call this after getting KEY_PASTE_BEGIN.
+ */
+void skip_paste(void);
+
 /**
  * Allows the user to write a new line of text.
  *
@@ -32,3 +76,15 @@ void write_new_line(LoonyWindow *win, size_t pos);
  * @param win the window where the next text should be added
  */
 void insert_at_cursor(LoonyWindow *win);
+
+/**
+ * Asks the user for a line of text on the statusbar.
+ *
+ * @param win the window whose statusbar is used
+ * @param prompt text shown before the answer
+ * @param text an array where the null terminated answer is stored
+ * @param size size of the text array
+ * @return 0 if the answer was given with enter, non-zero if it was cancelled
+ * with escape
+ */
+int read_prompt(LoonyWindow *win, const char *prompt, char *text, size_t size);
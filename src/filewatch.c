@@ -0,0 +1,158 @@
+/*
+ * filewatch.c
+ *
+ * Noticing changes to files. See filewatch.h.
+ */
+
+#include "filewatch.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/inotify.h>
+#define HAVE_INOTIFY 1
+
+/* the events that may mean that the text of the file has changed */
+#define WATCH_EVENTS (IN_MODIFY | IN_ATTRIB | IN_CLOSE_WRITE | IN_MOVE_SELF \
+                      | IN_DELETE_SELF)
+#endif
+
+struct FileWatch
+{
+    /** name of the watched file */
+    char *filename;
+    /** inotify instance, or -1 if the file is polled */
+    int fd;
+    /** the inotify watch of the file, or -1 if there isn't one right now */
+    int wd;
+    /** the state of the file when it was last polled */
+    struct stat st;
+};
+
+/* Stats the file and returns non-zero if it's different from the last
+ * time. */
+static int filewatch_poll(FileWatch *watch)
+{
+    struct stat st;
+    int changed;
+
+    if (stat(watch->filename, &st) != 0) {
+        memset(&st, 0, sizeof(st));
+    }
+
+    changed = st.st_ino != watch->st.st_ino || st.st_size != watch->st.st_size
+              || st.st_mtim.tv_sec != watch->st.st_mtim.tv_sec
+              || st.st_mtim.tv_nsec != watch->st.st_mtim.tv_nsec;
+    watch->st = st;
+    return changed;
+}
+
+FileWatch *filewatch_init(const char *filename)
+{
+    FileWatch *watch;
+
+    assert(filename != NULL);
+
+    if (!(watch = malloc(sizeof(*watch)))) {
+        return NULL;
+    }
+    if (!(watch->filename = malloc(strlen(filename) + 1))) {
+        free(watch);
+        return NULL;
+    }
+    strcpy(watch->filename, filename);
+    memset(&watch->st, 0, sizeof(watch->st));
+    filewatch_poll(watch);
+
+    watch->fd = -1;
+    watch->wd = -1;
+#ifdef HAVE_INOTIFY
+    watch->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (watch->fd != -1) {
+        watch->wd = inotify_add_watch(watch->fd, filename, WATCH_EVENTS);
+    }
+#endif
+    return watch;
+}
+
+int filewatch_fd(const FileWatch *watch)
+{
+    assert(watch != NULL);
+
+    /* a file that has been moved away is polled until it is back */
+    return watch->wd != -1 ? watch->fd : -1;
+}
+
+int filewatch_check(FileWatch *watch)
+{
+    assert(watch != NULL);
+
+#ifdef HAVE_INOTIFY
+    if (watch->fd != -1) {
+        char events[4096]
+            __attribute__((aligned(__alignof__(struct inotify_event))));
+        ssize_t n;
+        int changed = 0;
+
+        while ((n = read(watch->fd, events, sizeof(events))) > 0) {
+            char *p;
+            changed = 1;
+            for (p = events; p < events + n;
+                 p += sizeof(struct inotify_event)
+                      + ((struct inotify_event *) p)->len) {
+                struct inotify_event *ev = (struct inotify_event *) p;
+                /* the watch follows the file if it's renamed, but the name
+                 * may soon belong to a new file (log rotation) */
+                if (ev->wd != watch->wd) {
+                    continue;
+                } else if (ev->mask & (IN_MOVE_SELF | IN_DELETE_SELF)) {
+                    inotify_rm_watch(watch->fd, watch->wd);
+                    watch->wd = -1;
+                } else if (ev->mask & IN_IGNORED) {
+                    watch->wd = -1;
+                }
+            }
+        }
+
+        /* A file that is replaced by renaming another one over it doesn't
+         * say so if someone still has it open, so any change is a reason
+         * to see if the name still refers to the watched file. */
+        if (changed && watch->wd != -1) {
+            struct stat st;
+            if (stat(watch->filename, &st) != 0
+                || st.st_ino != watch->st.st_ino
+                || st.st_dev != watch->st.st_dev) {
+                inotify_rm_watch(watch->fd, watch->wd);
+                watch->wd = -1;
+            }
+        }
+
+        if (watch->wd == -1) {
+            watch->wd = inotify_add_watch(watch->fd, watch->filename,
+                                          WATCH_EVENTS);
+            changed |= filewatch_poll(watch);
+        }
+        return changed;
+    }
+#endif
+
+    return filewatch_poll(watch);
+}
+
+void filewatch_free(FileWatch *watch)
+{
+    if (!watch) {
+        return;
+    }
+
+    if (watch->fd != -1) {
+        close(watch->fd);
+    }
+    free(watch->filename);
+    free(watch);
+}
@@ -0,0 +1,46 @@
+/**
+ * @file filewatch.h
+ * @author dreamyeyed
+ *
+ * A FileWatch notices when a file changes. On Linux it asks inotify to tell
+ * it about changes, so there is a file descriptor that becomes readable when
+ * the file has changed. Elsewhere, or if inotify can't be used, the size and
+ * modification time of the file are compared every time it is checked.
+ */
+#pragma once
+
+typedef struct FileWatch FileWatch;
+
+/**
+ * Starts watching a file.
+ *
+ * @param filename name of the file
+ * @return pointer to a dynamically allocated FileWatch, or NULL in case of
+ * error
+ */
+FileWatch *filewatch_init(const char *filename);
+
+/**
+ * Returns a file descriptor that becomes readable when the file changes.
+ * If there isn't one, filewatch_check must be called every now and then.
+ *
+ * @param watch
+ * @return a file descriptor, or -1 if the file must be polled
+ */
+int filewatch_fd(const FileWatch *watch);
+
+/**
+ * Tells whether the file may have changed since the last call. This never
+ * blocks.
+ *
+ * @param watch
+ * @return non-zero if the file may have changed
+ */
+int filewatch_check(FileWatch *watch);
+
+/**
+ * Stops watching a file and frees the FileWatch.
+ *
+ * @param watch
+ */
+void filewatch_free(FileWatch *watch);
@@ -0,0 +1,942 @@
+/*
+ * journal.c
+ *
+ * Recording edits so that they can be recovered after a crash. See
+ * journal.h.
+ */
+
+#include "journal.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/* the first bytes of a journal file */
+#define JOURNAL_MAGIC "LOONYJ01"
+#define JOURNAL_MAGIC_SIZE 8
+
+/* every record begins with its size and checksum */
+#define RECORD_HEADER_SIZE 8
+
+/* edits are committed at most this many milliseconds after they were made,
+ * or as soon as this many bytes of them are waiting */
+#define JOURNAL_COMMIT_DELAY 1000
+#define JOURNAL_COMMIT_SIZE (1 << 20)
+
+/* the journal is replaced with a checkpoint when it's bigger than this and
+ * the edits after the last checkpoint take more space than the checkpoint */
+#define JOURNAL_COMPACT_SIZE (1 << 20)
+
+/* maximum number of lines in one text record of a checkpoint */
+#define CHECKPOINT_TEXT_LINES 1024
+
+/* Types of records. An edit is JOURNAL_EDIT plus its TextEditType. */
+enum
+{
+    /* the file that the journal belongs to: size, mtime, inode */
+    JOURNAL_BASE,
+    /* lines that are the same as in the file: first line, count */
+    JOURNAL_CHECKPOINT_LINES,
+    /* lines that aren't in the file: count, text */
+    JOURNAL_CHECKPOINT_TEXT,
+    /* the end of a checkpoint */
+    JOURNAL_CHECKPOINT_END,
+    JOURNAL_EDIT = 16
+};
+
+/* Lines [line, line + count[ of the buffer are the lines
+ * [base_line, base_line + count[ of the file. */
+typedef struct JournalSegment
+{
+    size_t line;
+    size_t base_line;
+    size_t count;
+} JournalSegment;
+
+struct Journal
+{
+    /** the buffer whose edits are recorded */
+    TextBuffer *buf;
+    /** name of the edited file */
+    char *filename;
+    /** name of the journal file */
+    char *path;
+    /** the journal file, or -1 if nothing has been written yet */
+    int fd;
+    /** the edited file as it was when the journal was started */
+    struct stat base;
+    /** records that haven't been written yet */
+    char *pending;
+    /** number of bytes in pending */
+    size_t num_pending;
+    /** size of the pending array */
+    size_t pending_size;
+    /** when the oldest record in pending was made */
+    unsigned long pending_since;
+    /** size of the journal file */
+    size_t file_size;
+    /** size of the journal file right after its checkpoint */
+    size_t checkpoint_size;
+    /** lines of the buffer that are still the same as in the file */
+    JournalSegment *segments;
+    /** number of segments */
+    size_t num_segments;
+    /** size of the segments array */
+    size_t segments_size;
+    /**
+     * non-zero if an edit couldn't be recorded, so the journal must be
+     * replaced with a checkpoint
+     */
+    int broken;
+};
+
+/* Computes the checksum of a record (32-bit FNV-1a). */
+static uint32_t journal_checksum(const char *data, size_t size)
+{
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < size; ++i) {
+        hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+    }
+    return hash;
+}
+
+/* Makes room for n more bytes in pending. Returns 0 on success. */
+static int journal_reserve(Journal *journal, size_t n)
+{
+    if (journal->num_pending + n > journal->pending_size) {
+        size_t new_size = journal->pending_size ? journal->pending_size : 4096;
+        char *new_pending;
+        while (new_size < journal->num_pending + n) {
+            new_size *= 2;
+        }
+        if (!(new_pending = realloc(journal->pending, new_size))) {
+            return 1;
+        }
+        journal->pending = new_pending;
+        journal->pending_size = new_size;
+    }
+    return 0;
+}
+
+/* Adds bytes to the record being built. Returns 0 on success. */
+static int journal_put(Journal *journal, const void *data, size_t n)
+{
+    if (n == 0) {
+        return 0;
+    } else if (journal_reserve(journal, n)) {
+        return 1;
+    }
+    memcpy(journal->pending + journal->num_pending, data, n);
+    journal->num_pending += n;
+    return 0;
+}
+
+/* Adds a number to the record being built, seven bits per byte. */
+static int journal_put_number(Journal *journal, uint64_t value)
+{
+    unsigned char bytes[10];
+    size_t n = 0;
+
+    do {
+        bytes[n] = value & 0x7f;
+        value >>= 7;
+        if (value) {
+            bytes[n] |= 0x80;
+        }
+        ++n;
+    } while (value);
+    return journal_put(journal, bytes, n);
+}
+
+/* Starts a record of the given type. Returns 0 on success. */
+static int journal_begin_record(Journal *journal, unsigned char type)
+{
+    if (journal_reserve(journal, RECORD_HEADER_SIZE + 1)) {
+        return 1;
+    }
+    journal->num_pending += RECORD_HEADER_SIZE;
+    return journal_put(journal, &type, 1);
+}
+
+/* Fills in the header of the record that begins at start. */
+static void journal_end_record(Journal *journal, size_t start)
+{
+    char *payload = journal->pending + start + RECORD_HEADER_SIZE;
+    uint32_t size = journal->num_pending - start - RECORD_HEADER_SIZE;
+    uint32_t checksum = journal_checksum(payload, size);
+
+    memcpy(journal->pending + start, &size, 4);
+    memcpy(journal->pending + start + 4, &checksum, 4);
+}
+
+/* Reads a number written by journal_put_number. Returns 0 on success. */
+static int journal_get_number(const char **p, const char *end,
+                              uint64_t *value)
+{
+    int shift = 0;
+
+    *value = 0;
+    while (*p < end && shift < 64) {
+        unsigned char byte = *(*p)++;
+        *value |= (uint64_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return 0;
+        }
+        shift += 7;
+    }
+    return 1;
+}
+
+/* Reads the record that begins at *pos. Returns 0 and moves *pos past the
+ * record if it's complete and intact. */
+static int journal_get_record(const char *data, size_t size, size_t *pos,
+                              const char **payload, size_t *payload_size)
+{
+    uint32_t record_size;
+    uint32_t checksum;
+
+    if (size - *pos < RECORD_HEADER_SIZE) {
+        return 1;
+    }
+    memcpy(&record_size, data + *pos, 4);
+    memcpy(&checksum, data + *pos + 4, 4);
+    if (record_size == 0 || size - *pos - RECORD_HEADER_SIZE < record_size
+        || journal_checksum(data + *pos + RECORD_HEADER_SIZE, record_size)
+           != checksum) {
+        return 1;
+    }
+
+    *payload = data + *pos + RECORD_HEADER_SIZE;
+    *payload_size = record_size;
+    *pos += RECORD_HEADER_SIZE + record_size;
+    return 0;
+}
+
+/*
+ * The segments are sorted by line and don't overlap. Lines that no segment
+ * covers have been changed. Edits split, remove and move segments, so the
+ * number of segments depends on the number of edits and not on the size of
+ * the file.
+ */
+
+/* Returns the index of the first segment that ends after line. */
+static size_t journal_find_segment(const Journal *journal, size_t line)
+{
+    size_t lo = 0;
+    size_t hi = journal->num_segments;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        const JournalSegment *seg = &journal->segments[mid];
+        if (seg->line + seg->count <= line) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Splits the segment that contains line so that a segment begins at line.
+ * Returns 0 on success. */
+static int journal_split_segment(Journal *journal, size_t line)
+{
+    size_t i = journal_find_segment(journal, line);
+    JournalSegment *seg;
+
+    if (i == journal->num_segments || journal->segments[i].line >= line) {
+        return 0;
+    }
+
+    if (journal->num_segments == journal->segments_size) {
+        size_t new_size = journal->segments_size ? journal->segments_size * 2
+                                                 : 16;
+        JournalSegment *new_segments = realloc(journal->segments,
+                                               new_size * sizeof(*seg));
+        if (!new_segments) {
+            return 1;
+        }
+        journal->segments = new_segments;
+        journal->segments_size = new_size;
+    }
+
+    seg = &journal->segments[i];
+    memmove(seg + 1, seg, (journal->num_segments - i) * sizeof(*seg));
+    ++journal->num_segments;
+    seg[1].line = line;
+    seg[1].base_line = seg->base_line + (line - seg->line);
+    seg[1].count = seg->count - (line - seg->line);
+    seg->count = line - seg->line;
+    return 0;
+}
+
+/* Forgets which lines are the same as in the file, so that checkpoints
+ * contain the whole buffer. This is always correct, only slower. */
+static void journal_forget_segments(Journal *journal)
+{
+    journal->num_segments = 0;
+}
+
+/* Records that every line of the buffer is the same as in the file. */
+static void journal_reset_segments(Journal *journal)
+{
+    journal_forget_segments(journal);
+    if (journal->segments_size == 0) {
+        if (!(journal->segments = malloc(16 * sizeof(*journal->segments)))) {
+            return;
+        }
+        journal->segments_size = 16;
+    }
+
+    journal->segments[0].line = 0;
+    journal->segments[0].base_line = 0;
+    journal->segments[0].count = journal->buf->num_lines;
+    journal->num_segments = journal->buf->num_lines > 0;
+}
+
+/* Records that the lines [first, end[ have changed. The lines after them
+ * move up by shift lines. */
+static void journal_change_lines(Journal *journal, size_t first, size_t end,
+                                 size_t shift)
+{
+    size_t i, j;
+
+    if (journal_split_segment(journal, first)
+        || journal_split_segment(journal, end)) {
+        journal_forget_segments(journal);
+        return;
+    }
+
+    i = journal_find_segment(journal, first);
+    for (j = i; j < journal->num_segments
+                && journal->segments[j].line < end; ++j) {
+    }
+    memmove(journal->segments + i, journal->segments + j,
+            (journal->num_segments - j) * sizeof(*journal->segments));
+    journal->num_segments -= j - i;
+
+    for (j = i; shift && j < journal->num_segments; ++j) {
+        journal->segments[j].line -= shift;
+    }
+}
+
+/* Records that count new lines were added before line. */
+static void journal_add_lines(Journal *journal, size_t line, size_t count)
+{
+    size_t i;
+
+    if (journal_split_segment(journal, line)) {
+        journal_forget_segments(journal);
+        return;
+    }
+
+    for (i = journal_find_segment(journal, line); i < journal->num_segments;
+         ++i) {
+        journal->segments[i].line += count;
+    }
+}
+
+/* Keeps the segments up to date after an edit. */
+static void journal_track_edit(Journal *journal, const TextEdit *edit)
+{
+    const char *p;
+    size_t count = 0;
+
+    switch (edit->type) {
+    case TEXTEDIT_INSERT:
+        for (p = edit->text;
+             (p = memchr(p, '\n', edit->text + edit->num_bytes - p)); ++p) {
+            ++count;
+        }
+        journal_change_lines(journal, edit->line, edit->line + 1, 0);
+        journal_add_lines(journal, edit->line + 1, count);
+        break;
+    case TEXTEDIT_DELETE:
+        journal_change_lines(journal, edit->line, edit->end_line + 1,
+                             edit->end_line - edit->line);
+        break;
+    case TEXTEDIT_SPLIT:
+        journal_change_lines(journal, edit->line, edit->line + 1, 0);
+        journal_add_lines(journal, edit->line + 1, 1);
+        break;
+    case TEXTEDIT_JOIN:
+        journal_change_lines(journal, edit->line, edit->line + 2, 1);
+        break;
+    case TEXTEDIT_INSERT_LINE:
+        journal_add_lines(journal, edit->line, 1);
+        break;
+    case TEXTEDIT_DELETE_LINE:
+        journal_change_lines(journal, edit->line, edit->line + 1, 1);
+        break;
+    case TEXTEDIT_REPLACE_LINE:
+        journal_change_lines(journal, edit->line, edit->line + 1, 0);
+        break;
+    }
+}
+
+/* The listener that records the edits made to the buffer. */
+static void journal_record_edit(void *data, TextBuffer *buf,
+                                const TextEdit *edit)
+{
+    Journal *journal = data;
+    size_t start = journal->num_pending;
+
+    (void) buf;
+
+    journal_track_edit(journal, edit);
+
+    if (start == 0) {
+        journal->pending_since = current_ms();
+    }
+    if (edit->num_bytes > UINT32_MAX / 2
+        || journal_begin_record(journal, JOURNAL_EDIT + edit->type)
+        || journal_put_number(journal, edit->line)
+        || journal_put_number(journal, edit->col)
+        || journal_put_number(journal, edit->end_line)
+        || journal_put_number(journal, edit->end_col)
+        || journal_put_number(journal, edit->num_bytes)
+        || journal_put(journal, edit->text, edit->num_bytes)) {
+        /* the next commit writes a checkpoint that includes this edit */
+        journal->num_pending = start;
+        journal->broken = 1;
+        return;
+    }
+    journal_end_record(journal, start);
+}
+
+/* Writes all of pending to fd. Returns 0 on success. */
+static int journal_write_pending(Journal *journal, int fd)
+{
+    size_t written = 0;
+
+    while (written < journal->num_pending) {
+        ssize_t n = write(fd, journal->pending + written,
+                          journal->num_pending - written);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            return 1;
+        }
+        written += n;
+    }
+    journal->num_pending = 0;
+    return 0;
+}
+
+/* Gets the description of the edited file that the base record holds. A
+ * file that doesn't exist is described with zeros, which no file on disk
+ * matches. Returns 0 on success. */
+static int journal_stat(const char *filename, struct stat *st)
+{
+    if (stat(filename, st) == 0) {
+        return 0;
+    } else if (errno != ENOENT) {
+        return 1;
+    }
+    memset(st, 0, sizeof(*st));
+    return 0;
+}
+
+/* Adds the record that describes the edited file to pending. */
+static int journal_put_base(Journal *journal)
+{
+    size_t start = journal->num_pending;
+
+    if (journal_begin_record(journal, JOURNAL_BASE)
+        || journal_put_number(journal, journal->base.st_size)
+        || journal_put_number(journal, journal->base.st_mtim.tv_sec)
+        || journal_put_number(journal, journal->base.st_mtim.tv_nsec)
+        || journal_put_number(journal, journal->base.st_ino)) {
+        return 1;
+    }
+    journal_end_record(journal, start);
+    return 0;
+}
+
+/* Adds the lines [first, end[ of the buffer to pending as text records. */
+static int journal_put_text(Journal *journal, size_t first, size_t end)
+{
+    TextBuffer *buf = journal->buf;
+
+    while (first < end) {
+        size_t last = end - first > CHECKPOINT_TEXT_LINES
+                      ? first + CHECKPOINT_TEXT_LINES - 1 : end - 1;
+        size_t last_col = textbuf_line_length(buf, last);
+        size_t size = textbuf_get_text(buf, first, 0, last, last_col, NULL, 0);
+        size_t start = journal->num_pending;
+
+        if (journal_begin_record(journal, JOURNAL_CHECKPOINT_TEXT)
+            || journal_put_number(journal, last - first + 1)
+            || journal_put_number(journal, size)
+            || journal_reserve(journal, size)) {
+            return 1;
+        }
+        textbuf_get_text(buf, first, 0, last, last_col,
+                         journal->pending + journal->num_pending, size);
+        journal->num_pending += size;
+        journal_end_record(journal, start);
+        first = last + 1;
+    }
+    return 0;
+}
+
+/* Adds a record of lines that are the same as in the file to pending. */
+static int journal_put_lines(Journal *journal, const JournalSegment *seg)
+{
+    size_t start = journal->num_pending;
+
+    if (journal_begin_record(journal, JOURNAL_CHECKPOINT_LINES)
+        || journal_put_number(journal, seg->base_line)
+        || journal_put_number(journal, seg->count)) {
+        return 1;
+    }
+    journal_end_record(journal, start);
+    return 0;
+}
+
+int journal_checkpoint(Journal *journal)
+{
+    TextBuffer *buf;
+    char *tmpname;
+    size_t line = 0;
+    size_t file_size = 0;
+    size_t start;
+    size_t i;
+    int fd;
+    int failed = 0;
+
+    assert(journal != NULL);
+
+    buf = journal->buf;
+
+    /* the checkpoint is written next to the old journal and renamed over
+     * it, so there's always a complete journal */
+    if (!(tmpname = malloc(strlen(journal->path) + 5))) {
+        return 1;
+    }
+    sprintf(tmpname, "%s.new", journal->path);
+    if ((fd = open(tmpname, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) {
+        free(tmpname);
+        return 1;
+    }
+
+    /* the edits waiting in pending are part of the checkpoint */
+    journal->num_pending = 0;
+    failed = journal_put(journal, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE)
+             || journal_put_base(journal);
+
+    for (i = 0; i <= journal->num_segments && !failed; ++i) {
+        const JournalSegment *seg = i < journal->num_segments
+                                    ? &journal->segments[i] : NULL;
+        size_t end = seg ? seg->line : buf->num_lines;
+
+        failed = journal_put_text(journal, line, end)
+                 || (seg && journal_put_lines(journal, seg));
+        if (seg) {
+            line = seg->line + seg->count;
+        }
+
+        /* big checkpoints are written in parts */
+        if (!failed && journal->num_pending >= JOURNAL_COMMIT_SIZE) {
+            file_size += journal->num_pending;
+            failed = journal_write_pending(journal, fd);
+        }
+    }
+
+    start = journal->num_pending;
+    if (!failed && !(failed = journal_begin_record(journal,
+                                                   JOURNAL_CHECKPOINT_END))) {
+        journal_end_record(journal, start);
+        file_size += journal->num_pending;
+        failed = journal_write_pending(journal, fd);
+    }
+
+    if (failed || fdatasync(fd) != 0 || rename(tmpname, journal->path) != 0) {
+        close(fd);
+        unlink(tmpname);
+        free(tmpname);
+        journal->num_pending = 0;
+        journal->broken = 1;
+        return 1;
+    }
+    free(tmpname);
+
+    if (journal->fd != -1) {
+        close(journal->fd);
+    }
+    journal->fd = fd;
+    journal->file_size = file_size;
+    journal->checkpoint_size = file_size;
+    journal->broken = 0;
+    return 0;
+}
+
+/* Returns the name of the journal of a file in a dynamically allocated
+ * string, or NULL in case of error. The journal of dir/name is
+ * dir/.name.journal. */
+static char *journal_path(const char *filename)
+{
+    const char *base = strrchr(filename, '/');
+    char *path;
+
+    base = base ? base + 1 : filename;
+    if ((path = malloc(strlen(filename) + 10))) {
+        sprintf(path, "%.*s.%s.journal", (int) (base - filename), filename,
+                base);
+    }
+    return path;
+}
+
+Journal *journal_open(TextBuffer *buf, const char *filename)
+{
+    Journal *journal;
+
+    assert(buf != NULL);
+    assert(filename != NULL);
+
+    if (!(journal = calloc(1, sizeof(*journal)))) {
+        return NULL;
+    }
+    journal->buf = buf;
+    journal->fd = -1;
+    journal->filename = malloc(strlen(filename) + 1);
+    journal->path = journal_path(filename);
+    if (!journal->filename || !journal->path
+        || journal_stat(filename, &journal->base)
+        || textbuf_add_listener(buf, journal_record_edit, journal)) {
+        free(journal->filename);
+        free(journal->path);
+        free(journal);
+        return NULL;
+    }
+    strcpy(journal->filename, filename);
+
+    /* at first every line is the same as in the file */
+    journal_reset_segments(journal);
+    return journal;
+}
+
+int journal_exists(const char *filename)
+{
+    char *path;
+    struct stat st;
+    int exists;
+
+    assert(filename != NULL);
+
+    if (!(path = journal_path(filename))) {
+        return 0;
+    }
+    exists = stat(path, &st) == 0;
+    free(path);
+    return exists;
+}
+
+/* Reads the whole journal file into memory. Returns NULL in case of error,
+ * or if there's no journal. */
+static char *journal_read_file(const char *path, size_t *size)
+{
+    struct stat st;
+    char *data;
+    size_t num_read = 0;
+    int fd;
+
+    if ((fd = open(path, O_RDONLY)) == -1) {
+        return NULL;
+    }
+    if (fstat(fd, &st) != 0 || !(data = malloc(st.st_size + 1))) {
+        close(fd);
+        return NULL;
+    }
+    while (num_read < (size_t) st.st_size) {
+        ssize_t n = read(fd, data + num_read, st.st_size - num_read);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            break;
+        }
+        num_read += n;
+    }
+    close(fd);
+    *size = num_read;
+    return data;
+}
+
+/* Checks that the journal was written for the file as it is now. */
+static int journal_check_base(const Journal *journal, const char *p,
+                              const char *end)
+{
+    uint64_t size, sec, nsec, ino;
+
+    return *p++ == JOURNAL_BASE && !journal_get_number(&p, end, &size)
+           && !journal_get_number(&p, end, &sec)
+           && !journal_get_number(&p, end, &nsec)
+           && !journal_get_number(&p, end, &ino)
+           && size == (uint64_t) journal->base.st_size
+           && sec == (uint64_t) journal->base.st_mtim.tv_sec
+           && nsec == (uint64_t) journal->base.st_mtim.tv_nsec
+           && ino == (uint64_t) journal->base.st_ino;
+}
+
+/* Makes room for a line before line pos. If pos is one past the last line,
+ * a line is added to the end. Returns 0 on success. */
+static int journal_open_line(TextBuffer *buf, size_t pos)
+{
+    if (pos < buf->num_lines) {
+        return textbuf_insert_text(buf, pos, 0, "\n", 1);
+    }
+    return textbuf_insert_text(buf, pos - 1, textbuf_line_length(buf, pos - 1),
+                               "\n", 1);
+}
+
+/* Turns the buffer, which holds the file, into the buffer described by a
+ * checkpoint. The lines before line *pos are done, and the lines from *pos
+ * on are the lines of the file starting from *base_line. */
+static int journal_apply_checkpoint(TextBuffer *buf, const char *p,
+                                    const char *end, size_t *pos,
+                                    size_t *base_line)
+{
+    uint64_t first, count, num_bytes;
+    size_t last;
+
+    switch (*p++) {
+    case JOURNAL_CHECKPOINT_LINES:
+        if (journal_get_number(&p, end, &first)
+            || journal_get_number(&p, end, &count) || first < *base_line
+            || *pos + (first - *base_line) + count > buf->num_lines) {
+            return 1;
+        }
+        /* the lines of the file that aren't in the buffer anymore */
+        if (first > *base_line
+            && textbuf_delete_text(buf, *pos, 0,
+                                   *pos + (first - *base_line), 0)) {
+            return 1;
+        }
+        *pos += count;
+        *base_line = first + count;
+        return 0;
+    case JOURNAL_CHECKPOINT_TEXT:
+        if (journal_get_number(&p, end, &count)
+            || journal_get_number(&p, end, &num_bytes)
+            || num_bytes != (uint64_t) (end - p) || count == 0) {
+            return 1;
+        }
+        /* the lines must be where the later records expect them */
+        for (first = 1, last = 0; last < num_bytes; ++last) {
+            first += p[last] == '\n';
+        }
+        if (first != count) {
+            return 1;
+        }
+        if (journal_open_line(buf, *pos)
+            || textbuf_insert_text(buf, *pos, 0, p, num_bytes)) {
+            return 1;
+        }
+        *pos += count;
+        return 0;
+    case JOURNAL_CHECKPOINT_END:
+        /* the rest of the file isn't in the buffer */
+        if (*pos == 0 || *pos > buf->num_lines) {
+            return 1;
+        } else if (*pos < buf->num_lines) {
+            last = buf->num_lines - 1;
+            return textbuf_delete_text(buf, *pos - 1,
+                                       textbuf_line_length(buf, *pos - 1),
+                                       last, textbuf_line_length(buf, last));
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* Makes an edit that was read from a journal. Returns 0 on success. */
+static int journal_apply_edit(TextBuffer *buf, const char *p, const char *end)
+{
+    uint64_t line, col, end_line, end_col, num_bytes;
+    unsigned char type = *p++;
+    TextLine *tmp;
+
+    if (journal_get_number(&p, end, &line)
+        || journal_get_number(&p, end, &col)
+        || journal_get_number(&p, end, &end_line)
+        || journal_get_number(&p, end, &end_col)
+        || journal_get_number(&p, end, &num_bytes)
+        || num_bytes != (uint64_t) (end - p)) {
+        return 1;
+    }
+
+    switch (type - JOURNAL_EDIT) {
+    case TEXTEDIT_INSERT:
+        return textbuf_insert_text(buf, line, col, p, num_bytes);
+    case TEXTEDIT_DELETE:
+        return textbuf_delete_text(buf, line, col, end_line, end_col);
+    case TEXTEDIT_SPLIT:
+        return textbuf_split_line(buf, line, col);
+    case TEXTEDIT_JOIN:
+        return textbuf_join_with_next_line(buf, line);
+    case TEXTEDIT_INSERT_LINE:
+    case TEXTEDIT_REPLACE_LINE:
+        if (!(tmp = textline_init_len(p, num_bytes))) {
+            return 1;
+        }
+        if ((type - JOURNAL_EDIT == TEXTEDIT_INSERT_LINE
+             ? textbuf_insert_line(buf, tmp, line)
+             : textbuf_replace_line(buf, tmp, line))) {
+            textline_free(tmp);
+            return 1;
+        }
+        return 0;
+    case TEXTEDIT_DELETE_LINE:
+        return textbuf_delete_line(buf, line);
+    }
+    return 1;
+}
+
+int journal_replay(Journal *journal)
+{
+    const char *payload;
+    size_t payload_size;
+    size_t size;
+    size_t pos = JOURNAL_MAGIC_SIZE;
+    size_t line = 0;
+    size_t base_line = 0;
+    char *data;
+    int failed = 0;
+
+    assert(journal != NULL);
+
+    if (!(data = journal_read_file(journal->path, &size))) {
+        return errno != ENOENT;
+    }
+
+    /* The checkpoint must be complete before anything is changed. It was
+     * renamed into place in one go, so it's only incomplete if the journal
+     * is damaged. */
+    if (size < JOURNAL_MAGIC_SIZE
+        || memcmp(data, JOURNAL_MAGIC, JOURNAL_MAGIC_SIZE) != 0
+        || journal_get_record(data, size, &pos, &payload, &payload_size)
+        || !journal_check_base(journal, payload, payload + payload_size)) {
+        failed = 1;
+    }
+    while (!failed && payload[0] != JOURNAL_CHECKPOINT_END) {
+        failed = journal_get_record(data, size, &pos, &payload,
+                                    &payload_size);
+    }
+    if (failed) {
+        char *old = malloc(strlen(journal->path) + 5);
+        if (old) {
+            sprintf(old, "%s.old", journal->path);
+            rename(journal->path, old);
+            free(old);
+        }
+        free(data);
+        return 1;
+    }
+
+    pos = JOURNAL_MAGIC_SIZE;
+    journal_get_record(data, size, &pos, &payload, &payload_size);
+    do {
+        journal_get_record(data, size, &pos, &payload, &payload_size);
+        failed = journal_apply_checkpoint(journal->buf, payload,
+                                          payload + payload_size, &line,
+                                          &base_line);
+    } while (!failed && payload[0] != JOURNAL_CHECKPOINT_END);
+
+    /* the edits after the checkpoint are made until one is incomplete */
+    while (!failed
+           && !journal_get_record(data, size, &pos, &payload, &payload_size)
+           && (unsigned char) payload[0] >= JOURNAL_EDIT
+           && !journal_apply_edit(journal->buf, payload,
+                                  payload + payload_size)) {
+    }
+    free(data);
+
+    /* the recovered buffer is the new starting point */
+    return journal_checkpoint(journal) || failed;
+}
+
+long journal_commit_due(const Journal *journal)
+{
+    unsigned long elapsed;
+
+    assert(journal != NULL);
+
+    if (journal->broken || journal->num_pending >= JOURNAL_COMMIT_SIZE) {
+        return 0;
+    } else if (journal->num_pending == 0) {
+        return -1;
+    }
+
+    elapsed = current_ms() - journal->pending_since;
+    return elapsed >= JOURNAL_COMMIT_DELAY ? 0
+                                           : JOURNAL_COMMIT_DELAY - elapsed;
+}
+
+int journal_commit(Journal *journal)
+{
+    size_t new_size;
+
+    assert(journal != NULL);
+
+    new_size = journal->file_size + journal->num_pending;
+    if (journal->fd == -1 || journal->broken
+        || (new_size > JOURNAL_COMPACT_SIZE
+            && new_size - journal->checkpoint_size
+               > journal->checkpoint_size)) {
+        return journal_checkpoint(journal);
+    } else if (journal->num_pending == 0) {
+        return 0;
+    }
+
+    /* a failed write may leave half a record behind, so the next commit
+     * starts over with a checkpoint */
+    new_size = journal->num_pending;
+    if (journal_write_pending(journal, journal->fd)
+        || fdatasync(journal->fd) != 0) {
+        journal->num_pending = 0;
+        journal->broken = 1;
+        return 1;
+    }
+    journal->file_size += new_size;
+    return 0;
+}
+
+int journal_restart(Journal *journal)
+{
+    assert(journal != NULL);
+
+    if (journal_stat(journal->filename, &journal->base)) {
+        return 1;
+    }
+    journal_reset_segments(journal);
+    return journal_checkpoint(journal);
+}
+
+void journal_free(Journal *journal)
+{
+    if (!journal) {
+        return;
+    }
+
+    textbuf_remove_listener(journal->buf, journal_record_edit, journal);
+    if (journal->fd != -1) {
+        close(journal->fd);
+        unlink(journal->path);
+    }
+    free(journal->pending);
+    free(journal->segments);
+    free(journal->filename);
+    free(journal->path);
+    free(journal);
+}
@@ -0,0 +1,101 @@
+/**
+ * @file journal.h
+ * @author dreamyeyed
+ *
+ * A Journal keeps the edits made to a buffer in a file next to the file
+ * being edited, so that they can be recovered if loony is killed before
+ * the buffer has been saved. The journal is only ever appended to: every
+ * edit becomes a small record, and records are written and flushed to disk
+ * in groups so that typing doesn't cost a flush per key.
+ *
+ * A journal begins with a checkpoint that describes the whole buffer as
+ * ranges of lines of the file plus the text of the lines that differ from
+ * it, so its size depends on how much has been changed and not on the size
+ * of the file. When the records after it grow big, a new checkpoint is
+ * written to replace them.
+ */
+#pragma once
+
+#include <stddef.h>
+
+#include "textbuf.h"
+
+typedef struct Journal Journal;
+
+/**
+ * Starts keeping a journal of the edits made to a buffer. The buffer must
+ * hold the whole file as it is on disk, or be as textbuf_init left it if
+ * the file doesn't exist yet. Nothing is written until the first call to
+ * journal_replay, journal_checkpoint or journal_commit.
+ *
+ * @param buf the buffer; the journal must be freed before it
+ * @param filename name of the file that was loaded into the buffer
+ * @return pointer to a dynamically allocated Journal, or NULL in case of
+ * error
+ */
+Journal *journal_open(TextBuffer *buf, const char *filename);
+
+/**
+ * Tells whether a file has a journal left behind by an earlier session.
+ *
+ * @param filename name of the edited file
+ * @return non-zero if there's a journal
+ */
+int journal_exists(const char *filename);
+
+/**
+ * Makes the edits in a journal left behind by an earlier session again. The
+ * edits are also recorded in the new journal. A journal that was written
+ * for another version of the file isn't used; it's renamed so that it isn't
+ * lost. If the end of the journal is incomplete, the edits before it are
+ * made.
+ *
+ * @param journal
+ * @return 0 on success or if there's no journal, non-zero if the journal
+ * couldn't be used
+ */
+int journal_replay(Journal *journal);
+
+/**
+ * Returns how many milliseconds there are until the edits that haven't been
+ * written should be committed with journal_commit.
+ *
+ * @param journal
+ * @return the time in milliseconds, 0 if they should be committed now, or
+ * -1 if there's nothing to commit
+ */
+long journal_commit_due(const Journal *journal);
+
+/**
+ * Writes the edits that have been recorded since the last commit to the
+ * journal and waits until they are on the disk. If the journal has grown
+ * big, a checkpoint is written instead.
+ *
+ * @param journal
+ * @return 0 on success, non-zero otherwise
+ */
+int journal_commit(Journal *journal);
+
+/**
+ * Replaces the journal with a checkpoint of the buffer as it is now.
+ *
+ * @param journal
+ * @return 0 on success, non-zero otherwise
+ */
+int journal_checkpoint(Journal *journal);
+
+/**
+ * Starts the journal from the beginning after the buffer has been saved, so
+ * that the file on disk is the new starting point.
+ *
+ * @param journal
+ * @return 0 on success, non-zero otherwise
+ */
+int journal_restart(Journal *journal);
+
+/**
+ * Stops keeping a journal and removes the journal file.
+ *
+ * @param journal
+ */
+void journal_free(Journal *journal);
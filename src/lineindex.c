@@ -0,0 +1,239 @@
+/*
+ * lineindex.c
+ *
+ * An implicit treap of TextLines. See lineindex.h.
+ */
+
+#include "lineindex.h"
+
+#include <assert.h>
+#include <stdlib.h>
+
+/* Returns the number of lines in the subtree rooted at node. */
+static size_t subtree_size(const TextLine *node)
+{
+    return node ? node->subtree_size : 0;
+}
+
+/* Returns the number of lines that node stands for. */
+static size_t node_size(const TextLine *node)
+{
+    return node->source ? node->run_length : 1;
+}
+
+static void update_size(TextLine *node)
+{
+    node->subtree_size = node_size(node) + subtree_size(node->left)
+                                         + subtree_size(node->right);
+}
+
+/* A small xorshift generator is good enough for treap priorities. */
+static unsigned int next_priority(LineIndex *idx)
+{
+    unsigned int x = idx->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    idx->seed = x;
+    return x;
+}
+
+/* Splits the tree into two trees. The first k lines go to *left and the rest
+ * to *right. k must not fall in the middle of a run of lines. */
+static void split(TextLine *node, size_t k, TextLine **left, TextLine **right)
+{
+    if (!node) {
+        *left = NULL;
+        *right = NULL;
+    } else if (subtree_size(node->left) < k) {
+        assert(subtree_size(node->left) + node_size(node) <= k);
+        split(node->right, k - subtree_size(node->left) - node_size(node),
+              &node->right, right);
+        update_size(node);
+        *left = node;
+    } else {
+        split(node->left, k, left, &node->left);
+        update_size(node);
+        *right = node;
+    }
+}
+
+/* Concatenates two trees. Every line in left comes before every line in
+ * right. */
+static TextLine *merge(TextLine *left, TextLine *right)
+{
+    if (!left) {
+        return right;
+    } else if (!right) {
+        return left;
+    } else if (left->priority > right->priority) {
+        left->right = merge(left->right, right);
+        update_size(left);
+        return left;
+    } else {
+        right->left = merge(left, right->left);
+        update_size(right);
+        return right;
+    }
+}
+
+void lineindex_init(LineIndex *idx)
+{
+    assert(idx != NULL);
+
+    idx->root = NULL;
+    idx->seed = 2463534242u;
+}
+
+size_t lineindex_size(const LineIndex *idx)
+{
+    assert(idx != NULL);
+
+    return subtree_size(idx->root);
+}
+
+TextLine *lineindex_get(const LineIndex *idx, size_t pos, size_t *start)
+{
+    TextLine *node;
+    size_t skipped = 0;
+
+    assert(idx != NULL);
+
+    node = idx->root;
+    while (node) {
+        size_t left_size = subtree_size(node->left);
+        if (pos < left_size) {
+            node = node->left;
+        } else if (pos < left_size + node_size(node)) {
+            if (start) {
+                *start = skipped + left_size;
+            }
+            return node;
+        } else {
+            pos -= left_size + node_size(node);
+            skipped += left_size + node_size(node);
+            node = node->right;
+        }
+    }
+
+    return NULL;
+}
+
+void lineindex_insert(LineIndex *idx, TextLine *line, size_t pos)
+{
+    TextLine *left, *right;
+
+    assert(idx != NULL);
+    assert(line != NULL);
+    assert(pos <= lineindex_size(idx));
+
+    line->left = NULL;
+    line->right = NULL;
+    line->priority = next_priority(idx);
+    update_size(line);
+
+    split(idx->root, pos, &left, &right);
+    idx->root = merge(merge(left, line), right);
+}
+
+int lineindex_insert_list(LineIndex *idx, TextLine *first, size_t count,
+                          size_t pos)
+{
+    TextLine **stack;
+    TextLine *line = first;
+    TextLine *left, *right;
+    size_t depth = 0;
+    size_t i;
+
+    assert(idx != NULL);
+    assert(pos <= lineindex_size(idx));
+
+    if (count == 0) {
+        return 0;
+    }
+
+    /* The tree is built from left to right. The stack holds its rightmost
+     * path, which is O(log n) long on average but can't be longer than n. */
+    if (!(stack = malloc(count * sizeof(*stack)))) {
+        return 1;
+    }
+
+    for (i = 0; i < count; ++i, line = line->next) {
+        TextLine *popped = NULL;
+
+        line->left = NULL;
+        line->right = NULL;
+        line->priority = next_priority(idx);
+
+        /* lines with lower priorities become the left subtree */
+        while (depth > 0 && stack[depth-1]->priority < line->priority) {
+            popped = stack[--depth];
+            update_size(popped);
+        }
+        line->left = popped;
+        if (depth > 0) {
+            stack[depth-1]->right = line;
+        }
+        stack[depth++] = line;
+    }
+
+    while (depth > 1) {
+        update_size(stack[--depth]);
+    }
+    update_size(stack[0]);
+
+    split(idx->root, pos, &left, &right);
+    idx->root = merge(merge(left, stack[0]), right);
+    free(stack);
+    return 0;
+}
+
+TextLine *lineindex_remove(LineIndex *idx, size_t pos)
+{
+    TextLine *left, *middle, *right;
+
+    assert(idx != NULL);
+
+    if (pos >= lineindex_size(idx)) {
+        return NULL;
+    }
+
+    split(idx->root, pos, &left, &right);
+    middle = right;
+    while (middle->left) {
+        middle = middle->left;
+    }
+    split(right, node_size(middle), &middle, &right);
+    idx->root = merge(left, right);
+
+    middle->left = NULL;
+    middle->right = NULL;
+    update_size(middle);
+    return middle;
+}
+
+void lineindex_remove_range(LineIndex *idx, size_t pos, size_t count)
+{
+    TextLine *left, *middle, *right;
+
+    assert(idx != NULL);
+    assert(pos + count <= lineindex_size(idx));
+
+    split(idx->root, pos, &left, &right);
+    split(right, count, &middle, &right);
+    idx->root = merge(left, right);
+}
+
+TextLine *lineindex_replace(LineIndex *idx, TextLine *line, size_t pos)
+{
+    TextLine *old;
+
+    assert(idx != NULL);
+    assert(line != NULL);
+
+    if (!(old = lineindex_remove(idx, pos))) {
+        return NULL;
+    }
+    lineindex_insert(idx, line, pos);
+    return old;
+}
@@ -0,0 +1,104 @@
+/**
+ * @file lineindex.h
+ * @author dreamyeyed
+ *
+ * A LineIndex keeps the TextLines of a buffer in a balanced search tree that
+ * is keyed by line number. The tree is a treap with implicit keys: every node
+ * knows how many lines there are in its subtree, so the nth line can be found
+ * by walking down from the root. Finding, inserting and removing a line take
+ * O(log n) expected time.
+ *
+ * A TextLine that stands for a run of unmodified lines (see textbuf.h) counts
+ * as run_length lines. Positions given to the functions below must be at the
+ * start of a TextLine, never in the middle of a run.
+ *
+ * The tree fields live inside the TextLine itself, so the index doesn't need
+ * any allocations of its own.
+ */
+#pragma once
+
+#include <stddef.h>
+
+#include "textbuf.h"
+
+/**
+ * Initializes an empty index.
+ *
+ * @param idx
+ */
+void lineindex_init(LineIndex *idx);
+
+/**
+ * Returns the number of lines in an index.
+ *
+ * @param idx
+ * @return number of lines
+ */
+size_t lineindex_size(const LineIndex *idx);
+
+/**
+ * Finds a line in an index.
+ *
+ * @param idx
+ * @param pos index of the line
+ * @param start If this isn't NULL, the index of the first line of the
+ * returned TextLine is stored here. It is smaller than pos if the line is in
+ * the middle of a run.
+ * @return the TextLine that contains the line, or NULL if pos is out of range
+ */
+TextLine *lineindex_get(const LineIndex *idx, size_t pos, size_t *start);
+
+/**
+ * Inserts a line in an index.
+ *
+ * @param idx
+ * @param line the line to be inserted
+ * @param pos The index of the new line. It must be in the range [0, n], where
+ * n is the number of lines in the index.
+ */
+void lineindex_insert(LineIndex *idx, TextLine *line, size_t pos);
+
+/**
+ * Inserts several lines in an index at once. The lines are given as a list
+ * that is linked with their next pointers. Building a tree of the new lines
+ * takes O(n) expected time and joining it to the index O(log n).
+ *
+ * @param idx
+ * @param first the first line to be inserted
+ * @param count number of TextLines in the list
+ * @param pos the index of the first new line; see lineindex_insert()
+ * @return 0 on success, non-zero if there wasn't enough memory
+ */
+int lineindex_insert_list(LineIndex *idx, TextLine *first, size_t count,
+                          size_t pos);
+
+/**
+ * Removes a line from an index. The line itself isn't freed.
+ *
+ * @param idx
+ * @param pos index of the first line of the TextLine to be removed
+ * @return the removed line, or NULL if pos is out of range
+ */
+TextLine *lineindex_remove(LineIndex *idx, size_t pos);
+
+/**
+ * Removes a range of lines from an index in O(log n) time. The lines
+ * themselves aren't freed.
+ *
+ * @param idx
+ * @param pos index of the first line to be removed
+ * @param count number of lines to remove; pos + count must be at the start of
+ * a TextLine or at the end of the index
+ */
+void lineindex_remove_range(LineIndex *idx, size_t pos, size_t count);
+
+/**
+ * Replaces the line at the given position with another line. The old line
+ * isn't freed.
+ *
+ * @param idx
+ * @param line the new line
+ * @param pos index of the first line of the TextLine to be replaced
+ * @return the old line, or NULL if pos is out of range
+ */
+TextLine *lineindex_replace(LineIndex *idx, TextLine *line, size_t pos);
@@ -5,29 +5,423 @@
  */
 
 #include <ctype.h>
+#include <limits.h>
 #include <locale.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <unistd.h>
+
+#include <fcntl.h>
 
 #include <curses.h>
 
 #include "cursesio.h"
+#include "filewatch.h"
+#include "journal.h"
+#include "regsearch.h"
 #include "textbuf.h"
+#include "trigram.h"
+#include "undo.h"
+
+/* how often the screen is updated while a file is being loaded */
+#define LOAD_POLL_INTERVAL 100
+/* how often a followed file is checked if the system can't tell when it
+ * changes */
+#define FOLLOW_POLL_INTERVAL 500
+/* how many megabytes the undo history may use by default */
+#define DEFAULT_UNDO_LIMIT 64
+/* Ctrl-R */
+#define REDO_KEY 18
+/* how often the progress of a regex search is shown */
+#define SEARCH_POLL_INTERVAL 100
+/* how often a regex search or the trigram index is polled while its
+ * threads wait for lines to be copied */
+#define COPY_POLL_INTERVAL 5
+
+/* A regex search that runs in the background while keys are read. */
+typedef struct RegexState
+{
+    /** the search, or NULL if none is running */
+    RegexSearch *search;
+    /** what it looks for */
+    RegexSearchMode mode;
+    /** non-zero if the search was cancelled and its threads are stopping */
+    int cancelled;
+    /** non-zero if the threads are waiting for regsearch_poll to copy lines */
+    int copying;
+    /** the last regex, which ignores case if it starts with \c */
+    char pattern[STATUSBAR_LENGTH];
+} RegexState;
+
+/* Returns non-zero if the key is a command that changes the buffer. */
+static int is_edit_key(int ch)
+{
+    return ch == 'w' || ch == 'i' || ch == 'o' || ch == 'O' || ch == 'd'
+           || ch == 'x' || ch == 'u' || ch == REDO_KEY
+           || ch == KEY_PASTE_BEGIN;
+}
+
+/* Writes the edits made in insert mode to the journal when they are due,
+ * since the main loop doesn't run until insert mode ends. The timeouts that
+ * the main loop set, such as the one for polling a regex search, are
+ * dropped, and so is the wake fd of a followed file: the text appended to it
+ * is added when insert mode ends. data points to the Journal pointer. See
+ * LoonyWaitFn. */
+static void insert_wait(void *data, LoonyWindow *win)
+{
+    Journal *journal = *(Journal **) data;
+    long due = journal ? journal_commit_due(journal) : -1;
+
+    loonywin_set_wake_fd(win, -1);
+
+    if (due == 0) {
+        if (journal_commit(journal)) {
+            loonywin_set_statusbar(win, "Couldn't write the journal");
+        }
+        due = journal_commit_due(journal);
+    }
+    loonywin_set_key_timeout(win, due > 0 ? due : -1);
+}
+
+/* Saves the buffer and describes the result in status. Returns 0 on
+ * success. */
+static int save_file(TextBuffer *tbuf, const char *filename, char *status)
+{
+    double mb;
+
+    if (textbuf_save_file(tbuf, filename)) {
+        snprintf(status, STATUSBAR_LENGTH, "Couldn't write %s", filename);
+        return 1;
+    }
+
+    mb = tbuf->saved_bytes / 1e6;
+    if (tbuf->save_seconds > 0) {
+        snprintf(status, STATUSBAR_LENGTH,
+                 "Wrote %zu bytes in %.1f ms (%.0f MB/s)", tbuf->saved_bytes,
+                 tbuf->save_seconds * 1000, mb / tbuf->save_seconds);
+    } else {
+        snprintf(status, STATUSBAR_LENGTH, "Wrote %zu bytes",
+                 tbuf->saved_bytes);
+    }
+    return 0;
+}
+
+/* Moves the cursor to the next match of a pattern, or to the previous one if
+ * backward is non-zero, and describes the result in status. The blocks of
+ * the trigram index that edits have changed are indexed again afterwards. */
+static void find_pattern(LoonyWindow *win, TrigramIndex *trigrams,
+                         const SearchPattern *pat, int backward, char *status)
+{
+    TextBuffer *tbuf = win->buffer;
+    size_t line = tbuf->crow;
+    size_t col = tbuf->ccol;
+    double mb;
+    int len;
+
+    if (textbuf_search(tbuf, pat, backward, &line, &col)) {
+        len = snprintf(status, STATUSBAR_LENGTH, "Pattern not found");
+    } else {
+        loonywin_move_cursor(win, (int) line - tbuf->crow, INT_MIN);
+        loonywin_move_cursor(win, 0, (int) col);
+        len = snprintf(status, STATUSBAR_LENGTH, "Found at %zu:%zu%s",
+                       line + 1, col + 1,
+                       !tbuf->search_wrapped ? ""
+                       : backward ? ", continued from the bottom"
+                                  : ", continued from the top");
+    }
+
+    /* the speed of short searches would be mostly noise */
+    mb = tbuf->searched_bytes / 1e6;
+    if (mb >= 1 && tbuf->search_seconds > 0 && len > 0
+        && len < STATUSBAR_LENGTH) {
+        snprintf(status + len, STATUSBAR_LENGTH - len,
+                 " (%.1f MB in %.1f ms, %.2f GB/s)", mb,
+                 tbuf->search_seconds * 1000,
+                 mb / 1000 / tbuf->search_seconds);
+    }
+
+    if (trigrams) {
+        trigram_refresh(trigrams);
+    }
+}
+
+/* Asks for a pattern to search for. A pattern that starts with \c ignores
+ * the case of ASCII letters. Returns 0 if pat was replaced with a new
+ * pattern. */
+static int read_pattern(LoonyWindow *win, SearchPattern *pat, int backward,
+                        char *status)
+{
+    char text[STATUSBAR_LENGTH];
+    SearchPattern new_pat;
+    const char *start = text;
+    int ignore_case = 0;
+
+    if (read_prompt(win, backward ? "?" : "/", text, sizeof(text))) {
+        return 1;
+    }
+    if (strncmp(text, "\\c", 2) == 0) {
+        start += 2;
+        ignore_case = 1;
+    }
+    if (search_pattern_init(&new_pat, start, strlen(start), ignore_case)) {
+        strcpy(status, "Invalid pattern");
+        return 1;
+    }
+    search_pattern_free(pat);
+    *pat = new_pat;
+    return 0;
+}
+
+/* Starts searching for the last regex in the background. A search that is
+ * still running is stopped first. */
+static void start_regex(TextBuffer *tbuf, RegexState *regex,
+                        RegexSearchMode mode, char *status)
+{
+    char error[STATUSBAR_LENGTH] = "";
+    const char *pattern = regex->pattern;
+    int ignore_case = 0;
+
+    regsearch_free(regex->search);
+    if (strncmp(pattern, "\\c", 2) == 0) {
+        pattern += 2;
+        ignore_case = 1;
+    }
+    regex->search = regsearch_start(tbuf, pattern, ignore_case, mode,
+                                    tbuf->crow, tbuf->ccol,
+                                    tbuf->load_threads, error, sizeof(error));
+    regex->mode = mode;
+    regex->cancelled = 0;
+    regex->copying = 0;
+    if (!regex->search) {
+        snprintf(status, STATUSBAR_LENGTH, "Invalid regex: %s",
+                 error[0] ? error : "couldn't start the search");
+    }
+}
+
+/* Tells the threads of a regex search to stop without waiting for them. */
+static void cancel_regex(RegexState *regex)
+{
+    if (regex->search && !regex->cancelled) {
+        regsearch_cancel(regex->search);
+        regex->cancelled = 1;
+    }
+}
+
+/* Shows how far a regex search has got in status. When it's over, the
+ * cursor is moved to the match that was found and the search is freed. */
+static void poll_regex(LoonyWindow *win, RegexState *regex, char *status)
+{
+    RegexProgress p;
+    double percent;
+
+    regsearch_poll(regex->search, &p);
+    regex->copying = p.copying;
+    percent = p.num_lines ? 100.0 * p.lines_searched / p.num_lines : 100;
+    if (percent > 100) {
+        percent = 100;
+    }
+
+    if (regex->cancelled) {
+        /* the status already says that the search was cancelled */
+    } else if (p.found) {
+        TextBuffer *tbuf = win->buffer;
+        loonywin_move_cursor(win, (int) p.line - tbuf->crow, INT_MIN);
+        loonywin_move_cursor(win, 0, (int) p.col);
+        snprintf(status, STATUSBAR_LENGTH, "Found at %zu:%zu%s (%.1f ms)",
+                 p.line + 1, p.col + 1,
+                 !p.wrapped ? ""
+                 : regex->mode == REGSEARCH_BACKWARD
+                     ? ", continued from the bottom"
+                     : ", continued from the top",
+                 p.seconds * 1000);
+    } else if (!p.done) {
+        if (regex->mode == REGSEARCH_COUNT) {
+            snprintf(status, STATUSBAR_LENGTH,
+                     "Counting: %zu matches so far, %.0f%% (Esc cancels)",
+                     p.num_matches, percent);
+        } else {
+            snprintf(status, STATUSBAR_LENGTH,
+                     "Searching: %.0f%% (Esc cancels)", percent);
+        }
+        return;
+    } else if (regex->mode == REGSEARCH_COUNT) {
+        snprintf(status, STATUSBAR_LENGTH,
+                 "%zu matches on %zu lines (%.1f ms)", p.num_matches,
+                 p.matched_lines, p.seconds * 1000);
+    } else {
+        strcpy(status, "Pattern not found");
+    }
+
+    if (p.found || p.done) {
+        /* after a match, the threads only have to notice that they can
+         * stop, so this doesn't wait long */
+        regsearch_free(regex->search);
+        regex->search = NULL;
+    }
+}
+
+/* Adds the text that has been appended to the followed file to the buffer.
+ * If the cursor is on the last line, it stays there. Returns non-zero if the
+ * file was loaded again. */
+static int follow_file(LoonyWindow *win, UndoHistory *undo,
+                       RegexState *regex, TrigramIndex *trigrams,
+                       const char *filename, char *status)
+{
+    TextBuffer *tbuf = win->buffer;
+    int at_end = (size_t) tbuf->crow + 1 == tbuf->num_lines;
+    int err = textbuf_append_from_file(tbuf, filename);
+
+    if (err == 2) {
+        /* the file was truncated or replaced, so it's loaded again */
+        if (undo) {
+            undo_clear(undo);
+        }
+        /* the search may still be reading the old text */
+        regsearch_free(regex->search);
+        regex->search = NULL;
+        if (trigrams) {
+            trigram_clear(trigrams);
+        }
+        if (textbuf_load_file_async(tbuf, filename)) {
+            snprintf(status, STATUSBAR_LENGTH, "Couldn't read %s", filename);
+        } else {
+            snprintf(status, STATUSBAR_LENGTH, "%s was loaded again",
+                     filename);
+        }
+        at_end |= (size_t) tbuf->crow >= tbuf->num_lines;
+        loonywin_move_cursor(win, at_end ? INT_MAX : 0, INT_MIN);
+        return 1;
+    } else if (err) {
+        snprintf(status, STATUSBAR_LENGTH, "Couldn't read %s", filename);
+    } else if (at_end) {
+        loonywin_move_cursor(win, INT_MAX, 0);
+    }
+    return 0;
+}
+
+/* Starts reading standard input into the buffer. The terminal is opened as
+ * standard input instead, so that curses can still read keys. Returns 0 on
+ * success. */
+static int load_stdin(TextBuffer *tbuf)
+{
+    int fd = dup(STDIN_FILENO);
+    int tty = open("/dev/tty", O_RDWR);
+
+    if (fd == -1 || tty == -1 || dup2(tty, STDIN_FILENO) == -1
+        || textbuf_load_stream(tbuf, fd)) {
+        if (fd != -1) {
+            close(fd);
+        }
+        if (tty != -1) {
+            close(tty);
+        }
+        return 1;
+    }
+    close(tty);
+    return 0;
+}
 
 int main (int argc, char *argv[])
 {
     TextBuffer *tbuf = textbuf_init();
     LoonyWindow *win;
+    FileWatch *watch = NULL;
+    Journal *journal = NULL;
+    UndoHistory *undo;
+    TrigramIndex *trigrams = NULL;
+    SearchPattern pattern = { NULL, 0, 0 };
+    int last_backward = 0;
+    RegexState regex = { NULL, REGSEARCH_FORWARD, 0, 0, "" };
+    int last_regex = 0;
+    size_t undo_limit = DEFAULT_UNDO_LIMIT;
+    const char *filename;
+    int from_stdin;
+    unsigned long frame_interval = DEFAULT_FRAME_INTERVAL;
+    char status[STATUSBAR_LENGTH] = "Loony ALPHA";
+    int follow = 0;
+    int want_trigrams = 0;
+    /* the index is built when the file has been loaded */
+    int index_pending = 1;
+    /* non-zero while the first build of the index runs */
+    int announce_index = 0;
+    int want_journal;
+    /* non-zero if the last key was an edit that loading didn't allow */
+    int edit_refused = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "f:Fj:mpstu:")) != -1) {
+        if (opt == 'f') {
+            frame_interval = strtoul(optarg, NULL, 10);
+        } else if (opt == 'F') {
+            follow = 1;
+        } else if (opt == 'j') {
+            textbuf_set_load_threads(tbuf, atoi(optarg));
+        } else if (opt == 'm') {
+            textbuf_set_load_mode(tbuf, TEXTBUF_LOAD_MMAP);
+        } else if (opt == 'p') {
+            textbuf_set_load_mode(tbuf, TEXTBUF_LOAD_PIECES);
+        } else if (opt == 's') {
+            textbuf_set_save_sync(tbuf, 1);
+        } else if (opt == 't') {
+            want_trigrams = 1;
+        } else if (opt == 'u') {
+            undo_limit = strtoul(optarg, NULL, 10);
+        } else {
+            textbuf_free(tbuf);
+            return 1;
+        }
+    }
 
-    if (argc != 2) {
-        printf("Loony must be launched with 'loony filename'\n");
+    if (argc - optind != 1) {
+        printf("Loony must be launched with 'loony [-f ms] [-F] [-j threads] [-m | -p] [-s] [-t] [-u mb] filename'\n");
+        textbuf_free(tbuf);
         return 1;
     }
+    filename = argv[optind];
+    from_stdin = strcmp(filename, "-") == 0;
+    /* a followed file changes under the buffer, so its edits can't be
+     * replayed */
+    want_journal = !from_stdin && !follow;
 
-    if (textbuf_load_file(tbuf, argv[1])) {
+    if (want_journal && journal_exists(filename)) {
+        /* the edits of a session that didn't end are made again, which
+         * needs the whole file, or the empty buffer if it's a new file */
+        want_journal = 0;
+        if ((access(filename, F_OK) != 0
+             || !textbuf_load_file(tbuf, filename))
+            && (journal = journal_open(tbuf, filename))) {
+            if (journal_replay(journal)) {
+                snprintf(status, STATUSBAR_LENGTH,
+                         "The journal of %s doesn't match it; renamed it",
+                         filename);
+            } else {
+                snprintf(status, STATUSBAR_LENGTH,
+                         "Recovered unsaved changes to %s", filename);
+            }
+            textbuf_move_cursor(tbuf, INT_MIN, INT_MIN);
+        }
+    } else if (from_stdin) {
+        if (load_stdin(tbuf)) {
+            fprintf(stderr, "Couldn't read standard input\n");
+            textbuf_free(tbuf);
+            return 1;
+        }
+    } else if (textbuf_load_file_async(tbuf, filename)) {
+        TextBufLoadMode mode = tbuf->load_mode;
+        int threads = tbuf->load_threads;
+        /* a new file is journaled from the empty buffer, but the empty
+         * buffer isn't what a file that couldn't be read holds */
+        want_journal = want_journal && access(filename, F_OK) != 0;
         textbuf_free(tbuf);
         tbuf = textbuf_init();
+        textbuf_set_load_mode(tbuf, mode);
+        textbuf_set_load_threads(tbuf, threads);
+    }
+    /* the edits recovered from the journal can't be undone */
+    undo = undo_init(tbuf, undo_limit << 20);
+    if (want_trigrams) {
+        trigrams = trigram_init(tbuf);
     }
 
     /* set the (hopefully) correct locale */
@@ -39,20 +433,151 @@ int main (int argc, char *argv[])
     keypad(stdscr, TRUE);
     noecho();
 
+    start_bracketed_paste();
+
     win = loonywin_init(tbuf, stdscr);
+    loonywin_set_frame_interval(win, frame_interval);
+    loonywin_set_wait_handler(win, insert_wait, &journal);
+    if (follow && !from_stdin) {
+        watch = filewatch_init(filename);
+    }
 
     for (;;) {
         int ch;
+        int loading = textbuf_poll_load(tbuf, 0);
+        /* the progress replaces the status bar, so it also tells why an
+         * edit was ignored */
+        const char *read_only = edit_refused ? "still loading, read only"
+                                             : "read only";
 
-        loonywin_set_statusbar(win, "Loony ALPHA");
-        display_win(win);
+        if (regex.search) {
+            poll_regex(win, &regex, status);
+        }
 
-        ch = getch();
+        /* the rest of the file is added while the user looks at the start */
+        if (loading && from_stdin) {
+            char progress[STATUSBAR_LENGTH];
+            snprintf(progress, sizeof(progress),
+                     "Reading standard input: %zu lines (%s)",
+                     tbuf->num_lines, read_only);
+            loonywin_set_statusbar(win, progress);
+            /* more text wakes get_key up */
+            loonywin_set_key_timeout(win, loading > 1 ? 0 : -1);
+            loonywin_set_wake_fd(win, tbuf->load_fd);
+        } else if (loading) {
+            char progress[STATUSBAR_LENGTH];
+            snprintf(progress, sizeof(progress),
+                     "Loading %s: %.0f%% (%s)", filename,
+                     textbuf_load_progress(tbuf) * 100, read_only);
+            loonywin_set_statusbar(win, progress);
+            /* don't wait for keys if there are lines to be added */
+            loonywin_set_key_timeout(win, loading > 1 ? 0
+                                                      : LOAD_POLL_INTERVAL);
+            loonywin_set_wake_fd(win, -1);
+        } else {
+            /* edits are journaled once the whole file is there */
+            if (want_journal) {
+                want_journal = 0;
+                if (!tbuf->load_failed) {
+                    journal = journal_open(tbuf, filename);
+                }
+            }
+            if (tbuf->load_failed) {
+                snprintf(status, STATUSBAR_LENGTH,
+                         "Couldn't read all of %s",
+                         from_stdin ? "standard input" : filename);
+                tbuf->load_failed = 0;
+            }
+            loonywin_set_statusbar(win, status);
+            loonywin_set_key_timeout(win, -1);
+            /* get_key returns when a followed file changes, or every now
+             * and then if that can't be known; standard input has been
+             * closed */
+            loonywin_set_wake_fd(win, watch ? filewatch_fd(watch) : -1);
+            if (watch && filewatch_fd(watch) == -1) {
+                loonywin_set_key_timeout(win, FOLLOW_POLL_INTERVAL);
+            }
+        }
+        if (trigrams && !loading) {
+            int building;
+            if (index_pending) {
+                index_pending = 0;
+                announce_index = !trigram_refresh(trigrams);
+            }
+            building = trigram_building(trigrams);
+            if (announce_index && !building) {
+                announce_index = 0;
+                snprintf(status, STATUSBAR_LENGTH,
+                         "Indexed %zu lines: %.1f MB",
+                         trigram_indexed_lines(trigrams),
+                         trigram_memory(trigrams) / 1e6);
+                loonywin_set_statusbar(win, status);
+            } else if (building && (win->key_timeout < 0
+                       || win->key_timeout > COPY_POLL_INTERVAL)) {
+                /* the thread waits for the lines that polling copies, and
+                 * the status bar tells when the index is ready */
+                loonywin_set_key_timeout(win, COPY_POLL_INTERVAL);
+            }
+        }
+        if (journal) {
+            /* edits are written in groups: get_key gives up waiting when
+             * the oldest edit that hasn't been written is due */
+            long due = journal_commit_due(journal);
+            if (due == 0) {
+                if (journal_commit(journal)) {
+                    strcpy(status, "Couldn't write the journal");
+                }
+                due = journal_commit_due(journal);
+            }
+            if (due > 0 && (win->key_timeout < 0 || due < win->key_timeout)) {
+                loonywin_set_key_timeout(win, due);
+            }
+        }
+        if (regex.search) {
+            int interval = regex.copying ? COPY_POLL_INTERVAL
+                                         : SEARCH_POLL_INTERVAL;
+            if (win->key_timeout < 0 || win->key_timeout > interval) {
+                loonywin_set_key_timeout(win, interval);
+            }
+        }
+        ch = get_key(win);
+        if (watch && !loading && filewatch_check(watch)) {
+            index_pending |= follow_file(win, undo, &regex, trigrams,
+                                         filename, status);
+        }
+        if (ch == ERR) {
+            continue;
+        }
+        strcpy(status, "Loony ALPHA");
+        edit_refused = 0;
+        /* every command is undone on its own */
+        if (undo) {
+            undo_new_step(undo);
+        }
+
+        /* the results of a search would be for the text before the edit */
+        if (is_edit_key(ch) && ch != 'w') {
+            cancel_regex(&regex);
+        }
 
         if (ch == 'q') {
             goto end;
+        } else if (ch == 27) { /* 27 = escape */
+            if (regex.search && !regex.cancelled) {
+                cancel_regex(&regex);
+                strcpy(status, "Search cancelled");
+            }
+        } else if (loading && is_edit_key(ch)) {
+            if (ch == KEY_PASTE_BEGIN) {
+                skip_paste();
+            }
+            edit_refused = 1;
+        } else if (ch == 'w' && from_stdin) {
+            strcpy(status, "Standard input can't be saved");
         } else if (ch == 'w') {
-            textbuf_save_file(tbuf, argv[1]);
+            if (!save_file(tbuf, filename, status) && journal) {
+                journal_restart(journal);
+            }
         } else if (ch == 'h') {
             loonywin_move_cursor(win, 0, -1);
         } else if (ch == 'l') {
@@ -61,6 +586,8 @@ int main (int argc, char *argv[])
             loonywin_move_cursor(win, 1, 0);
         } else if (ch == 'k') {
             loonywin_move_cursor(win, -1, 0);
+        } else if (ch == KEY_PASTE_BEGIN) {
+            paste_at_cursor(win);
         } else if (ch == 'i') {
             insert_at_cursor(win);
         } else if (ch == 'o') {
@@ -75,11 +602,61 @@ int main (int argc, char *argv[])
             if (tbuf->num_lines != 0) {
                 textbuf_delete_char(tbuf);
             }
+        } else if (ch == 'u' || ch == REDO_KEY) {
+            if (!undo) {
+                strcpy(status, "There's no undo history");
+            } else if (ch == 'u' ? undo_undo(undo) : undo_redo(undo)) {
+                strcpy(status, ch == 'u' ? "Nothing to undo"
+                                         : "Nothing to redo");
+            }
+            loonywin_follow_cursor(win);
+        } else if (ch == '/' || ch == '?') {
+            if (!read_pattern(win, &pattern, ch == '?', status)) {
+                last_backward = ch == '?';
+                last_regex = 0;
+                find_pattern(win, trigrams, &pattern, last_backward, status);
+            }
+        } else if (ch == 'f' || ch == 'F' || ch == 'c') {
+            char text[STATUSBAR_LENGTH];
+            if (!read_prompt(win, ch == 'c' ? "Count: " : "Regex: ",
+                             text, sizeof(text)) && text[0]) {
+                strcpy(regex.pattern, text);
+                last_regex = 1;
+                if (ch != 'c') {
+                    last_backward = ch == 'F';
+                }
+                start_regex(tbuf, &regex,
+                            ch == 'c' ? REGSEARCH_COUNT
+                            : ch == 'F' ? REGSEARCH_BACKWARD
+                                        : REGSEARCH_FORWARD,
+                            status);
+            }
+        } else if (ch == 'n' || ch == 'N') {
+            int backward = last_backward != (ch == 'N');
+            if (regex.search && !regex.cancelled) {
+                /* the next match is found from where this one is */
+                strcpy(status, "Still searching (Esc cancels)");
+            } else if (last_regex) {
+                start_regex(tbuf, &regex,
+                            backward ? REGSEARCH_BACKWARD : REGSEARCH_FORWARD,
+                            status);
+            } else if (!pattern.text) {
+                strcpy(status, "No previous pattern");
+            } else {
+                find_pattern(win, trigrams, &pattern, backward, status);
+            }
         }
     }
 
 end:
+    stop_bracketed_paste();
     endwin();
+    regsearch_free(regex.search);
+    trigram_free(trigrams);
+    search_pattern_free(&pattern);
+    undo_free(undo);
+    journal_free(journal);
+    filewatch_free(watch);
     loonywin_free(win);
     textbuf_free(tbuf);
     return 0;
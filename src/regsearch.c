@@ -0,0 +1,560 @@
+/*
+ * regsearch.c
+ *
+ * Searching for regular expressions with several threads. See regsearch.h.
+ */
+
+/* REG_STARTEND is a GNU extension */
+#define _GNU_SOURCE
+
+#include "regsearch.h"
+
+#include <assert.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "util.h"
+
+/* Number of lines in a task. Tasks are small enough that the threads get
+ * about the same amount of work and that copying one doesn't keep the UI
+ * waiting, and big enough that taking one is rare. */
+#define TASK_LINES (1 << 14)
+/* How many tasks per thread are copied before the threads need them. */
+#define TASKS_AHEAD 3
+/* How many lines a thread searches before it reports its progress and looks
+ * whether it should stop. */
+#define CHECK_LINES 256
+
+/* Lines that a thread searches at once. */
+typedef struct RegexTask
+{
+    /** the lines are first..first+num_lines-1 */
+    size_t first;
+    size_t num_lines;
+    /**
+     * On this line, only matches that begin after (or before, when
+     * searching backward) limit_byte count. (size_t) -1 if there isn't
+     * such a line.
+     */
+    size_t limit_line;
+    size_t limit_byte;
+    /** non-zero if the task continues from the other end of the buffer */
+    int wrapped;
+    /**
+     * copies of the lines made by regsearch_feed; the thread that searches
+     * them frees them
+     */
+    TextBlock *blocks;
+    size_t num_blocks;
+    /** the rest are protected by the lock of the search */
+    int done;
+    int found;
+    size_t line;
+    size_t col;
+} RegexTask;
+
+typedef struct RegexWorker
+{
+    struct RegexSearch *search;
+    /** glibc lets only one thread at a time use a regex_t */
+    regex_t regex;
+    pthread_t thread;
+    /** null terminated copy of a line, if regexec needs one */
+    char *copy;
+    size_t copy_size;
+} RegexWorker;
+
+struct RegexSearch
+{
+    RegexSearchMode mode;
+    TextBuffer *buf;
+    RegexTask *tasks;
+    size_t num_tasks;
+    RegexWorker *workers;
+    /** number of workers with a compiled regex */
+    int num_workers;
+    /** number of workers whose thread was started */
+    int num_started;
+    size_t num_lines;
+    unsigned long start_ms;
+    /** protects everything below */
+    pthread_mutex_t lock;
+    /** signalled when tasks are ready or the threads should stop */
+    pthread_cond_t ready;
+    /** the tasks before this have their lines copied */
+    size_t num_ready;
+    /** the next task to take */
+    size_t next_task;
+    /** index of the first task with a match, or num_tasks */
+    size_t first_found;
+    /** the tasks before this are done and have no match */
+    size_t merged;
+    size_t lines_searched;
+    size_t num_matches;
+    size_t matched_lines;
+    /** number of threads that haven't stopped */
+    int num_running;
+    /** how long the search took, when num_running is 0 */
+    unsigned long ms;
+    int cancel;
+};
+
+/* Finds the next match of the regex in a line of num_bytes bytes, starting
+ * from the byte *pos. The offset where the match begins is stored in *begin
+ * and *pos is moved past the match. Returns 0 if a match was found. */
+static int regsearch_next(RegexWorker *w, const char *line, size_t num_bytes,
+                          size_t *pos, size_t *begin)
+{
+    regmatch_t match;
+
+    if (*pos > num_bytes) {
+        return 1;
+    }
+
+#ifdef REG_STARTEND
+    match.rm_so = *pos;
+    match.rm_eo = num_bytes;
+    if (regexec(&w->regex, line, 1, &match, REG_STARTEND)) {
+        return 1;
+    }
+#else
+    if (w->copy_size < num_bytes + 1) {
+        char *new_copy = realloc(w->copy, num_bytes + 1);
+        if (!new_copy) {
+            return 1;
+        }
+        w->copy = new_copy;
+        w->copy_size = num_bytes + 1;
+    }
+    memcpy(w->copy, line, num_bytes);
+    w->copy[num_bytes] = '\0';
+    if (regexec(&w->regex, w->copy + *pos, 1, &match,
+                *pos > 0 ? REG_NOTBOL : 0)) {
+        return 1;
+    }
+    match.rm_so += *pos;
+    match.rm_eo += *pos;
+#endif
+
+    *begin = match.rm_so;
+    /* an empty match would be found again at the same place */
+    *pos = match.rm_eo > match.rm_so ? (size_t) match.rm_eo
+                                     : (size_t) match.rm_eo + 1;
+    return 0;
+}
+
+/* Adds the progress of a task to the totals. Returns non-zero if the task
+ * should stop. */
+static int regsearch_report(RegexSearch *search, size_t index,
+                            size_t *lines, size_t *matches,
+                            size_t *matched_lines)
+{
+    int stop;
+
+    pthread_mutex_lock(&search->lock);
+    search->lines_searched += *lines;
+    search->num_matches += *matches;
+    search->matched_lines += *matched_lines;
+    stop = search->cancel || index > search->first_found;
+    pthread_mutex_unlock(&search->lock);
+
+    *lines = *matches = *matched_lines = 0;
+    return stop;
+}
+
+/* Searches the lines of a task and frees their copies. */
+static void regsearch_task(RegexWorker *w, size_t index)
+{
+    RegexSearch *search = w->search;
+    RegexTask *task = &search->tasks[index];
+    int backward = search->mode == REGSEARCH_BACKWARD;
+    size_t lines = 0, matches = 0, matched_lines = 0;
+    const char *found_text = NULL;
+    size_t found_line = 0, found_byte = 0;
+    int stop = 0;
+    size_t b, k;
+
+    for (b = 0; b < task->num_blocks && !found_text && !stop; ++b) {
+        const TextBlock *block =
+            &task->blocks[backward ? task->num_blocks - 1 - b : b];
+
+        for (k = 0; k < block->num_lines && !found_text && !stop; ++k) {
+            size_t i = backward ? block->num_lines - 1 - k : k;
+            size_t line_no = block->first_line + i;
+            const char *line = block->text + block->line_starts[i];
+            size_t num_bytes = block->line_starts[i+1]
+                               - block->line_starts[i] - 1;
+            size_t pos = 0, begin, n = 0;
+
+            while (!regsearch_next(w, line, num_bytes, &pos, &begin)) {
+                if (search->mode == REGSEARCH_COUNT) {
+                    ++n;
+                    continue;
+                }
+                if (line_no == task->limit_line) {
+                    if (backward && begin >= task->limit_byte) {
+                        break;
+                    } else if (!backward && begin <= task->limit_byte) {
+                        continue;
+                    }
+                }
+                /* backward searches want the last match before the limit */
+                found_text = line;
+                found_line = line_no;
+                found_byte = begin;
+                if (!backward) {
+                    break;
+                }
+            }
+
+            ++lines;
+            matches += n;
+            matched_lines += n > 0;
+            if (lines == CHECK_LINES) {
+                stop = regsearch_report(search, index, &lines, &matches,
+                                        &matched_lines);
+            }
+        }
+    }
+
+    pthread_mutex_lock(&search->lock);
+    search->lines_searched += lines;
+    search->num_matches += matches;
+    search->matched_lines += matched_lines;
+    task->done = 1;
+    if (found_text) {
+        task->found = 1;
+        task->line = found_line;
+        task->col = u8strnlen(found_text, found_byte);
+        if (index < search->first_found) {
+            search->first_found = index;
+            /* the threads waiting for later tasks can stop */
+            pthread_cond_broadcast(&search->ready);
+        }
+    }
+    pthread_mutex_unlock(&search->lock);
+
+    textbuf_free_blocks(task->blocks, task->num_blocks);
+    task->blocks = NULL;
+    task->num_blocks = 0;
+}
+
+/* The function that the threads run. */
+static void *regsearch_run(void *arg)
+{
+    RegexWorker *w = arg;
+    RegexSearch *search = w->search;
+
+    pthread_mutex_lock(&search->lock);
+    for (;;) {
+        size_t index;
+
+        /* the lines of the next task haven't been copied yet */
+        while (!search->cancel && search->next_task <= search->first_found
+               && search->next_task == search->num_ready
+               && search->num_ready < search->num_tasks) {
+            pthread_cond_wait(&search->ready, &search->lock);
+        }
+        /* a match has already been found before the next task */
+        if (search->cancel || search->next_task == search->num_tasks
+            || search->next_task > search->first_found) {
+            break;
+        }
+        index = search->next_task++;
+        pthread_mutex_unlock(&search->lock);
+
+        regsearch_task(w, index);
+        pthread_mutex_lock(&search->lock);
+    }
+
+    if (--search->num_running == 0) {
+        search->ms = current_ms() - search->start_ms;
+    }
+    pthread_mutex_unlock(&search->lock);
+    return NULL;
+}
+
+/* Copies the lines of the next tasks, so that each thread has a few tasks
+ * waiting but the whole buffer is never copied at once. This runs on the
+ * thread that owns the buffer. */
+static void regsearch_feed(RegexSearch *search)
+{
+    size_t from, to;
+
+    pthread_mutex_lock(&search->lock);
+    from = search->num_ready;
+    to = search->next_task + (size_t) TASKS_AHEAD * search->num_workers;
+    if (to > search->num_tasks) {
+        to = search->num_tasks;
+    }
+    /* the tasks after a match won't be searched */
+    if (to > search->first_found + 1) {
+        to = search->first_found + 1;
+    }
+    if (search->cancel || search->num_running == 0) {
+        to = from;
+    }
+    pthread_mutex_unlock(&search->lock);
+
+    /* only this thread sets num_ready, so the tasks from there on belong to
+     * it until they are counted as ready */
+    while (from < to) {
+        RegexTask *task = &search->tasks[from];
+        if (textbuf_get_blocks(search->buf, task->first, task->num_lines,
+                               task->num_lines, &task->blocks,
+                               &task->num_blocks)) {
+            /* try again at the next poll */
+            break;
+        }
+        ++from;
+    }
+
+    pthread_mutex_lock(&search->lock);
+    if (from > search->num_ready) {
+        search->num_ready = from;
+        pthread_cond_broadcast(&search->ready);
+    }
+    pthread_mutex_unlock(&search->lock);
+}
+
+/* Adds a task for the lines first..end-1. */
+static void regsearch_add_task(RegexSearch *search, size_t first, size_t end,
+                               int wrapped)
+{
+    RegexTask *task = &search->tasks[search->num_tasks++];
+
+    memset(task, 0, sizeof(*task));
+    task->first = first;
+    task->num_lines = end - first;
+    task->limit_line = (size_t) -1;
+    task->wrapped = wrapped;
+}
+
+/* Adds a task for the i:th part of the grid of TASK_LINES lines. */
+static void regsearch_add_part(RegexSearch *search, size_t i, int wrapped)
+{
+    size_t end = (i + 1) * TASK_LINES;
+
+    if (end > search->num_lines) {
+        end = search->num_lines;
+    }
+    regsearch_add_task(search, i * TASK_LINES, end, wrapped);
+}
+
+/* Divides the lines into tasks in the order in which their matches are
+ * wanted. The part of the grid where finding starts is split in two.
+ * Returns 0 on success. */
+static int regsearch_make_tasks(RegexSearch *search, size_t line, size_t col)
+{
+    size_t n = (search->num_lines + TASK_LINES - 1) / TASK_LINES;
+    size_t first, begin, end, i;
+    const char *text;
+
+    if (!(search->tasks = malloc((n + 1) * sizeof(*search->tasks)))) {
+        return 1;
+    }
+
+    if (search->mode == REGSEARCH_COUNT) {
+        for (i = 0; i < n; ++i) {
+            regsearch_add_part(search, i, 0);
+        }
+        return 0;
+    }
+
+    if (line >= search->num_lines) {
+        line = search->num_lines - 1;
+    }
+    first = line / TASK_LINES;
+    begin = first * TASK_LINES;
+    end = begin + TASK_LINES < search->num_lines ? begin + TASK_LINES
+                                                 : search->num_lines;
+
+    if (search->mode == REGSEARCH_FORWARD) {
+        regsearch_add_task(search, line, end, 0);
+        for (i = first + 1; i < n; ++i) {
+            regsearch_add_part(search, i, 0);
+        }
+        for (i = 0; i < first; ++i) {
+            regsearch_add_part(search, i, 1);
+        }
+        regsearch_add_task(search, begin, line + 1, 1);
+    } else {
+        regsearch_add_task(search, begin, line + 1, 0);
+        for (i = first; i-- > 0; ) {
+            regsearch_add_part(search, i, 0);
+        }
+        for (i = n; --i > first; ) {
+            regsearch_add_part(search, i, 1);
+        }
+        regsearch_add_task(search, line, end, 1);
+    }
+
+    if (!(text = textbuf_get_line(search->buf, line))) {
+        return 1;
+    }
+    search->tasks[0].limit_line = line;
+    if (u8_find_pos_n(text, strlen(text), col,
+                      &search->tasks[0].limit_byte)) {
+        search->tasks[0].limit_byte = strlen(text);
+    }
+    return 0;
+}
+
+RegexSearch *regsearch_start(TextBuffer *buf, const char *pattern,
+                             int ignore_case, RegexSearchMode mode,
+                             size_t line, size_t col, int num_threads,
+                             char *error, size_t error_size)
+{
+    RegexSearch *search;
+    int flags = REG_EXTENDED | (ignore_case ? REG_ICASE : 0);
+    int err;
+    int i;
+
+    assert(buf != NULL);
+    assert(pattern != NULL);
+    assert(error != NULL || error_size == 0);
+
+    if (!(search = calloc(1, sizeof(*search)))) {
+        return NULL;
+    }
+    search->mode = mode;
+    search->buf = buf;
+    search->num_lines = buf->num_lines;
+    search->start_ms = current_ms();
+    pthread_mutex_init(&search->lock, NULL);
+    pthread_cond_init(&search->ready, NULL);
+
+    if (search->num_lines == 0 || regsearch_make_tasks(search, line, col)) {
+        regsearch_free(search);
+        return NULL;
+    }
+    search->first_found = search->num_tasks;
+
+    if (num_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? cpus : 1;
+    }
+    if ((size_t) num_threads > search->num_tasks) {
+        num_threads = search->num_tasks;
+    }
+    if (!(search->workers = calloc(num_threads, sizeof(*search->workers)))) {
+        regsearch_free(search);
+        return NULL;
+    }
+
+    /* every thread has its own copy of the regex */
+    for (i = 0; i < num_threads; ++i) {
+        RegexWorker *w = &search->workers[i];
+        if ((err = regcomp(&w->regex, pattern, flags))) {
+            if (i == 0 && error_size > 0) {
+                regerror(err, &w->regex, error, error_size);
+            }
+            regsearch_free(search);
+            return NULL;
+        }
+        w->search = search;
+        ++search->num_workers;
+    }
+
+    pthread_mutex_lock(&search->lock);
+    for (i = 0; i < search->num_workers; ++i) {
+        RegexWorker *w = &search->workers[i];
+        if (pthread_create(&w->thread, NULL, regsearch_run, w)) {
+            break;
+        }
+        ++search->num_running;
+    }
+    search->num_started = i;
+    pthread_mutex_unlock(&search->lock);
+
+    if (i == 0) {
+        regsearch_free(search);
+        return NULL;
+    }
+    regsearch_feed(search);
+    return search;
+}
+
+void regsearch_poll(RegexSearch *search, RegexProgress *progress)
+{
+    assert(search != NULL);
+    assert(progress != NULL);
+
+    regsearch_feed(search);
+
+    memset(progress, 0, sizeof(*progress));
+    pthread_mutex_lock(&search->lock);
+    progress->lines_searched = search->lines_searched;
+    progress->num_lines = search->num_lines;
+    progress->num_matches = search->num_matches;
+    progress->matched_lines = search->matched_lines;
+
+    /* A match is the right one only when the tasks before it are done
+     * without a match. */
+    while (search->merged < search->first_found
+           && search->tasks[search->merged].done) {
+        ++search->merged;
+    }
+    if (search->merged < search->num_tasks
+        && search->merged == search->first_found) {
+        RegexTask *task = &search->tasks[search->merged];
+        progress->found = 1;
+        progress->line = task->line;
+        progress->col = task->col;
+        progress->wrapped = task->wrapped;
+    }
+
+    progress->done = search->num_running == 0;
+    progress->copying = !progress->done && !search->cancel
+                        && search->num_ready < search->num_tasks
+                        && search->num_ready <= search->first_found;
+    progress->seconds = (progress->done ? search->ms
+                                        : current_ms() - search->start_ms)
+                        / 1000.0;
+    pthread_mutex_unlock(&search->lock);
+}
+
+void regsearch_cancel(RegexSearch *search)
+{
+    assert(search != NULL);
+
+    pthread_mutex_lock(&search->lock);
+    search->cancel = 1;
+    pthread_cond_broadcast(&search->ready);
+    pthread_mutex_unlock(&search->lock);
+}
+
+void regsearch_free(RegexSearch *search)
+{
+    size_t j;
+    int i;
+
+    if (!search) {
+        return;
+    }
+
+    regsearch_cancel(search);
+    for (i = 0; i < search->num_started; ++i) {
+        pthread_join(search->workers[i].thread, NULL);
+    }
+    for (i = 0; i < search->num_workers; ++i) {
+        regfree(&search->workers[i].regex);
+        free(search->workers[i].copy);
+    }
+
+    /* the copies of the tasks that weren't searched */
+    for (j = 0; j < search->num_tasks; ++j) {
+        textbuf_free_blocks(search->tasks[j].blocks,
+                            search->tasks[j].num_blocks);
+    }
+
+    pthread_cond_destroy(&search->ready);
+    pthread_mutex_destroy(&search->lock);
+    free(search->tasks);
+    free(search->workers);
+    free(search);
+}
@@ -0,0 +1,122 @@
+/**
+ * @file regsearch.h
+ * @author dreamyeyed
+ *
+ * A RegexSearch finds or counts the matches of a regular expression in a
+ * TextBuffer with several threads. The lines of the buffer are divided into
+ * tasks, which the threads take one at a time, and the results of the tasks
+ * are put together in the order of the lines. The lines of a task are
+ * copied by regsearch_poll a little before a thread needs them, so the
+ * buffer is never copied all at once. The search runs in the background:
+ * the caller asks how far it has got with regsearch_poll, so the results
+ * can be shown while they come in, and the search can be cancelled at any
+ * time.
+ *
+ * The regular expressions are POSIX extended regular expressions. A match
+ * is always inside one line.
+ */
+#pragma once
+
+#include <stddef.h>
+
+#include "textbuf.h"
+
+typedef struct RegexSearch RegexSearch;
+
+/**
+ * What a RegexSearch looks for.
+ */
+typedef enum RegexSearchMode
+{
+    /** the first match after a position, continuing from the top */
+    REGSEARCH_FORWARD,
+    /** the last match before a position, continuing from the bottom */
+    REGSEARCH_BACKWARD,
+    /** all matches in the buffer */
+    REGSEARCH_COUNT
+} RegexSearchMode;
+
+/**
+ * How far a RegexSearch has got.
+ */
+typedef struct RegexProgress
+{
+    /** number of lines searched so far */
+    size_t lines_searched;
+    /** number of lines to search */
+    size_t num_lines;
+    /** number of matches found so far when counting */
+    size_t num_matches;
+    /** number of lines with at least one match found so far when counting */
+    size_t matched_lines;
+    /** non-zero if a match was found when finding */
+    int found;
+    /** line of the match that was found */
+    size_t line;
+    /** character where the match that was found begins */
+    size_t col;
+    /** non-zero if the match was found after continuing from the other end */
+    int wrapped;
+    /** how many seconds the search has taken */
+    double seconds;
+    /**
+     * non-zero when the threads have stopped, so that the results are
+     * complete unless the search was cancelled
+     */
+    int done;
+    /**
+     * non-zero while there are lines that regsearch_poll hasn't copied for
+     * the threads yet; the threads wait for them, so the search should be
+     * polled often
+     */
+    int copying;
+} RegexProgress;
+
+/**
+ * Starts searching for a regular expression in the lines that exist now.
+ * The search only gets far while it's polled, since regsearch_poll copies
+ * the lines for the threads. The search must be cancelled before the buffer
+ * is edited, and the buffer must not be loaded again or freed before the
+ * search is freed. Lines may be appended to the buffer.
+ *
+ * @param buf
+ * @param pattern the regular expression
+ * @param ignore_case non-zero to ignore case
+ * @param mode what to look for
+ * @param line the line where finding starts
+ * @param col the character where finding starts
+ * @param num_threads number of threads, or 0 to use one thread per CPU
+ * @param error a description of the problem is stored here if the pattern is
+ * invalid
+ * @param error_size size of the error array
+ * @return pointer to a dynamically allocated RegexSearch, or NULL if the
+ * pattern is invalid or in case of error
+ */
+RegexSearch *regsearch_start(TextBuffer *buf, const char *pattern,
+                             int ignore_case, RegexSearchMode mode,
+                             size_t line, size_t col, int num_threads,
+                             char *error, size_t error_size);
+
+/**
+ * Tells how far a search has got, and copies the lines that the threads
+ * need next. It must be called from the thread that edits the buffer.
+ *
+ * @param search
+ * @param progress the progress is stored here
+ */
+void regsearch_poll(RegexSearch *search, RegexProgress *progress);
+
+/**
+ * Tells the threads of a search to stop. This doesn't wait for them, so
+ * regsearch_poll should be used to find out when they have stopped.
+ *
+ * @param search
+ */
+void regsearch_cancel(RegexSearch *search);
+
+/**
+ * Cancels a search, waits for its threads to stop and frees it.
+ *
+ * @param search
+ */
+void regsearch_free(RegexSearch *search);
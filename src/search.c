@@ -0,0 +1,284 @@
+/*
+ * search.c
+ *
+ * Finding strings in blocks of text. See search.h.
+ */
+
+#define _GNU_SOURCE
+
+#include "search.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
+
+/* Returns c in lower case if it's an ASCII letter. */
+static char search_fold(char c)
+{
+    return c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+}
+
+/* Returns 0x20 if c is an ASCII letter. ORing a byte with it turns an upper
+ * case letter into a lower case one, so one comparison matches both. Other
+ * bytes that it changes can only cause candidates that don't match. */
+static char search_fold_bit(const SearchPattern *pat, char c)
+{
+    return pat->ignore_case && c >= 'a' && c <= 'z' ? 0x20 : 0;
+}
+
+/* Returns c the way it's compared with the pattern. */
+static char search_key(const SearchPattern *pat, char c)
+{
+    return pat->ignore_case ? search_fold(c) : c;
+}
+
+/* Checks whether the pattern is at text. */
+static int search_matches(const SearchPattern *pat, const char *text)
+{
+    size_t i;
+
+    if (!pat->ignore_case) {
+        return memcmp(text, pat->text, pat->num_bytes) == 0;
+    }
+    for (i = 0; i < pat->num_bytes; ++i) {
+        if (search_fold(text[i]) != pat->text[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static const char *search_forward_portable(const SearchPattern *pat,
+                                           const char *text, size_t n)
+{
+    size_t i;
+
+    if (n < pat->num_bytes) {
+        return NULL;
+    }
+    if (!pat->ignore_case) {
+        return memmem(text, n, pat->text, pat->num_bytes);
+    }
+    for (i = 0; i + pat->num_bytes <= n; ++i) {
+        if (search_fold(text[i]) == pat->text[0]
+            && search_matches(pat, text + i)) {
+            return text + i;
+        }
+    }
+    return NULL;
+}
+
+static const char *search_backward_portable(const SearchPattern *pat,
+                                            const char *text, size_t n)
+{
+    size_t i;
+
+    if (n < pat->num_bytes) {
+        return NULL;
+    }
+    for (i = n - pat->num_bytes + 1; i-- > 0; ) {
+        if (search_key(pat, text[i]) == pat->text[0]
+            && search_matches(pat, text + i)) {
+            return text + i;
+        }
+    }
+    return NULL;
+}
+
+#ifdef HAVE_X86_SIMD
+/* In the versions below, bit k of a mask stands for the place i + k. Places
+ * are only compared in whole blocks, and the rest are left to the portable
+ * versions. */
+
+__attribute__((target("sse2")))
+static unsigned int candidates_sse2(const SearchPattern *pat, const char *s)
+{
+    char first = pat->text[0];
+    char last = pat->text[pat->num_bytes - 1];
+    __m128i a = _mm_or_si128(_mm_loadu_si128((const __m128i *) s),
+                             _mm_set1_epi8(search_fold_bit(pat, first)));
+    __m128i b = _mm_or_si128(
+        _mm_loadu_si128((const __m128i *) (s + pat->num_bytes - 1)),
+        _mm_set1_epi8(search_fold_bit(pat, last)));
+    __m128i eq = _mm_and_si128(_mm_cmpeq_epi8(a, _mm_set1_epi8(first)),
+                               _mm_cmpeq_epi8(b, _mm_set1_epi8(last)));
+    return _mm_movemask_epi8(eq);
+}
+
+__attribute__((target("sse2")))
+static const char *search_forward_sse2(const SearchPattern *pat,
+                                       const char *text, size_t n)
+{
+    size_t places = n >= pat->num_bytes ? n - pat->num_bytes + 1 : 0;
+    size_t i;
+
+    for (i = 0; i + 16 <= places; i += 16) {
+        unsigned int mask = candidates_sse2(pat, text + i);
+        while (mask) {
+            const char *p = text + i + __builtin_ctz(mask);
+            if (search_matches(pat, p)) {
+                return p;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return search_forward_portable(pat, text + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static const char *search_backward_sse2(const SearchPattern *pat,
+                                        const char *text, size_t n)
+{
+    size_t i = n >= pat->num_bytes ? n - pat->num_bytes + 1 : 0;
+
+    while (i >= 16) {
+        unsigned int mask;
+        i -= 16;
+        mask = candidates_sse2(pat, text + i);
+        while (mask) {
+            int bit = 31 - __builtin_clz(mask);
+            if (search_matches(pat, text + i + bit)) {
+                return text + i + bit;
+            }
+            mask &= ~(1u << bit);
+        }
+    }
+    return search_backward_portable(pat, text, i + pat->num_bytes - 1);
+}
+
+__attribute__((target("avx2")))
+static unsigned int candidates_avx2(const SearchPattern *pat, const char *s)
+{
+    char first = pat->text[0];
+    char last = pat->text[pat->num_bytes - 1];
+    __m256i a = _mm256_or_si256(
+        _mm256_loadu_si256((const __m256i *) s),
+        _mm256_set1_epi8(search_fold_bit(pat, first)));
+    __m256i b = _mm256_or_si256(
+        _mm256_loadu_si256((const __m256i *) (s + pat->num_bytes - 1)),
+        _mm256_set1_epi8(search_fold_bit(pat, last)));
+    __m256i eq = _mm256_and_si256(
+        _mm256_cmpeq_epi8(a, _mm256_set1_epi8(first)),
+        _mm256_cmpeq_epi8(b, _mm256_set1_epi8(last)));
+    return _mm256_movemask_epi8(eq);
+}
+
+__attribute__((target("avx2")))
+static const char *search_forward_avx2(const SearchPattern *pat,
+                                       const char *text, size_t n)
+{
+    size_t places = n >= pat->num_bytes ? n - pat->num_bytes + 1 : 0;
+    size_t i;
+
+    for (i = 0; i + 32 <= places; i += 32) {
+        unsigned int mask = candidates_avx2(pat, text + i);
+        while (mask) {
+            const char *p = text + i + __builtin_ctz(mask);
+            if (search_matches(pat, p)) {
+                return p;
+            }
+            mask &= mask - 1;
+        }
+    }
+    return search_forward_portable(pat, text + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static const char *search_backward_avx2(const SearchPattern *pat,
+                                        const char *text, size_t n)
+{
+    size_t i = n >= pat->num_bytes ? n - pat->num_bytes + 1 : 0;
+
+    while (i >= 32) {
+        unsigned int mask;
+        i -= 32;
+        mask = candidates_avx2(pat, text + i);
+        while (mask) {
+            int bit = 31 - __builtin_clz(mask);
+            if (search_matches(pat, text + i + bit)) {
+                return text + i + bit;
+            }
+            mask &= ~(1u << bit);
+        }
+    }
+    return search_backward_portable(pat, text, i + pat->num_bytes - 1);
+}
+#endif
+
+/* The best implementations for this CPU. They are chosen before main()
+ * runs, so that every thread sees the same ones. */
+static const char *(*search_forward_impl)(const SearchPattern *,
+                                          const char *, size_t)
+    = search_forward_portable;
+static const char *(*search_backward_impl)(const SearchPattern *,
+                                           const char *, size_t)
+    = search_backward_portable;
+
+#ifdef HAVE_X86_SIMD
+__attribute__((constructor))
+static void search_choose_impl(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        search_forward_impl = search_forward_avx2;
+        search_backward_impl = search_backward_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        search_forward_impl = search_forward_sse2;
+        search_backward_impl = search_backward_sse2;
+    }
+}
+#endif
+
+int search_pattern_init(SearchPattern *pat, const char *text,
+                        size_t num_bytes, int ignore_case)
+{
+    size_t i;
+
+    assert(pat != NULL);
+    assert(text != NULL);
+
+    if (num_bytes == 0 || memchr(text, '\n', num_bytes)
+        || memchr(text, '\0', num_bytes)) {
+        return 1;
+    }
+    if (!(pat->text = malloc(num_bytes))) {
+        return 1;
+    }
+    for (i = 0; i < num_bytes; ++i) {
+        pat->text[i] = ignore_case ? search_fold(text[i]) : text[i];
+    }
+    pat->num_bytes = num_bytes;
+    pat->ignore_case = ignore_case;
+    return 0;
+}
+
+void search_pattern_free(SearchPattern *pat)
+{
+    if (pat) {
+        free(pat->text);
+        pat->text = NULL;
+    }
+}
+
+const char *search_forward(const SearchPattern *pat, const char *text,
+                           size_t num_bytes)
+{
+    assert(pat != NULL);
+    assert(text != NULL || num_bytes == 0);
+
+    return search_forward_impl(pat, text, num_bytes);
+}
+
+const char *search_backward(const SearchPattern *pat, const char *text,
+                            size_t num_bytes)
+{
+    assert(pat != NULL);
+    assert(text != NULL || num_bytes == 0);
+
+    return search_backward_impl(pat, text, num_bytes);
+}
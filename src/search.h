@@ -0,0 +1,69 @@
+/**
+ * @file search.h
+ * @author dreamyeyed
+ *
+ * Finding a string in a block of text. Blocks are searched 16 or 32 bytes at
+ * a time for places where both the first and the last byte of the pattern
+ * match, and only those places are compared with the whole pattern. The
+ * right version is chosen at run time like in util.h; without SSE2 or AVX2,
+ * memmem is used.
+ */
+#pragma once
+
+#include <stddef.h>
+
+/**
+ * A string to search for.
+ */
+typedef struct SearchPattern
+{
+    /** the string, with ASCII letters in lower case if case is ignored */
+    char *text;
+    /** length of text in bytes */
+    size_t num_bytes;
+    /** non-zero if ASCII letters match both upper and lower case */
+    int ignore_case;
+} SearchPattern;
+
+/**
+ * Prepares a pattern. Patterns must not be empty and can't contain newlines
+ * or null characters, so a match is always inside one line.
+ *
+ * @param pat the pattern to initialize
+ * @param text the string
+ * @param num_bytes length of text in bytes
+ * @param ignore_case non-zero to ignore the case of ASCII letters
+ * @return 0 on success, non-zero if the string can't be a pattern or in case
+ * of error
+ */
+int search_pattern_init(SearchPattern *pat, const char *text,
+                        size_t num_bytes, int ignore_case);
+
+/**
+ * Frees the memory of a pattern.
+ *
+ * @param pat
+ */
+void search_pattern_free(SearchPattern *pat);
+
+/**
+ * Finds the first match of a pattern in a block of text.
+ *
+ * @param pat
+ * @param text the text, which doesn't need to be null terminated
+ * @param num_bytes length of text in bytes
+ * @return pointer to the first byte of the match, or NULL if there isn't one
+ */
+const char *search_forward(const SearchPattern *pat, const char *text,
+                           size_t num_bytes);
+
+/**
+ * Finds the last match of a pattern in a block of text.
+ *
+ * @param pat
+ * @param text the text, which doesn't need to be null terminated
+ * @param num_bytes length of text in bytes
+ * @return pointer to the first byte of the match, or NULL if there isn't one
+ */
+const char *search_backward(const SearchPattern *pat, const char *text,
+                            size_t num_bytes);
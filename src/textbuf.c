@@ -2,474 +2,2725 @@
  * textbuf.c
  */
 
+/* copy_file_range is a GNU extension */
+#define _GNU_SOURCE
+
 #include "textbuf.h"
 
 #include <assert.h>
+#include <errno.h>
 #include <limits.h>
 #include <math.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
 
 #include <curses.h>
 
+#include "lineindex.h"
+#include "textloader.h"
 #include "util.h"
 
-TextLine *textline_init(const char *text)
+#ifdef __linux__
+#include <sys/sendfile.h>
+#define HAVE_SENDFILE 1
+#if defined(__GLIBC__) \
+    && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 27))
+#define HAVE_COPY_FILE_RANGE 1
+#endif
+#endif
+
+/* Lines at most this far from the finger are found by walking the list
+ * instead of searching the line index. */
+#define FINGER_MAX_WALK 64
+
+/* minimum size of the TextSources where new text is appended */
+#define ADD_SOURCE_SIZE (1 << 16)
+
+/* maximum number of pieces of text written with one writev call */
+#define SAVE_IOV_MAX 1024
+
+/* size of the buffer where short pieces of text are collected when saving */
+#define SAVE_STAGE_SIZE (1 << 18)
+
+/* longer pieces of text are written without copying them when saving */
+#define SAVE_COPY_LIMIT 512
+
+/* runs of unmodified lines at least this long are copied from the file they
+ * were loaded from when saving */
+#define SAVE_FILE_COPY_MIN (1 << 16)
+
+/* maximum number of lines copied into TextLines of their own by one call to
+ * textbuf_poll_load, so that the UI isn't blocked for long */
+#define LOAD_MAX_COPY_LINES (1 << 16)
+
+/* maximum number of bytes read from a stream by one call to
+ * textbuf_poll_load */
+#define STREAM_BLOCK_SIZE (1 << 20)
+
+/* The counters of a TextLine are 32 bits, so its text array can't be
+ * bigger than this. */
+#define TEXTLINE_MAX_SIZE ((size_t) 1 << 31)
+
+/* number of characters between two checkpoints of a line */
+#define CHECKPOINT_INTERVAL 256
+
+/* shorter lines are scanned from the start instead of using checkpoints */
+#define CHECKPOINT_MIN_BYTES 4096
+
+/* Byte offsets of the characters 0, CHECKPOINT_INTERVAL,
+ * 2*CHECKPOINT_INTERVAL... of a line. Only the first num_valid offsets are up
+ * to date. */
+struct LineCheckpoints
 {
-    TextLine *line;
-    size_t num_bytes;
-    size_t buf_size;
-    char *newline;
+    size_t num_valid;
+    size_t size;
+    size_t offsets[];
+};
 
-    assert(text != NULL);
+/* A function that is told about changes, see textbuf_add_listener. */
+struct TextListener
+{
+    TextEditListener fn;
+    void *data;
+    struct TextListener *next;
+};
 
-    line = malloc(sizeof(*line));
-    if (!line) {
-        return NULL;
-    }
+/* Returns the size of the gap in a line. */
+static size_t textline_gap_size(const TextLine *line)
+{
+    return line->textbuf_size - line->num_bytes;
+}
+
+/* Returns a pointer to the first byte after the gap. */
+static char *textline_after_gap(const TextLine *line)
+{
+    return line->text + line->gap_start + textline_gap_size(line);
+}
+
+/* Allocates memory for a line from arena, or with malloc if arena is
+ * NULL. */
+static void *line_alloc(Arena *arena, size_t size)
+{
+    return arena ? arena_alloc(arena, size) : malloc(size);
+}
+
+static void *line_realloc(Arena *arena, void *ptr, size_t old_size,
+                          size_t new_size)
+{
+    return arena ? arena_realloc(arena, ptr, old_size, new_size)
+                 : realloc(ptr, new_size);
+}
 
-    num_bytes = strlen(text);
-    buf_size = 16;
-    while (buf_size < num_bytes+1) {
-        buf_size *= 2;
+static void line_free(Arena *arena, void *ptr, size_t size)
+{
+    if (arena) {
+        arena_free(arena, ptr, size);
+    } else {
+        free(ptr);
     }
+}
+
+/* Returns the arena that the memory of line comes from when arena is the
+ * arena of its buffer, or NULL if the memory comes from malloc. */
+static Arena *textline_arena(const TextLine *line, Arena *arena)
+{
+    return line->in_arena ? arena : NULL;
+}
+
+/* Returns the room for text right after a TextLine. */
+static char *textline_inline(TextLine *line)
+{
+    return (char *) (line + 1);
+}
+
+/* Returns the size of the memory of a TextLine. */
+static size_t textline_node_bytes(const TextLine *line)
+{
+    return (size_t) line->node_size * ARENA_CLASS_STEP;
+}
+
+/* Allocates a TextLine from arena, or with malloc if arena is NULL. If a
+ * text of num_bytes bytes fits after the TextLine in a size class of the
+ * arena, there is room for it there. Returns NULL in case of error. */
+static TextLine *textline_alloc(Arena *arena, size_t num_bytes)
+{
+    size_t size = sizeof(TextLine);
+    TextLine *line;
 
-    line->text = malloc(buf_size);
-    if (!line->text) {
-        free(line);
+    if (size + num_bytes + 1 <= ARENA_MAX_SMALL) {
+        size += num_bytes + 1;
+    }
+    /* the rest of the size class is room for the text to grow */
+    size = (size + ARENA_CLASS_STEP - 1) / ARENA_CLASS_STEP
+           * ARENA_CLASS_STEP;
+    if (!(line = line_alloc(arena, size))) {
         return NULL;
     }
+    line->in_arena = arena != NULL;
+    line->node_size = size / ARENA_CLASS_STEP;
+    return line;
+}
+
+/* Gives a TextLine a copy of text as its own text. Short texts are stored
+ * right after the TextLine if there is room. arena is the arena of the
+ * buffer of the line, or NULL. Returns 0 on success. */
+static int textline_set_text(Arena *arena, TextLine *line, const char *text,
+                             size_t num_bytes)
+{
+    size_t buf_size = textline_node_bytes(line) - sizeof(*line);
+    char *new_text = textline_inline(line);
+
+    if (num_bytes+1 > TEXTLINE_MAX_SIZE) {
+        return 1;
+    } else if (num_bytes+1 > buf_size) {
+        buf_size = 16;
+        while (buf_size < num_bytes+1) {
+            buf_size *= 2;
+        }
 
-    strcpy(line->text, text);
-    if ((newline = strchr(line->text, '\n'))) {
-        *newline = '\0';
+        if (!(new_text = line_alloc(textline_arena(line, arena),
+                                    buf_size))) {
+            return 1;
+        }
     }
+
+    /* count the characters in the copy while it's still in the cache */
+    line->text = new_text;
+    memcpy(line->text, text, num_bytes);
     line->textbuf_size = buf_size;
-    line->num_chars = u8strlen(text);
     line->num_bytes = num_bytes;
+    line->num_chars = u8strnlen(line->text, num_bytes);
+    line->gap_start = line->num_bytes;
+    line->gap_chars = line->num_chars;
+    return 0;
+}
+
+/* Creates a TextLine whose memory comes from arena, or from malloc if arena
+ * is NULL. Returns NULL in case of error. */
+static TextLine *textline_init_in(Arena *arena, const char *text,
+                                  size_t num_bytes)
+{
+    TextLine *line = textline_alloc(arena, num_bytes);
+    if (!line) {
+        return NULL;
+    }
+
+    if (textline_set_text(arena, line, text, num_bytes)) {
+        line_free(arena, line, textline_node_bytes(line));
+        return NULL;
+    }
+    line->checkpoints = NULL;
     line->prev = NULL;
     line->next = NULL;
+    line->source = NULL;
     return line;
 }
 
-void textline_free(TextLine *line)
+TextLine *textline_init_len(const char *text, size_t num_bytes)
+{
+    assert(text != NULL);
+
+    return textline_init_in(NULL, text, num_bytes);
+}
+
+TextLine *textline_init(const char *text)
+{
+    assert(text != NULL);
+
+    /* the text ends at the first newline */
+    return textline_init_len(text, strcspn(text, "\n"));
+}
+
+/* Returns the size of the checkpoint table of a line. */
+static size_t checkpoints_bytes(const struct LineCheckpoints *cp)
+{
+    return sizeof(*cp) + cp->size * sizeof(cp->offsets[0]);
+}
+
+/* Frees a TextLine. arena is the arena of its buffer, or NULL. */
+static void textline_free_in(Arena *arena, TextLine *line)
 {
     if (!line) {
         return;
     }
 
-    free(line->text);
-    free(line);
+    arena = textline_arena(line, arena);
+
+    if (!line->source && line->checkpoints) {
+        line_free(arena, line->checkpoints,
+                  checkpoints_bytes(line->checkpoints));
+    }
+    if (!line->source && line->text != textline_inline(line)) {
+        line_free(arena, line->text, line->textbuf_size);
+    }
+    line_free(arena, line, textline_node_bytes(line));
 }
 
-/* Adds text to end of line */
-static void textline_append(TextLine *line, const char *text)
+void textline_free(TextLine *line)
+{
+    assert(!line || !line->in_arena);
+
+    textline_free_in(NULL, line);
+}
+
+/* Returns the byte offset of the character that is n characters after the
+ * byte offset start. Neither offset counts the gap. */
+static size_t textline_skip_chars(const TextLine *line, size_t start, size_t n)
 {
-    size_t num_bytes = strlen(text);
-    size_t new_size = line->num_bytes + num_bytes + 1;
-    if (line->textbuf_size < new_size) {
-        while (line->textbuf_size < new_size) {
-            line->textbuf_size *= 2;
+    size_t len, pos;
+
+    if (start < line->gap_start) {
+        len = line->gap_start - start;
+        if (!u8_find_pos_n(line->text + start, len, n, &pos)) {
+            return start + pos;
         }
-        line->text = realloc(line->text, line->textbuf_size);
+        n -= u8strnlen(line->text + start, len);
+        start = line->gap_start;
     }
-    strcat(line->text, text);
+
+    u8_find_pos_n(textline_after_gap(line) + (start - line->gap_start),
+                  line->num_bytes - start, n, &pos);
+    return start + pos;
 }
 
-/* Inserts text in middle of line. Returns 0 on success */
-static int textline_insert_in_middle(TextLine *line, const char *text,
-                                      size_t pos)
+/* Forgets the checkpoints after the character pos. Edits at pos don't move
+ * anything before it. */
+static void textline_drop_checkpoints(TextLine *line, size_t pos)
 {
+    struct LineCheckpoints *cp = line->checkpoints;
 
-    size_t num_bytes = strlen(text);
-    size_t new_size = line->num_bytes + num_bytes + 1;
-    if (line->textbuf_size < new_size) {
-        while (line->textbuf_size < new_size) {
-            line->textbuf_size *= 2;
-        }
-        line->text = realloc(line->text, line->textbuf_size);
+    if (cp && cp->num_valid > pos / CHECKPOINT_INTERVAL + 1) {
+        cp->num_valid = pos / CHECKPOINT_INTERVAL + 1;
     }
+}
 
-    size_t u8pos;
-    if (u8_find_pos(line->text, pos, &u8pos)) {
-        return 1;
+/* Makes sure that the checkpoint of the character n*CHECKPOINT_INTERVAL is
+ * valid. Returns 0 on success. */
+static int textline_build_checkpoints(Arena *arena, TextLine *line, size_t n)
+{
+    struct LineCheckpoints *cp = line->checkpoints;
+    size_t i;
+
+    if (!cp || cp->size <= n) {
+        size_t new_size = cp ? cp->size : 16;
+        while (new_size <= n) {
+            new_size *= 2;
+        }
+        cp = line_realloc(textline_arena(line, arena), cp,
+                          cp ? checkpoints_bytes(cp) : 0,
+                          sizeof(*cp) + new_size * sizeof(cp->offsets[0]));
+        if (!cp) {
+            return 1;
+        }
+        if (!line->checkpoints) {
+            cp->num_valid = 1;
+            cp->offsets[0] = 0;
+        }
+        cp->size = new_size;
+        line->checkpoints = cp;
     }
-    char *tmp = malloc(line->num_bytes - u8pos + 1);
 
-    strcpy(tmp, line->text + u8pos);
-    strcpy(line->text + u8pos, text);
-    strcat(line->text, tmp);
-    free(tmp);
+    for (i = cp->num_valid; i <= n; ++i) {
+        cp->offsets[i] = textline_skip_chars(line, cp->offsets[i-1],
+                                             CHECKPOINT_INTERVAL);
+    }
+    if (cp->num_valid <= n) {
+        cp->num_valid = n + 1;
+    }
     return 0;
 }
 
-int textline_insert(TextLine *line, const char *text, size_t pos)
+/* Like textline_byte_offset. arena is the arena of the buffer of the
+ * line, or NULL. */
+static size_t textline_byte_offset_in(Arena *arena, TextLine *line,
+                                      size_t pos)
 {
+    size_t n = pos / CHECKPOINT_INTERVAL;
+
+    assert(line != NULL);
+    assert(pos <= line->num_chars);
 
+    /* characters near the gap are found from the gap */
     if (pos == line->num_chars) {
-        textline_append(line, text);
+        return line->num_bytes;
+    } else if (pos >= line->gap_chars
+               && pos - line->gap_chars < CHECKPOINT_INTERVAL) {
+        return textline_skip_chars(line, line->gap_start,
+                                   pos - line->gap_chars);
+    } else if (pos < line->gap_chars
+               && line->gap_chars - pos < CHECKPOINT_INTERVAL) {
+        size_t chars = line->gap_chars - pos;
+        size_t offset = line->gap_start;
+        while (chars-- > 0) {
+            do {
+                --offset;
+            } while (offset > 0 && is_u8_cont_byte(line->text[offset]));
+        }
+        return offset;
+    }
+
+    if (line->num_bytes < CHECKPOINT_MIN_BYTES
+        || textline_build_checkpoints(arena, line, n)) {
+        return textline_skip_chars(line, 0, pos);
+    }
+    return textline_skip_chars(line, line->checkpoints->offsets[n],
+                               pos % CHECKPOINT_INTERVAL);
+}
+
+size_t textline_byte_offset(TextLine *line, size_t pos)
+{
+    assert(line != NULL);
+    assert(!line->in_arena);
+
+    return textline_byte_offset_in(NULL, line, pos);
+}
+
+/* Moves the gap so that it starts before the character pos. Only the text
+ * between the old and the new position of the gap is touched. */
+static void textline_move_gap(Arena *arena, TextLine *line, size_t pos)
+{
+    size_t offset;
+
+    assert(pos <= line->num_chars);
+
+    if (pos == line->gap_chars) {
+        return;
+    }
+
+    offset = textline_byte_offset_in(arena, line, pos);
+    if (offset > line->gap_start) {
+        memmove(line->text + line->gap_start, textline_after_gap(line),
+                offset - line->gap_start);
+    } else {
+        size_t n = line->gap_start - offset;
+        memmove(textline_after_gap(line) - n, line->text + offset, n);
+    }
+    line->gap_start = offset;
+    line->gap_chars = pos;
+}
+
+/* Makes the gap at least n bytes long. Returns 0 on success. */
+static int textline_reserve(Arena *arena, TextLine *line, size_t n)
+{
+    size_t after_size = line->num_bytes - line->gap_start;
+    size_t new_size = line->textbuf_size;
+    char *new_text;
+
+    if (textline_gap_size(line) >= n) {
+        return 0;
+    } else if (line->num_bytes + n > TEXTLINE_MAX_SIZE) {
+        return 1;
+    }
+
+    while (new_size < line->num_bytes + n) {
+        new_size *= 2;
+    }
+    arena = textline_arena(line, arena);
+
+    if (line->text == textline_inline(line)) {
+        /* the text outgrew the TextLine, move it to a block of its own */
+        if (!(new_text = line_alloc(arena, new_size))) {
+            return 1;
+        }
+        memcpy(new_text, line->text, line->gap_start);
+        memcpy(new_text + new_size - after_size,
+               textline_after_gap(line), after_size);
     } else {
-        int err = textline_insert_in_middle(line, text, pos);
-        if (err) {
+        if (!(new_text = line_realloc(arena, line->text,
+                                      line->textbuf_size, new_size))) {
             return 1;
         }
+
+        /* the text after the gap must stay at the end of the array */
+        memmove(new_text + new_size - after_size,
+                new_text + line->textbuf_size - after_size, after_size);
+    }
+    line->text = new_text;
+    line->textbuf_size = new_size;
+    return 0;
+}
+
+/* Moves the gap to the end of the line and null terminates the text. This
+ * doesn't allocate anything. */
+static const char *textline_contiguous(TextLine *line)
+{
+    textline_move_gap(NULL, line, line->num_chars);
+    /* there is always at least one byte in the gap */
+    line->text[line->num_bytes] = '\0';
+    return line->text;
+}
+
+/* Like textline_insert_len. arena is the arena of the buffer of the line, or
+ * NULL. */
+static int textline_insert_in(Arena *arena, TextLine *line, const char *text,
+                              size_t num_bytes, size_t pos)
+{
+    size_t num_chars;
+
+    assert(line != NULL);
+    assert(text != NULL);
+
+    if (pos > line->num_chars) {
+        return 1;
+    }
+
+    /* keep one extra byte for a null character */
+    if (textline_reserve(arena, line, num_bytes + 1)) {
+        return 1;
     }
+    textline_move_gap(arena, line, pos);
+    textline_drop_checkpoints(line, pos);
 
-    line->num_bytes = strlen(line->text);
-    line->num_chars = u8strlen(line->text);
+    memcpy(line->text + line->gap_start, text, num_bytes);
+    num_chars = u8strnlen(line->text + line->gap_start, num_bytes);
+    line->gap_start += num_bytes;
+    line->gap_chars += num_chars;
+    line->num_bytes += num_bytes;
+    line->num_chars += num_chars;
 
     return 0;
 }
 
-int textline_delete_to_eol(TextLine *line, size_t pos)
+int textline_insert_len(TextLine *line, const char *text, size_t num_bytes,
+                        size_t pos)
 {
-    size_t u8pos;
+    assert(line != NULL);
+    assert(!line->in_arena);
 
-    if (pos > line->num_chars) {
+    return textline_insert_in(NULL, line, text, num_bytes, pos);
+}
+
+int textline_insert(TextLine *line, const char *text, size_t pos)
+{
+    return textline_insert_len(line, text, strlen(text), pos);
+}
+
+/* Like textline_delete. arena is the arena of the buffer of the line, or
+ * NULL. */
+static int textline_delete_in(Arena *arena, TextLine *line, size_t pos,
+                              size_t n)
+{
+    size_t deleted;
+
+    if (pos + n > line->num_chars) {
         return 1;
     }
 
-    if (u8_find_pos(line->text, pos, &u8pos)) {
+    textline_move_gap(arena, line, pos);
+    textline_drop_checkpoints(line, pos);
+
+    /* widen the gap over the deleted characters */
+    u8_find_pos_n(textline_after_gap(line), line->num_bytes - line->gap_start,
+                  n, &deleted);
+    line->num_bytes -= deleted;
+    line->num_chars -= n;
+    return 0;
+}
+
+int textline_delete(TextLine *line, size_t pos, size_t n)
+{
+    assert(line != NULL);
+    assert(!line->in_arena);
+
+    return textline_delete_in(NULL, line, pos, n);
+}
+
+/* Like textline_delete_to_eol. arena is the arena of the buffer of the
+ * line, or NULL. */
+static int textline_delete_to_eol_in(Arena *arena, TextLine *line,
+                                     size_t pos)
+{
+    if (pos > line->num_chars) {
         return 1;
     }
 
-    line->text[u8pos] = '\0';
-    line->num_bytes = u8pos;
+    textline_move_gap(arena, line, pos);
+    textline_drop_checkpoints(line, pos);
+    line->num_bytes = line->gap_start;
     line->num_chars = pos;
     return 0;
 }
 
+int textline_delete_to_eol(TextLine *line, size_t pos)
+{
+    assert(line != NULL);
+    assert(!line->in_arena);
+
+    return textline_delete_to_eol_in(NULL, line, pos);
+}
+
 /*
  * Internal functions to simplify some tasks
  */
 
-/* Returns a pointer to the given TextLine. */
-static TextLine *textbuf_get_textline(const TextBuffer *buf, size_t pos)
+/* Returns the number of lines that a TextLine stands for. */
+static size_t textline_size(const TextLine *line)
 {
-    TextLine *tmp;
-    assert(buf != NULL);
+    return line->source ? line->run_length : 1;
+}
 
-    tmp = buf->head;
-    while (pos-- > 0) {
-        assert(tmp != NULL);
-        tmp = tmp->next;
+/* Returns the text of the nth line of a TextLine in one piece and stores its
+ * length in *num_bytes. The text is null terminated unless it's in a mapped
+ * TextSource. */
+static const char *textline_bytes(TextLine *line, size_t n, size_t *num_bytes)
+{
+    if (line->source) {
+        *num_bytes = textsource_line_length(line->source,
+                                            line->source_line + n);
+        return textsource_line(line->source, line->source_line + n);
+    } else {
+        *num_bytes = line->num_bytes;
+        return textline_contiguous(line);
     }
-
-    return tmp;
 }
 
-TextBuffer *textbuf_init(void)
+/* Creates a TextLine that stands for count unmodified lines in src starting
+ * from the line first. Its memory comes from arena. Returns NULL in case of
+ * error. */
+static TextLine *textline_init_run(Arena *arena, TextSource *src,
+                                   size_t first, size_t count)
 {
-    TextBuffer *buf = malloc(sizeof(*buf));
-    if (!buf) {
+    TextLine *line = textline_alloc(arena, 0);
+    if (!line) {
         return NULL;
     }
 
-    buf->head = NULL;
-    buf->tail = NULL;
-    buf->num_lines = 0;
-    buf->crow = 0;
-    buf->ccol = 0;
+    line->textbuf_size = 0;
+    line->num_chars = 0;
+    line->num_bytes = 0;
+    line->gap_start = 0;
+    line->gap_chars = 0;
+    line->prev = NULL;
+    line->next = NULL;
+    line->source = src;
+    line->source_line = first;
+    line->run_length = count;
+    return line;
+}
 
-    /* a buffer should always have at least one line */
-    textbuf_append_line(buf, textline_init(""));
+/* Copies the text of a run of one line into the TextLine itself, so that it
+ * can be modified. The memory of runs comes from arena. Returns 0 on
+ * success. */
+static int textline_materialise(Arena *arena, TextLine *line)
+{
+    const char *text;
+    size_t num_bytes;
 
-    return buf;
+    assert(line->source != NULL);
+    assert(line->run_length == 1);
+
+    /* the text and the checkpoints take the place of the run */
+    text = textline_bytes(line, 0, &num_bytes);
+    if (textline_set_text(arena, line, text, num_bytes)) {
+        return 1;
+    }
+    line->checkpoints = NULL;
+    line->source = NULL;
+    return 0;
 }
 
-static void textbuf_delete_all_lines(TextBuffer *buf)
+/* Finds the TextLine that contains the given line. The index of the first
+ * line of the TextLine is stored in *start. Returns NULL if the line doesn't
+ * exist. */
+static TextLine *textbuf_find_line(const TextBuffer *buf, size_t pos,
+                                   size_t *start)
 {
+    /* The finger is just a cache, so it can be moved even if the buffer is
+     * otherwise constant. */
+    LineFinger *finger = (LineFinger *) &buf->finger;
+    TextLine *tmp = NULL;
+    size_t from = 0;
+
     assert(buf != NULL);
+    assert(start != NULL);
 
-    TextLine *tmp = buf->head;
+    if (pos >= buf->num_lines) {
+        return NULL;
+    }
 
-    while (tmp) {
-        TextLine *next = tmp->next;
-        textline_free(tmp);
-        tmp = next;
+    /* start from whichever known line is close enough */
+    if (finger->line && (finger->pos > pos ? finger->pos - pos
+                                           : pos - finger->pos)
+                        <= FINGER_MAX_WALK) {
+        tmp = finger->line;
+        from = finger->pos;
+    } else if (finger->line && pos >= finger->pos
+               && pos - finger->pos < textline_size(finger->line)) {
+        tmp = finger->line;
+        from = finger->pos;
+    } else if (pos <= FINGER_MAX_WALK) {
+        tmp = buf->head;
+        from = 0;
+    } else if (buf->num_lines - pos <= FINGER_MAX_WALK) {
+        tmp = buf->tail;
+        from = buf->num_lines - textline_size(buf->tail);
     }
 
-    buf->head = NULL;
-    buf->tail = NULL;
-    buf->num_lines = 0;
+    if (tmp) {
+        while (pos < from) {
+            tmp = tmp->prev;
+            from -= textline_size(tmp);
+        }
+        while (pos >= from + textline_size(tmp)) {
+            from += textline_size(tmp);
+            tmp = tmp->next;
+        }
+    } else {
+        tmp = lineindex_get(&buf->index, pos, &from);
+    }
+
+    finger->line = tmp;
+    finger->pos = from;
+    *start = from;
+    return tmp;
 }
 
-void textbuf_free(TextBuffer *buf)
+/* Links line into the list of lines between prev and next. Either one may be
+ * NULL at the ends of the buffer. */
+static void textbuf_link_line(TextBuffer *buf, TextLine *line,
+                              TextLine *prev, TextLine *next)
 {
-    if (!buf) {
-        return;
+    line->prev = prev;
+    line->next = next;
+    if (!line->in_arena) {
+        ++buf->num_foreign_lines;
     }
 
-    textbuf_delete_all_lines(buf);
+    if (prev) {
+        prev->next = line;
+    } else {
+        buf->head = line;
+    }
 
-    free(buf);
+    if (next) {
+        next->prev = line;
+    } else {
+        buf->tail = line;
+    }
 }
 
-int textbuf_append_line(TextBuffer *buf, TextLine *line)
+/* Removes line from the list of lines. */
+static void textbuf_unlink_line(TextBuffer *buf, TextLine *line)
 {
-    assert(buf != NULL);
-    assert(line != NULL);
+    if (!line->in_arena) {
+        --buf->num_foreign_lines;
+    }
 
-    if (buf->tail) {
-        buf->tail->next = line;
+    if (line->prev) {
+        line->prev->next = line->next;
     } else {
-        buf->head = line;
+        buf->head = line->next;
     }
-    line->prev = buf->tail;
-    line->next = NULL;
-    buf->tail = line;
 
-    buf->num_lines += 1;
-    return 0;
+    if (line->next) {
+        line->next->prev = line->prev;
+    } else {
+        buf->tail = line->prev;
+    }
 }
 
-int textbuf_insert_line(TextBuffer *buf, TextLine *line, size_t pos)
+/* Forgets all damage. */
+static void textbuf_clear_damage(TextBuffer *buf)
 {
-    assert(buf != NULL);
-    assert(line != NULL);
+    buf->damage.first = SIZE_MAX;
+    buf->damage.last = 0;
+    buf->damage.shift_pos = 0;
+    buf->damage.shift = 0;
+    buf->damage.all = 0;
+}
+
+/* Records that the text of the lines from first to last has changed. */
+static void textbuf_damage_lines(TextBuffer *buf, size_t first, size_t last)
+{
+    if (first < buf->damage.first) {
+        buf->damage.first = first;
+    }
+    if (last > buf->damage.last) {
+        buf->damage.last = last;
+    }
+}
+
+/* Records that n lines were inserted (or -n deleted) at pos. Only one shift
+ * is remembered; anything more complicated damages every line from the first
+ * shifted one to the end. */
+static void textbuf_damage_shift(TextBuffer *buf, size_t pos, long n)
+{
+    TextDamage *d = &buf->damage;
+
+    /* changed lines after pos have moved, and so has an earlier shift */
+    if (d->shift != 0 || (d->first <= d->last && d->last >= pos)) {
+        if (d->shift != 0 && d->shift_pos < pos) {
+            pos = d->shift_pos;
+        }
+        d->shift = 0;
+        textbuf_damage_lines(buf, pos, SIZE_MAX);
+    } else {
+        d->shift_pos = pos;
+        d->shift = n;
+    }
+}
+
+/* Adds a line to the buffer. pos must be in the range [0, num_lines] and it
+ * must not be in the middle of a run. The finger is left pointing to the new
+ * line. */
+static void textbuf_add_line(TextBuffer *buf, TextLine *line, size_t pos)
+{
+    size_t start;
+    TextLine *next = textbuf_find_line(buf, pos, &start);
+
+    assert(!next || start == pos);
+
+    textbuf_link_line(buf, line, next ? next->prev : buf->tail, next);
+    lineindex_insert(&buf->index, line, pos);
+    buf->num_lines += textline_size(line);
+    textbuf_damage_shift(buf, pos, textline_size(line));
+
+    buf->finger.line = line;
+    buf->finger.pos = pos;
+}
+
+/* Removes a line from the buffer and returns it. pos must be the first line
+ * of a TextLine. The finger is left pointing to the line that took its
+ * place, if there is one. */
+static TextLine *textbuf_remove_line(TextBuffer *buf, size_t pos)
+{
+    TextLine *line = lineindex_remove(&buf->index, pos);
+
+    assert(line != NULL);
+
+    textbuf_unlink_line(buf, line);
+    buf->num_lines -= textline_size(line);
+    textbuf_damage_shift(buf, pos, -(long) textline_size(line));
+
+    if (line->next) {
+        buf->finger.line = line->next;
+        buf->finger.pos = pos;
+    } else if (line->prev) {
+        buf->finger.line = line->prev;
+        buf->finger.pos = pos - textline_size(line->prev);
+    } else {
+        buf->finger.line = NULL;
+        buf->finger.pos = 0;
+    }
+    return line;
+}
+
+/* Adds a list of count TextLines linked from first to last with their next
+ * pointers. pos must be in the range [0, num_lines] and it must not be in the
+ * middle of a run. The finger is left pointing to the first new line. Returns
+ * 0 on success. */
+static int textbuf_add_lines(TextBuffer *buf, TextLine *first,
+                             TextLine *last, size_t count, size_t pos)
+{
+    size_t start;
+    size_t num_lines = 0;
+    TextLine *next = textbuf_find_line(buf, pos, &start);
+    TextLine *prev = next ? next->prev : buf->tail;
+    TextLine *tmp;
+
+    assert(!next || start == pos);
+
+    if (lineindex_insert_list(&buf->index, first, count, pos)) {
+        return 1;
+    }
+
+    first->prev = prev;
+    for (tmp = first; tmp != last; tmp = tmp->next) {
+        tmp->next->prev = tmp;
+    }
+    for (tmp = first; tmp != last->next; tmp = tmp->next) {
+        if (!tmp->in_arena) {
+            ++buf->num_foreign_lines;
+        }
+        num_lines += textline_size(tmp);
+    }
+
+    if (prev) {
+        prev->next = first;
+    } else {
+        buf->head = first;
+    }
+    last->next = next;
+    if (next) {
+        next->prev = last;
+    } else {
+        buf->tail = last;
+    }
+
+    buf->num_lines += num_lines;
+    textbuf_damage_shift(buf, pos, num_lines);
+
+    buf->finger.line = first;
+    buf->finger.pos = pos;
+    return 0;
+}
+
+/* Removes and frees count lines starting from pos. Both pos and pos + count
+ * must be at the start of a TextLine or at the end of the buffer. The finger
+ * is left pointing to the line that took their place, if there is one. */
+static void textbuf_delete_lines(TextBuffer *buf, size_t pos, size_t count)
+{
+    size_t start;
+    size_t n;
+    TextLine *first = textbuf_find_line(buf, pos, &start);
+    TextLine *last = first;
+    TextLine *prev, *next;
+
+    assert(first != NULL && start == pos);
+
+    for (n = textline_size(last); n < count; n += textline_size(last)) {
+        last = last->next;
+    }
+    assert(n == count);
+
+    lineindex_remove_range(&buf->index, pos, count);
+    prev = first->prev;
+    next = last->next;
+    if (prev) {
+        prev->next = next;
+    } else {
+        buf->head = next;
+    }
+    if (next) {
+        next->prev = prev;
+    } else {
+        buf->tail = prev;
+    }
+
+    last->next = NULL;
+    while (first) {
+        TextLine *tmp = first->next;
+        if (!first->in_arena) {
+            --buf->num_foreign_lines;
+        }
+        textline_free_in(&buf->arena, first);
+        first = tmp;
+    }
+
+    buf->num_lines -= count;
+    textbuf_damage_shift(buf, pos, -(long) count);
+
+    if (next) {
+        buf->finger.line = next;
+        buf->finger.pos = pos;
+    } else if (prev) {
+        buf->finger.line = prev;
+        buf->finger.pos = pos - textline_size(prev);
+    } else {
+        buf->finger.line = NULL;
+        buf->finger.pos = 0;
+    }
+}
+
+/* Makes sure that the given line has a TextLine of its own by splitting the
+ * run that it is in. The text isn't copied, so the returned TextLine may
+ * still refer to a TextSource. Returns NULL if the line doesn't exist or in
+ * case of error. */
+static TextLine *textbuf_isolate_line(TextBuffer *buf, size_t pos)
+{
+    size_t start;
+    size_t offset;
+    size_t rest_length;
+    TextLine *run = textbuf_find_line(buf, pos, &start);
+    TextLine *line;
+    TextLine *rest = NULL;
+
+    if (!run || textline_size(run) == 1) {
+        return run;
+    }
+
+    offset = pos - start;
+    rest_length = run->run_length - offset - 1;
+
+    line = run;
+    if (offset > 0) {
+        line = textline_init_run(&buf->arena, run->source,
+                                 run->source_line + offset, 1);
+        if (!line) {
+            return NULL;
+        }
+    }
+    if (rest_length > 0) {
+        rest = textline_init_run(&buf->arena, run->source,
+                                 run->source_line + offset + 1, rest_length);
+        if (!rest) {
+            if (line != run) {
+                textline_free_in(&buf->arena, line);
+            }
+            return NULL;
+        }
+    }
+
+    lineindex_remove(&buf->index, start);
+    if (offset > 0) {
+        run->run_length = offset;
+        lineindex_insert(&buf->index, run, start);
+        textbuf_link_line(buf, line, run, run->next);
+    } else {
+        run->run_length = 1;
+    }
+    lineindex_insert(&buf->index, line, pos);
+    if (rest) {
+        textbuf_link_line(buf, rest, line, line->next);
+        lineindex_insert(&buf->index, rest, pos + 1);
+    }
+
+    buf->finger.line = line;
+    buf->finger.pos = pos;
+    return line;
+}
+
+/* Returns a pointer to the given TextLine. If the line hasn't been modified
+ * yet, it is copied into a TextLine of its own first. Returns NULL if the
+ * line doesn't exist or in case of error. */
+static TextLine *textbuf_get_textline(TextBuffer *buf, size_t pos)
+{
+    TextLine *line = textbuf_isolate_line(buf, pos);
+
+    if (line && line->source && textline_materialise(&buf->arena, line)) {
+        return NULL;
+    }
+
+    return line;
+}
+
+size_t textbuf_line_length(const TextBuffer *buf, size_t pos)
+{
+    size_t start;
+    size_t num_bytes;
+    const char *text;
+    TextLine *line = textbuf_find_line(buf, pos, &start);
+
+    assert(line != NULL);
+
+    if (line->source) {
+        text = textline_bytes(line, pos - start, &num_bytes);
+        return u8strnlen(text, num_bytes);
+    } else {
+        return line->num_chars;
+    }
+}
+
+/* Makes the buffer responsible for freeing a TextSource. */
+static void textbuf_add_source(TextBuffer *buf, TextSource *src)
+{
+    src->next = buf->sources;
+    buf->sources = src;
+}
+
+/* Appends num_lines lines to the TextSource for new text and returns a run
+ * that refers to them. The lines in text are separated by newlines. Returns
+ * NULL in case of error. */
+static TextLine *textbuf_add_text(TextBuffer *buf, const char *text,
+                                  size_t num_bytes, size_t num_lines)
+{
+    const char *end = text + num_bytes;
+    long first = -1;
+    size_t i;
+
+    /* the lines of a run must all be in the same TextSource */
+    if (!buf->add || buf->add->capacity - buf->add->size < num_bytes + 1) {
+        size_t size = ADD_SOURCE_SIZE;
+        TextSource *src;
+
+        while (size < num_bytes + 1) {
+            size *= 2;
+        }
+        if (!(src = textsource_init(size))) {
+            return NULL;
+        }
+        textbuf_add_source(buf, src);
+        buf->add = src;
+    }
+
+    for (i = 0; i < num_lines; ++i) {
+        const char *newline = i + 1 < num_lines
+                              ? memchr(text, '\n', end - text) : end;
+        long n = textsource_append_line(buf->add, text, newline - text);
+        if (n < 0) {
+            return NULL;
+        }
+        if (first < 0) {
+            first = n;
+        }
+        text = newline + 1;
+    }
+
+    return textline_init_run(&buf->arena, buf->add, first, num_lines);
+}
+
+/* Creates a TextLine whose memory comes from the arena of the buffer.
+ * Returns NULL in case of error. */
+static TextLine *textbuf_new_line(TextBuffer *buf, const char *text,
+                                  size_t num_bytes)
+{
+    return textline_init_in(&buf->arena, text, num_bytes);
+}
+
+TextBuffer *textbuf_init(void)
+{
+    TextBuffer *buf = malloc(sizeof(*buf));
+    if (!buf) {
+        return NULL;
+    }
+
+    buf->head = NULL;
+    buf->tail = NULL;
+    lineindex_init(&buf->index);
+    buf->finger.line = NULL;
+    buf->finger.pos = 0;
+    buf->sources = NULL;
+    buf->add = NULL;
+    arena_init(&buf->arena);
+    buf->num_foreign_lines = 0;
+    buf->load_mode = TEXTBUF_LOAD_LINES;
+    buf->load_threads = 0;
+    buf->loader = NULL;
+    buf->load_source = NULL;
+    buf->load_fd = -1;
+    buf->load_lines = 0;
+    buf->load_failed = 0;
+    buf->loaded_dev = 0;
+    buf->loaded_ino = 0;
+    buf->loaded_bytes = 0;
+    buf->last_line_open = 1;
+    buf->save_sync = 0;
+    buf->saved_bytes = 0;
+    buf->save_seconds = 0;
+    buf->searched_bytes = 0;
+    buf->search_seconds = 0;
+    buf->search_wrapped = 0;
+    buf->search_filter = NULL;
+    buf->search_filter_data = NULL;
+    buf->listeners = NULL;
+    buf->line_copy = NULL;
+    buf->line_copy_size = 0;
+    buf->num_lines = 0;
+    textbuf_clear_damage(buf);
+    buf->crow = 0;
+    buf->ccol = 0;
+
+    /* a buffer should always have at least one line */
+    textbuf_append_line(buf, textbuf_new_line(buf, "", 0));
+
+    return buf;
+}
+
+/* Stops loading a file in the background. The lines that have already been
+ * added stay in the buffer. */
+static void textbuf_stop_load(TextBuffer *buf)
+{
+    if (!buf->load_source && buf->load_fd == -1) {
+        return;
+    }
+
+    textloader_free(buf->loader);
+    close(buf->load_fd);
+    /* lines that were copied into TextLines don't need their source */
+    if (buf->load_source && buf->load_mode == TEXTBUF_LOAD_LINES) {
+        textsource_free(buf->load_source);
+    }
+
+    buf->loader = NULL;
+    buf->load_source = NULL;
+    buf->load_fd = -1;
+}
+
+static void textbuf_delete_all_lines(TextBuffer *buf)
+{
+    assert(buf != NULL);
+
+    TextLine *tmp;
+    TextSource *src;
+
+    textbuf_stop_load(buf);
+    tmp = buf->head;
+    src = buf->sources;
+
+    /* Lines from the arena are released all at once, so the lines only need
+     * to be visited if some of them were allocated elsewhere. */
+    while (buf->num_foreign_lines > 0 && tmp) {
+        TextLine *next = tmp->next;
+        if (!tmp->in_arena) {
+            textline_free_in(&buf->arena, tmp);
+            --buf->num_foreign_lines;
+        }
+        tmp = next;
+    }
+    arena_release(&buf->arena);
+
+    while (src) {
+        TextSource *next = src->next;
+        textsource_free(src);
+        src = next;
+    }
+
+    buf->head = NULL;
+    buf->tail = NULL;
+    lineindex_init(&buf->index);
+    buf->finger.line = NULL;
+    buf->finger.pos = 0;
+    buf->sources = NULL;
+    buf->add = NULL;
+    buf->num_lines = 0;
+    buf->damage.all = 1;
+    buf->loaded_bytes = 0;
+    buf->last_line_open = 1;
+}
+
+void textbuf_free(TextBuffer *buf)
+{
+    if (!buf) {
+        return;
+    }
+
+    textbuf_delete_all_lines(buf);
+
+    while (buf->listeners) {
+        struct TextListener *next = buf->listeners->next;
+        free(buf->listeners);
+        buf->listeners = next;
+    }
+    free(buf->line_copy);
+    free(buf);
+}
+
+int textbuf_add_listener(TextBuffer *buf, TextEditListener fn, void *data)
+{
+    struct TextListener *listener;
+    struct TextListener **end;
+
+    assert(buf != NULL);
+    assert(fn != NULL);
+
+    if (!(listener = malloc(sizeof(*listener)))) {
+        return 1;
+    }
+    listener->fn = fn;
+    listener->data = data;
+    listener->next = NULL;
+
+    /* listeners are called in the order they were added */
+    for (end = &buf->listeners; *end; end = &(*end)->next) {
+    }
+    *end = listener;
+    return 0;
+}
+
+void textbuf_remove_listener(TextBuffer *buf, TextEditListener fn,
+                             void *data)
+{
+    struct TextListener **p;
+
+    assert(buf != NULL);
+
+    for (p = &buf->listeners; *p; p = &(*p)->next) {
+        if ((*p)->fn == fn && (*p)->data == data) {
+            struct TextListener *tmp = *p;
+            *p = tmp->next;
+            free(tmp);
+            return;
+        }
+    }
+}
+
+/* Tells the listeners of a buffer about a change. */
+static void textbuf_notify(TextBuffer *buf, TextEditType type, size_t line,
+                           size_t col, size_t end_line, size_t end_col,
+                           const char *text, size_t num_bytes,
+                           const char *removed, size_t num_removed)
+{
+    struct TextListener *listener;
+    TextEdit edit;
+
+    if (!buf->listeners) {
+        return;
+    }
+
+    edit.type = type;
+    edit.line = line;
+    edit.col = col;
+    edit.end_line = end_line;
+    edit.end_col = end_col;
+    edit.text = text;
+    edit.num_bytes = num_bytes;
+    edit.removed = removed;
+    edit.num_removed = num_removed;
+    for (listener = buf->listeners; listener; listener = listener->next) {
+        listener->fn(listener->data, buf, &edit);
+    }
+}
+
+/* Tells the listeners that a whole line was added or replaced. old is the
+ * line that was replaced, or NULL. */
+static void textbuf_notify_line(TextBuffer *buf, TextEditType type,
+                                TextLine *line, TextLine *old, size_t pos)
+{
+    const char *text;
+    const char *removed = NULL;
+    size_t num_bytes;
+    size_t num_removed = 0;
+
+    if (buf->listeners) {
+        text = textline_bytes(line, 0, &num_bytes);
+        if (old) {
+            removed = textline_bytes(old, 0, &num_removed);
+        }
+        textbuf_notify(buf, type, pos, 0, pos, 0, text, num_bytes, removed,
+                       num_removed);
+    }
+}
+
+int textbuf_append_line(TextBuffer *buf, TextLine *line)
+{
+    assert(buf != NULL);
+    assert(line != NULL);
+
+    textbuf_add_line(buf, line, buf->num_lines);
+    return 0;
+}
+
+/* Adds a line like textbuf_insert_line without telling the listeners. */
+static int textbuf_insert_textline(TextBuffer *buf, TextLine *line,
+                                   size_t pos)
+{
+    assert(buf != NULL);
+    assert(line != NULL);
+
+    if (buf->num_lines < pos) {
+        fprintf(stderr,
+                "Can't insert before line %zu because it doesn't exist!\n",
+                pos+1);
+        return 1;
+    }
+
+    if (pos < buf->num_lines && !textbuf_isolate_line(buf, pos)) {
+        return 1;
+    }
+
+    textbuf_add_line(buf, line, pos);
+    return 0;
+}
+
+int textbuf_insert_line(TextBuffer *buf, TextLine *line, size_t pos)
+{
+    if (textbuf_insert_textline(buf, line, pos)) {
+        return 1;
+    }
+    textbuf_notify_line(buf, TEXTEDIT_INSERT_LINE, line, NULL, pos);
+    return 0;
+}
+
+/* Returns a pointer to the last newline in text, or NULL if there isn't
+ * one. */
+static const char *textbuf_last_newline(const char *text, size_t num_bytes)
+{
+    while (num_bytes-- > 0) {
+        if (text[num_bytes] == '\n') {
+            return text + num_bytes;
+        }
+    }
+    return NULL;
+}
+
+/* Frees a list of TextLines that is linked with their next pointers. */
+static void textline_free_list(TextBuffer *buf, TextLine *line)
+{
+    while (line) {
+        TextLine *next = line->next;
+        textline_free_in(&buf->arena, line);
+        line = next;
+    }
+}
+
+/* Inserts text like textbuf_insert_text without telling the listeners. */
+static int textbuf_insert_block(TextBuffer *buf, size_t line, size_t col,
+                                const char *text, size_t num_bytes)
+{
+    TextLine *first, *last, *middle;
+    TextLine *chain, **chain_end;
+    const char *end = text + num_bytes;
+    const char *first_newline, *last_newline;
+    const char *p;
+    size_t count = 1;
+
+    assert(buf != NULL);
+    assert(text != NULL);
+
+    first = textbuf_get_textline(buf, line);
+    if (!first || col > first->num_chars) {
+        return 1;
+    }
+
+    if (!(first_newline = memchr(text, '\n', num_bytes))) {
+        if (textline_insert_in(&buf->arena, first, text, num_bytes, col)) {
+            return 1;
+        }
+        textbuf_damage_lines(buf, line, line);
+        return 0;
+    }
+    last_newline = textbuf_last_newline(text, num_bytes);
+
+    /* The last new line gets the text after col. It must be copied before
+     * the first line is shortened. The first line gets room for the text
+     * before the first newline now, so that nothing can fail after the new
+     * lines have been added. */
+    textline_move_gap(&buf->arena, first, col);
+    if (textline_reserve(&buf->arena, first, first_newline - text + 1)) {
+        return 1;
+    }
+    last = textbuf_new_line(buf, last_newline + 1, end - last_newline - 1);
+    if (!last || textline_insert_in(&buf->arena, last,
+                                    textline_after_gap(first),
+                                    first->num_bytes - first->gap_start,
+                                    last->num_chars)) {
+        textline_free_in(&buf->arena, last);
+        return 1;
+    }
+
+    /* The lines between the first and the last one are collected into a
+     * list that ends with the last line and is added in one go. */
+    chain = last;
+    chain_end = &chain;
+    if (first_newline != last_newline) {
+        const char *begin = first_newline + 1;
+
+        if (buf->load_mode != TEXTBUF_LOAD_LINES) {
+            size_t num_lines = 1;
+            for (p = begin; (p = memchr(p, '\n', last_newline - p)); ++p) {
+                ++num_lines;
+            }
+            middle = textbuf_add_text(buf, begin, last_newline - begin,
+                                      num_lines);
+            if (!middle) {
+                textline_free_in(&buf->arena, last);
+                return 1;
+            }
+            middle->next = last;
+            chain = middle;
+            ++count;
+        } else {
+            for (p = begin; p <= last_newline; ) {
+                const char *newline = memchr(p, '\n', last_newline + 1 - p);
+                middle = textbuf_new_line(buf, p, newline - p);
+                if (!middle) {
+                    textline_free_list(buf, chain);
+                    return 1;
+                }
+                middle->next = last;
+                *chain_end = middle;
+                chain_end = &middle->next;
+                ++count;
+                p = newline + 1;
+            }
+        }
+    }
+
+    /* the first line has a TextLine of its own, so line + 1 isn't in the
+     * middle of a run */
+    if (textbuf_add_lines(buf, chain, last, count, line + 1)) {
+        textline_free_list(buf, chain);
+        return 1;
+    }
+
+    /* there is room for the text, so this can't fail */
+    textline_delete_to_eol_in(&buf->arena, first, col);
+    textline_insert_in(&buf->arena, first, text, first_newline - text, col);
+    textbuf_damage_lines(buf, line, line);
+    return 0;
+}
+
+int textbuf_insert_text(TextBuffer *buf, size_t line, size_t col,
+                        const char *text, size_t num_bytes)
+{
+    if (textbuf_insert_block(buf, line, col, text, num_bytes)) {
+        return 1;
+    }
+    textbuf_notify(buf, TEXTEDIT_INSERT, line, col, line, col, text,
+                   num_bytes, NULL, 0);
+    return 0;
+}
+
+int textbuf_insert_len_at_cursor(TextBuffer *buf, const char *text,
+                                 size_t num_bytes)
+{
+    const char *last_newline;
+
+    assert(buf != NULL);
+    assert(text != NULL);
+
+    if (textbuf_insert_text(buf, buf->crow, buf->ccol, text, num_bytes)) {
+        return 1;
+    }
+
+    /* the cursor goes to the end of the new text */
+    if ((last_newline = textbuf_last_newline(text, num_bytes))) {
+        const char *p = text;
+        while ((p = memchr(p, '\n', last_newline + 1 - p))) {
+            ++buf->crow;
+            ++p;
+        }
+        buf->ccol = u8strnlen(last_newline + 1,
+                              text + num_bytes - last_newline - 1);
+    } else {
+        buf->ccol += u8strnlen(text, num_bytes);
+    }
+    return 0;
+}
+
+int textbuf_insert_at_cursor(TextBuffer *buf, const char *text)
+{
+    assert(text != NULL);
+
+    return textbuf_insert_len_at_cursor(buf, text, strlen(text));
+}
+
+int textbuf_delete_line(TextBuffer *buf, size_t pos)
+{
+    TextLine *tmp;
+    const char *removed = NULL;
+    size_t num_removed = 0;
+
+    assert(buf != NULL);
+
+    if (buf->num_lines <= pos) {
+        fprintf(stderr,
+                "Can't delete line %zu because it doesn't exist!\n", pos+1);
+        return 1;
+    }
+
+    if (!textbuf_isolate_line(buf, pos)) {
+        return 1;
+    }
+    /* the line is freed after the listeners have seen its text */
+    tmp = textbuf_remove_line(buf, pos);
+    if (buf->listeners) {
+        removed = textline_bytes(tmp, 0, &num_removed);
+    }
+    textbuf_notify(buf, TEXTEDIT_DELETE_LINE, pos, 0, pos, 0, NULL, 0,
+                   removed, num_removed);
+    textline_free_in(&buf->arena, tmp);
+
+    /* make sure there's always at least one line in the buffer */
+    if (buf->num_lines == 0) {
+        textbuf_append_line(buf, textbuf_new_line(buf, "", 0));
+        textbuf_move_cursor(buf, INT_MIN, INT_MIN);
+        return 0;
+    }
+
+    if (buf->crow == buf->num_lines) {
+        textbuf_move_cursor(buf, -1, 0);
+    }
+
+    /* If the next line is shorter than the deleted one, the cursor may be past
+     * its end. Move the cursor if that is the case. */
+    if (textbuf_col_num(buf)
+        >= textbuf_line_length(buf, textbuf_line_num(buf))) {
+        textbuf_move_cursor(buf, 0, INT_MAX);
+    }
+
+    return 0;
+}
+
+int textbuf_delete_text(TextBuffer *buf, size_t line1, size_t col1,
+                        size_t line2, size_t col2)
+{
+    TextLine *first, *last;
+    const char *tail;
+    size_t tail_bytes;
+    size_t offset;
+    char *removed = NULL;
+    size_t num_removed = 0;
+
+    assert(buf != NULL);
+
+    if (line2 >= buf->num_lines || line1 > line2
+        || (line1 == line2 && col1 > col2)
+        || col1 > textbuf_line_length(buf, line1)
+        || col2 > textbuf_line_length(buf, line2)) {
+        return 1;
+    }
+
+    /* the listeners get a copy of the text that is deleted */
+    if (buf->listeners) {
+        num_removed = textbuf_get_text(buf, line1, col1, line2, col2, NULL,
+                                       0);
+        if (num_removed > 0) {
+            if (!(removed = malloc(num_removed))) {
+                return 1;
+            }
+            textbuf_get_text(buf, line1, col1, line2, col2, removed,
+                             num_removed);
+        }
+    }
+
+    if (!(first = textbuf_get_textline(buf, line1))) {
+        free(removed);
+        return 1;
+    }
+
+    if (line1 == line2) {
+        if (textline_delete_in(&buf->arena, first, col1, col2 - col1)) {
+            free(removed);
+            return 1;
+        }
+    } else {
+        /* The text after col2 is moved to the end of the first line before
+         * the lines after it are deleted. */
+        if (!(last = textbuf_isolate_line(buf, line2))) {
+            free(removed);
+            return 1;
+        }
+        tail = textline_bytes(last, 0, &tail_bytes);
+        u8_find_pos_n(tail, tail_bytes, col2, &offset);
+        if (textline_delete_to_eol_in(&buf->arena, first, col1)
+            || textline_insert_in(&buf->arena, first, tail + offset,
+                                  tail_bytes - offset, col1)) {
+            free(removed);
+            return 1;
+        }
+        textbuf_delete_lines(buf, line1 + 1, line2 - line1);
+    }
+    textbuf_damage_lines(buf, line1, line1);
+    textbuf_notify(buf, TEXTEDIT_DELETE, line1, col1, line2, col2, NULL, 0,
+                   removed, num_removed);
+    free(removed);
+
+    /* the cursor stays on the same text if it wasn't deleted */
+    if ((size_t) buf->crow > line2) {
+        buf->crow -= line2 - line1;
+    } else if ((size_t) buf->crow == line2 && (size_t) buf->ccol >= col2) {
+        buf->crow = line1;
+        buf->ccol = col1 + (buf->ccol - col2);
+    } else if ((size_t) buf->crow > line1
+               || ((size_t) buf->crow == line1 && (size_t) buf->ccol > col1)) {
+        buf->crow = line1;
+        buf->ccol = col1;
+    }
+    return 0;
+}
+
+int textbuf_replace_line(TextBuffer *buf, TextLine *line, size_t pos)
+{
+    TextLine *tmp;
+
+    assert(buf != NULL);
+    assert(line != NULL);
+
+    if (buf->num_lines <= pos) {
+        fprintf(stderr,
+                "Can't replace line %zu because it doesn't exist!\n", pos+1);
+        return 1;
+    }
+
+    if (!textbuf_isolate_line(buf, pos)) {
+        return 1;
+    }
+
+    textbuf_damage_lines(buf, pos, pos);
+    tmp = lineindex_replace(&buf->index, line, pos);
+    textbuf_link_line(buf, line, tmp->prev, tmp->next);
+    if (!tmp->in_arena) {
+        --buf->num_foreign_lines;
+    }
+
+    buf->finger.line = line;
+    buf->finger.pos = pos;
+    textbuf_notify_line(buf, TEXTEDIT_REPLACE_LINE, line, tmp, pos);
+    textline_free_in(&buf->arena, tmp);
+    return 0;
+}
+
+int textbuf_join_with_next_line(TextBuffer *buf, size_t pos)
+{
+    int old_num_chars;
+    TextLine *tmp;
+    TextLine *next;
+    const char *text;
+    size_t num_bytes;
+    if (pos >= (buf->num_lines - 1)) {
+        return 1;
+    }
+
+    tmp = textbuf_get_textline(buf, pos);
+    next = textbuf_isolate_line(buf, pos + 1);
+    if (!tmp || !next) {
+        return 1;
+    }
+    old_num_chars = tmp->num_chars;
+    text = textline_bytes(next, 0, &num_bytes);
+    if (textline_insert_in(&buf->arena, tmp, text, num_bytes,
+                           tmp->num_chars)) {
+        return 1;
+    }
+    textline_free_in(&buf->arena, textbuf_remove_line(buf, pos + 1));
+    textbuf_damage_lines(buf, pos, pos);
+    buf->crow = pos;
+    buf->ccol = old_num_chars;
+    textbuf_notify(buf, TEXTEDIT_JOIN, pos, old_num_chars, pos, 0, NULL, 0,
+                   "\n", 1);
+    return 0;
+}
+
+int textbuf_split_line(TextBuffer *buf, size_t line, size_t pos)
+{
+    TextLine *tmp;
+    TextLine *new_line;
+    const char *tail;
+    size_t tail_bytes;
+    
+    tmp = textbuf_get_textline(buf, line);
+    if (!tmp || pos > tmp->num_chars) {
+        return 1;
+    }
+
+    if (pos == tmp->num_chars) {
+        new_line = textbuf_new_line(buf, "", 0);
+        if (!new_line || textbuf_insert_textline(buf, new_line, line+1)) {
+            return 1;
+        }
+    } else {
+        /* the text after the gap is the new line */
+        textline_move_gap(&buf->arena, tmp, pos);
+        tail = textline_after_gap(tmp);
+        tail_bytes = tmp->num_bytes - tmp->gap_start;
+
+        if (buf->load_mode != TEXTBUF_LOAD_LINES) {
+            new_line = textbuf_add_text(buf, tail, tail_bytes, 1);
+        } else {
+            new_line = textbuf_new_line(buf, tail, tail_bytes);
+        }
+        if (!new_line || textbuf_insert_textline(buf, new_line, line+1)) {
+            return 1;
+        }
+
+        if (textline_delete_to_eol_in(&buf->arena, tmp, pos)) {
+            return 1;
+        }
+        textbuf_damage_lines(buf, line, line);
+    }
+
+    textbuf_notify(buf, TEXTEDIT_SPLIT, line, pos, line, pos, NULL, 0, NULL,
+                   0);
+    return 0;
+}
+
+static void textbuf_load_lines_from_file(TextBuffer *buf, FILE *fp)
+{
+    assert(buf != NULL);
+    assert(fp != NULL);
+
+    char *line = NULL;
+    size_t n = 0;
+    ssize_t num_bytes = 0;
+    while ((num_bytes = getline(&line, &n, fp)) != -1) {
+        buf->loaded_bytes += num_bytes;
+        buf->last_line_open = 1;
+        /* the line may contain null characters, so only its end is checked */
+        if (num_bytes > 0 && line[num_bytes-1] == '\n') {
+            --num_bytes;
+            buf->last_line_open = 0;
+        }
+        textbuf_append_line(buf, textbuf_new_line(buf, line, num_bytes));
+    }
+    free(line);
+}
+
+/* Remembers which file is being loaded. */
+static void textbuf_set_loaded_file(TextBuffer *buf, int fd)
+{
+    struct stat st;
+
+    if (fstat(fd, &st) == 0) {
+        buf->loaded_dev = st.st_dev;
+        buf->loaded_ino = st.st_ino;
+    }
+}
+
+/* Remembers how much of the file the first num_lines lines of src cover. */
+static void textbuf_set_loaded_bytes(TextBuffer *buf, const TextSource *src,
+                                     size_t num_lines)
+{
+    size_t end = textsource_line_offset(src, num_lines);
+
+    /* the last line of an unterminated source ends one past the file */
+    buf->last_line_open = num_lines == 0
+                          || (num_lines == src->num_lines
+                              && src->unterminated);
+    buf->loaded_bytes = num_lines > 0 && buf->last_line_open ? end - 1 : end;
+}
+
+/* Loads the whole file into one TextSource, either by reading it or by
+ * mapping it into memory. Returns 0 on success. */
+static int textbuf_load_source_from_file(TextBuffer *buf, FILE *fp)
+{
+    TextSource *src = NULL;
+    TextLine *run;
+
+    assert(buf != NULL);
+    assert(fp != NULL);
+
+    /* files that can't be mapped (pipes, for example) are read instead */
+    if (buf->load_mode == TEXTBUF_LOAD_MMAP) {
+        src = textsource_map_file(fileno(fp), buf->load_threads);
+    }
+    if (!src && !(src = textsource_read_file(fp, buf->load_threads))) {
+        return 1;
+    }
+    textbuf_add_source(buf, src);
+
+    /* Without the file unmodified lines are saved from memory, which is
+     * slower but works just as well. */
+    textsource_attach_file(src, fileno(fp));
+    textbuf_set_loaded_bytes(buf, src, src->num_lines);
+
+    if (src->num_lines > 0) {
+        if (!(run = textline_init_run(&buf->arena, src, 0,
+                                      src->num_lines))) {
+            return 1;
+        }
+        textbuf_append_line(buf, run);
+    }
+    return 0;
+}
+
+void textbuf_set_load_mode(TextBuffer *buf, TextBufLoadMode mode)
+{
+    assert(buf != NULL);
+
+    buf->load_mode = mode;
+}
+
+void textbuf_set_save_sync(TextBuffer *buf, int sync)
+{
+    assert(buf != NULL);
+
+    buf->save_sync = sync;
+}
+
+void textbuf_set_load_threads(TextBuffer *buf, int num_threads)
+{
+    assert(buf != NULL);
+
+    buf->load_threads = num_threads;
+}
+
+int textbuf_load_file(TextBuffer *buf, const char *filename)
+{
+    int err = 0;
+
+    assert(buf != NULL);
+    assert(filename != NULL);
+
+    FILE *fp = fopen(filename, "r");
+    if (!fp) {
+        fprintf(stderr, "Couldn't open file %s for reading\n", filename);
+        return 1;
+    }
+
+    textbuf_delete_all_lines(buf);
+    textbuf_set_loaded_file(buf, fileno(fp));
+    if (buf->load_mode != TEXTBUF_LOAD_LINES) {
+        err = textbuf_load_source_from_file(buf, fp);
+    } else {
+        textbuf_load_lines_from_file(buf, fp);
+    }
+
+    /* an empty file still has one empty line */
+    if (buf->num_lines == 0) {
+        textbuf_append_line(buf, textbuf_new_line(buf, "", 0));
+    }
+
+    fclose(fp);
+    return err;
+}
+
+int textbuf_load_file_async(TextBuffer *buf, const char *filename)
+{
+    TextSource *src;
+    int fd;
+
+    assert(buf != NULL);
+    assert(filename != NULL);
+
+    if ((fd = open(filename, O_RDONLY)) == -1) {
+        fprintf(stderr, "Couldn't open file %s for reading\n", filename);
+        return 1;
+    }
+
+    /* Lines are copied out of the TextSource in the LINES mode, so there's
+     * no point in mapping the file then. */
+    src = textsource_open_file(fd, buf->load_mode == TEXTBUF_LOAD_MMAP);
+    if (!src) {
+        close(fd);
+        return textbuf_load_file(buf, filename);
+    }
+
+    textbuf_delete_all_lines(buf);
+    textbuf_set_loaded_file(buf, fd);
+    buf->load_source = src;
+    buf->load_fd = fd;
+    buf->load_lines = 0;
+    buf->load_failed = 0;
+    if (buf->load_mode != TEXTBUF_LOAD_LINES) {
+        textbuf_add_source(buf, src);
+        textsource_attach_file(src, fd);
+    }
+
+    if (!(buf->loader = textloader_start(src, fd, buf->load_threads))) {
+        textbuf_stop_load(buf);
+        return textbuf_load_file(buf, filename);
+    }
+
+    /* a buffer should always have at least one line */
+    while (buf->num_lines == 0 && textbuf_poll_load(buf, 1)) {
+    }
+    return buf->load_failed;
+}
+
+/* Adds the lines that the loader has found to the end of the buffer. */
+static void textbuf_add_loaded_lines(TextBuffer *buf)
+{
+    TextSource *src = buf->load_source;
+    size_t first = buf->load_lines;
+    size_t count = src->num_lines - first;
+    TextLine *tail = buf->tail;
+    size_t i;
+
+    if (count == 0) {
+        return;
+    }
+
+    if (buf->load_mode == TEXTBUF_LOAD_LINES) {
+        TextLine *chain = NULL;
+        TextLine *last = NULL;
+
+        if (count > LOAD_MAX_COPY_LINES) {
+            count = LOAD_MAX_COPY_LINES;
+        }
+        for (i = first; i < first + count; ++i) {
+            TextLine *line = textbuf_new_line(buf, textsource_line(src, i),
+                                              textsource_line_length(src, i));
+            if (!line) {
+                break;
+            }
+            line->next = NULL;
+            if (last) {
+                last->next = line;
+            } else {
+                chain = line;
+            }
+            last = line;
+        }
+        if (i < first + count
+            || textbuf_add_lines(buf, chain, last, count, buf->num_lines)) {
+            textline_free_list(buf, chain);
+            buf->load_failed = 1;
+            return;
+        }
+    } else if (tail && tail->source == src
+               && tail->source_line + tail->run_length == first) {
+        /* make the last run longer instead of adding another one */
+        size_t start = buf->num_lines - tail->run_length;
+        lineindex_remove(&buf->index, start);
+        tail->run_length += count;
+        lineindex_insert(&buf->index, tail, start);
+        textbuf_damage_shift(buf, buf->num_lines, count);
+        buf->num_lines += count;
+    } else {
+        TextLine *run = textline_init_run(&buf->arena, src, first, count);
+        if (!run) {
+            buf->load_failed = 1;
+            return;
+        }
+        textbuf_add_line(buf, run, buf->num_lines);
+    }
+
+    buf->load_lines = first + count;
+}
+
+int textbuf_load_stream(TextBuffer *buf, int fd)
+{
+    int flags;
+
+    assert(buf != NULL);
+
+    /* the stream is read only as far as it can be without waiting */
+    if ((flags = fcntl(fd, F_GETFL)) == -1
+        || fcntl(fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        return 1;
+    }
+
+    textbuf_delete_all_lines(buf);
+    buf->load_fd = fd;
+    buf->load_failed = 0;
+    buf->loaded_dev = 0;
+    buf->loaded_ino = 0;
+    textbuf_append_line(buf, textbuf_new_line(buf, "", 0));
+    return 0;
+}
+
+/* Reads what is available from the stream being loaded, at most
+ * STREAM_BLOCK_SIZE bytes, and adds it to the buffer. Returns like
+ * textbuf_poll_load. */
+static int textbuf_poll_stream(TextBuffer *buf, int wait)
+{
+    char *block;
+    size_t num_bytes = 0;
+    int eof = 0;
+
+    if (!(block = malloc(STREAM_BLOCK_SIZE))) {
+        buf->load_failed = 1;
+        textbuf_stop_load(buf);
+        return 0;
+    }
+
+    if (wait) {
+        struct pollfd pfd = { buf->load_fd, POLLIN, 0 };
+        while (poll(&pfd, 1, -1) == -1 && errno == EINTR) {
+        }
+    }
+
+    while (num_bytes < STREAM_BLOCK_SIZE) {
+        ssize_t n = read(buf->load_fd, block + num_bytes,
+                         STREAM_BLOCK_SIZE - num_bytes);
+        if (n > 0) {
+            num_bytes += n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else {
+            /* nothing more to read for now, unless the stream has ended */
+            if (n == 0) {
+                eof = 1;
+            } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                buf->load_failed = 1;
+                eof = 1;
+            }
+            break;
+        }
+    }
+
+    if (num_bytes > 0 && textbuf_append_text(buf, block, num_bytes)) {
+        buf->load_failed = 1;
+        eof = 1;
+    }
+    free(block);
+
+    if (eof) {
+        textbuf_stop_load(buf);
+        return 0;
+    }
+    return num_bytes == STREAM_BLOCK_SIZE ? 2 : 1;
+}
+
+int textbuf_poll_load(TextBuffer *buf, int wait)
+{
+    int done;
+
+    assert(buf != NULL);
+
+    if (!buf->load_source) {
+        return buf->load_fd != -1 ? textbuf_poll_stream(buf, wait) : 0;
+    }
+
+    /* everything that was found before the loader was done is taken now */
+    done = textloader_done(buf->loader);
+    textloader_take_lines(buf->loader,
+                          wait && buf->load_lines == buf->load_source->num_lines);
+    textbuf_add_loaded_lines(buf);
+
+    if (buf->load_failed) {
+        done = 1;
+    } else if (buf->load_lines < buf->load_source->num_lines) {
+        return 2;
+    } else if (!done) {
+        return 1;
+    }
+
+    buf->load_failed |= textloader_failed(buf->loader);
+    textbuf_set_loaded_bytes(buf, buf->load_source, buf->load_lines);
+    textbuf_stop_load(buf);
+
+    /* an empty file still has one empty line */
+    if (buf->num_lines == 0) {
+        textbuf_append_line(buf, textbuf_new_line(buf, "", 0));
+    }
+    return 0;
+}
+
+int textbuf_append_text(TextBuffer *buf, const char *text, size_t num_bytes)
+{
+    size_t last;
+    size_t len = num_bytes;
+
+    assert(buf != NULL);
+    assert(text != NULL);
+
+    if (num_bytes == 0) {
+        return 0;
+    }
+
+    /* The text continues the last line if the file didn't end with a
+     * newline. Otherwise it begins a new line. The newline at its end only
+     * ends the last line, so it doesn't make a line of its own. */
+    last = buf->num_lines - 1;
+    if (!buf->last_line_open) {
+        if (textbuf_insert_block(buf, last, textbuf_line_length(buf, last),
+                                "\n", 1)) {
+            return 1;
+        }
+        ++last;
+    }
+    if (text[num_bytes-1] == '\n') {
+        --len;
+    }
+
+    if (textbuf_insert_block(buf, last, textbuf_line_length(buf, last), text,
+                             len)) {
+        return 1;
+    }
+    buf->loaded_bytes += num_bytes;
+    buf->last_line_open = text[num_bytes-1] != '\n';
+    return 0;
+}
+
+int textbuf_append_from_file(TextBuffer *buf, const char *filename)
+{
+    struct stat st;
+    char *text;
+    int fd;
+    int err = 0;
+
+    assert(buf != NULL);
+    assert(filename != NULL);
+
+    /* the file may be missing for a moment while it's being replaced */
+    if ((fd = open(filename, O_RDONLY)) == -1) {
+        return errno != ENOENT;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return 1;
+    }
+    if (st.st_dev != buf->loaded_dev || st.st_ino != buf->loaded_ino) {
+        close(fd);
+        return 2;
+    }
+    if ((size_t) st.st_size <= buf->loaded_bytes) {
+        close(fd);
+        return (size_t) st.st_size < buf->loaded_bytes ? 2 : 0;
+    }
+
+    /* the new text is added a block at a time, however much there is */
+    if (!(text = malloc(STREAM_BLOCK_SIZE))) {
+        close(fd);
+        return 1;
+    }
+    while (!err && buf->loaded_bytes < (size_t) st.st_size) {
+        size_t n = st.st_size - buf->loaded_bytes;
+        ssize_t num_read;
+        if (n > STREAM_BLOCK_SIZE) {
+            n = STREAM_BLOCK_SIZE;
+        }
+        num_read = pread(fd, text, n, buf->loaded_bytes);
+        if (num_read < 0 && errno == EINTR) {
+            continue;
+        } else if (num_read <= 0) {
+            break;
+        }
+        err = textbuf_append_text(buf, text, num_read);
+    }
+    close(fd);
+    free(text);
+    return err;
+}
+
+double textbuf_load_progress(const TextBuffer *buf)
+{
+    const TextSource *src;
+
+    assert(buf != NULL);
+
+    src = buf->load_source;
+    if (!src && buf->load_fd != -1) {
+        return 0;
+    } else if (!src || src->size == 0) {
+        return 1;
+    }
+    return (double) textsource_line_offset(src, buf->load_lines) / src->size;
+}
+
+/* Opens a new temporary file in the same directory as filename, with the
+ * permissions, owner and group of filename if it exists. The name of the
+ * file is stored in tmpname, which must be at least strlen(filename) + 8
+ * bytes. If keep_file is non-zero and renaming the new file over the old one
+ * would break hard links or change the owner, nothing is created. Returns a
+ * file descriptor, or -1 in case of error. */
+static int textbuf_open_temp_file(const char *filename, char *tmpname,
+                                  int keep_file)
+{
+    struct stat st;
+    int exists = stat(filename, &st) == 0;
+    int fd;
+
+    /* the other names of the file would keep the old text */
+    if (exists && keep_file && st.st_nlink > 1) {
+        return -1;
+    }
+
+    sprintf(tmpname, "%s.XXXXXX", filename);
+    if ((fd = mkstemp(tmpname)) == -1) {
+        return -1;
+    }
+
+    /* keep the owner and permissions of the old file, or give a new one the
+     * same permissions that open would; chown comes first since it may
+     * clear the set-user-ID bit */
+    if (exists) {
+        if (fchown(fd, st.st_uid, st.st_gid) != 0 && keep_file) {
+            close(fd);
+            unlink(tmpname);
+            return -1;
+        }
+        fchmod(fd, st.st_mode & 07777);
+    } else {
+        mode_t mask = umask(0);
+        umask(mask);
+        fchmod(fd, 0666 & ~mask);
+    }
+    return fd;
+}
+
+/* Collects the text of a file into batches that are written with one writev
+ * call each. Short pieces are copied together into a staging buffer and long
+ * ones are written from where they are. */
+typedef struct SaveWriter
+{
+    int fd;
+    struct iovec iov[SAVE_IOV_MAX];
+    int num_iov;
+    char *stage;
+    size_t stage_used;
+    /** number of bytes written so far */
+    size_t num_bytes;
+    int failed;
+    /** the TextSource whose file can be copied from, or NULL */
+    const TextSource *file_source;
+    /** the fastest way to copy from the file that hasn't failed */
+    enum { COPY_FILE_RANGE, COPY_SENDFILE, COPY_PREAD } copy_method;
+} SaveWriter;
+
+/* Writes everything that has been collected. */
+static void savewriter_flush(SaveWriter *w)
+{
+    struct iovec *iov = w->iov;
+    int num_iov = w->num_iov;
+
+    while (num_iov > 0 && !w->failed) {
+        ssize_t n = writev(w->fd, iov, num_iov);
+        if (n < 0) {
+            w->failed = (errno != EINTR);
+            continue;
+        }
+        w->num_bytes += n;
+
+        /* skip what was written; writev may stop anywhere */
+        while (num_iov > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            ++iov;
+            --num_iov;
+        }
+        if (num_iov > 0) {
+            iov->iov_base = (char *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+
+    w->num_iov = 0;
+    w->stage_used = 0;
+}
+
+/* Adds num_bytes bytes of text to the file. Text that isn't copied must stay
+ * valid until the next flush. */
+static void savewriter_add(SaveWriter *w, const char *text, size_t num_bytes)
+{
+    struct iovec *last;
+
+    if (num_bytes == 0) {
+        return;
+    }
+
+    if (num_bytes >= SAVE_COPY_LIMIT) {
+        if (w->num_iov == SAVE_IOV_MAX) {
+            savewriter_flush(w);
+        }
+        w->iov[w->num_iov].iov_base = (char *) text;
+        w->iov[w->num_iov].iov_len = num_bytes;
+        ++w->num_iov;
+        return;
+    }
 
-    if (buf->num_lines < pos) {
-        fprintf(stderr,
-                "Can't insert before line %zu because it doesn't exist!\n",
-                pos+1);
-        return 1;
+    if (w->stage_used + num_bytes > SAVE_STAGE_SIZE
+        || w->num_iov == SAVE_IOV_MAX) {
+        savewriter_flush(w);
     }
+    memcpy(w->stage + w->stage_used, text, num_bytes);
 
-    if (buf->head == NULL) {
-        buf->head = line;
-        buf->tail = line;
-        line->prev = NULL;
-        line->next = NULL;
-    } else if (pos == buf->num_lines) {
-        return textbuf_append_line(buf, line);
+    /* continue the last piece if it ends where this one begins */
+    last = w->num_iov > 0 ? &w->iov[w->num_iov-1] : NULL;
+    if (last && (char *) last->iov_base + last->iov_len
+                == w->stage + w->stage_used) {
+        last->iov_len += num_bytes;
     } else {
-        TextLine *tmp = textbuf_get_textline(buf, pos);
+        w->iov[w->num_iov].iov_base = w->stage + w->stage_used;
+        w->iov[w->num_iov].iov_len = num_bytes;
+        ++w->num_iov;
+    }
+    w->stage_used += num_bytes;
+}
 
-        /* this should've been handled in the previous if statement unless
-         * num_lines is incorrect */
-        assert(tmp != NULL);
+/* Copies num_bytes bytes from the file fd starting from offset. The
+ * quickest way that works is used: the file system may be able to share or
+ * copy the data without it passing through the process at all. */
+static void savewriter_copy(SaveWriter *w, int fd, off_t offset,
+                            size_t num_bytes)
+{
+    savewriter_flush(w);
+
+    while (num_bytes > 0 && !w->failed) {
+        ssize_t n = -1;
+
+        errno = 0;
+        if (w->copy_method == COPY_FILE_RANGE) {
+#ifdef HAVE_COPY_FILE_RANGE
+            n = copy_file_range(fd, &offset, w->fd, NULL, num_bytes, 0);
+#else
+            errno = ENOSYS;
+#endif
+        } else if (w->copy_method == COPY_SENDFILE) {
+#ifdef HAVE_SENDFILE
+            n = sendfile(w->fd, fd, &offset, num_bytes);
+#else
+            errno = ENOSYS;
+#endif
+        } else {
+            size_t len = num_bytes < SAVE_STAGE_SIZE ? num_bytes
+                                                     : SAVE_STAGE_SIZE;
+            if ((n = pread(fd, w->stage, len, offset)) > 0) {
+                w->iov[0].iov_base = w->stage;
+                w->iov[0].iov_len = n;
+                w->num_iov = 1;
+                offset += n;
+                savewriter_flush(w);
+            }
+        }
 
-        if (tmp->prev) {
-            tmp->prev->next = line;
+        if (n > 0) {
+            /* savewriter_flush has already counted what pread read */
+            if (w->copy_method != COPY_PREAD) {
+                w->num_bytes += n;
+            }
+            num_bytes -= n;
+        } else if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0 && w->copy_method != COPY_PREAD
+                   && (errno == ENOSYS || errno == EXDEV || errno == EINVAL
+                       || errno == EOPNOTSUPP)) {
+            /* try the next way */
+            ++w->copy_method;
         } else {
-            buf->head = line;
+            /* the file has become shorter or can't be read */
+            w->failed = 1;
         }
-        line->prev = tmp->prev;
-        line->next = tmp;
-        tmp->prev = line;
     }
+}
 
-    buf->num_lines += 1;
-    return 0;
+/* Copies a run of unmodified lines from the file that they were loaded from
+ * if the run is long enough to make it worthwhile. The newline after the
+ * last line isn't copied. Returns non-zero if the run was copied. */
+static int savewriter_copy_run(SaveWriter *w, const TextLine *line)
+{
+    const TextSource *src = line->source;
+    size_t last = line->source_line + line->run_length - 1;
+    size_t begin = textsource_line_offset(src, line->source_line);
+    size_t end = textsource_line_offset(src, last)
+                 + textsource_line_length(src, last);
+
+    if (end - begin < SAVE_FILE_COPY_MIN) {
+        return 0;
+    }
+    savewriter_copy(w, src->fd, begin, end - begin);
+    return 1;
 }
 
-int textbuf_insert_at_cursor(TextBuffer *buf, const char *text)
+/* Adds the lines of a TextLine to the file. */
+static void savewriter_add_line(SaveWriter *w, TextLine *line)
 {
-    int err;
-    if ((err = textline_insert(textbuf_get_textline(buf, buf->crow),
-                               text, buf->ccol))) {
-        return err;
+    size_t i;
+    size_t num_bytes;
+    const char *text;
+
+    if (!line->source) {
+        savewriter_add(w, line->text, line->gap_start);
+        savewriter_add(w, textline_after_gap(line),
+                       line->num_bytes - line->gap_start);
+    } else if (line->source == w->file_source
+               && savewriter_copy_run(w, line)) {
+        /* the run was copied from the file */
+    } else if (line->source->mapped) {
+        /* the lines of a run in a mapped file are already separated with
+         * newlines, so the whole run can be written at once */
+        size_t last = line->source_line + line->run_length - 1;
+        text = textsource_line(line->source, line->source_line);
+        num_bytes = textsource_line(line->source, last)
+                    + textsource_line_length(line->source, last) - text;
+        savewriter_add(w, text, num_bytes);
+    } else {
+        for (i = 0; i < line->run_length; ++i) {
+            text = textline_bytes(line, i, &num_bytes);
+            savewriter_add(w, text, num_bytes);
+            if (i + 1 < line->run_length) {
+                savewriter_add(w, "\n", 1);
+            }
+        }
     }
-    textbuf_move_cursor(buf, 0, u8strlen(text));
+    savewriter_add(w, "\n", 1);
 }
 
-int textbuf_delete_line(TextBuffer *buf, size_t pos)
+/* Returns the time in seconds from some fixed point. */
+static double current_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int textbuf_save_file(TextBuffer *buf, const char *filename)
 {
+    SaveWriter w;
+    struct stat st;
     TextLine *tmp;
+    TextSource *src;
+    char *tmpname;
+    char *target;
+    int mapped = 0;
+    double start = current_seconds();
 
     assert(buf != NULL);
+    assert(filename != NULL);
 
-    if (buf->num_lines <= pos) {
-        fprintf(stderr,
-                "Can't delete line %zu because it doesn't exist!\n", pos+1);
-        return 1;
+    for (src = buf->sources; src; src = src->next) {
+        mapped |= src->mapped;
     }
 
-    tmp = textbuf_get_textline(buf, pos);
-
-    if (tmp->prev) {
-        tmp->prev->next = tmp->next;
+    /* The new text is written to a temporary file that is renamed over the
+     * old one, so the old file stays intact if saving fails halfway. A
+     * symbolic link is followed, so that the file it points to is replaced
+     * and not the link. If the directory isn't writable, the file has other
+     * hard links or its owner can't be kept, the file is overwritten in
+     * place instead, unless it's mapped into memory: truncating it would
+     * destroy the lines that are about to be written. */
+    target = realpath(filename, NULL);
+    if (!target && (errno != ENOENT || lstat(filename, &st) == 0)) {
+        /* a link to a file that doesn't exist yet is written through */
+        tmpname = NULL;
+        w.fd = -1;
+    } else if (!(tmpname = malloc(strlen(target ? target : filename) + 8))) {
+        free(target);
+        return 1;
     } else {
-        buf->head = tmp->next;
+        w.fd = textbuf_open_temp_file(target ? target : filename, tmpname,
+                                      !mapped);
     }
-
-    if (tmp->next) {
-        tmp->next->prev = tmp->prev;
-    } else {
-        buf->tail = tmp->prev;
+    if (w.fd == -1) {
+        free(tmpname);
+        tmpname = NULL;
+        if (!mapped) {
+            w.fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        }
+    }
+    if (w.fd == -1) {
+        fprintf(stderr, "Couldn't open file %s for writing\n", filename);
+        free(target);
+        return 1;
     }
 
-    textline_free(tmp);
-    buf->num_lines -= 1;
-
-    if (buf->crow == buf->num_lines) {
-        textbuf_move_cursor(buf, -1, 0);
+    w.num_iov = 0;
+    w.stage_used = 0;
+    w.num_bytes = 0;
+    w.failed = !(w.stage = malloc(SAVE_STAGE_SIZE));
+    w.copy_method = COPY_FILE_RANGE;
+
+    /* unmodified lines are copied from the file only if it hasn't been
+     * changed by someone else */
+    w.file_source = NULL;
+    for (src = buf->sources; src; src = src->next) {
+        if (textsource_file_unchanged(src)) {
+            w.file_source = src;
+            break;
+        }
     }
 
-    /* If the next line is shorter than the deleted one, the cursor may be past
-     * its end. Move the cursor if that is the case. */
-    tmp = textbuf_get_textline(buf, textbuf_line_num(buf));
-    if (textbuf_col_num(buf) >= tmp->num_chars) {
-        textbuf_move_cursor(buf, 0, INT_MAX);
+    for (tmp = buf->head; tmp && !w.failed; tmp = tmp->next) {
+        savewriter_add_line(&w, tmp);
     }
+    savewriter_flush(&w);
+    free(w.stage);
 
-    /* make sure there's always at least one line in the buffer */
-    if (buf->num_lines == 0) {
-        textbuf_append_line(buf, textline_init(""));
-        textbuf_move_cursor(buf, INT_MIN, INT_MIN);
+    if (!w.failed && buf->save_sync && fsync(w.fd) != 0) {
+        w.failed = 1;
+    }
+    if (close(w.fd) != 0 || w.failed
+        || (tmpname && rename(tmpname, target ? target : filename) != 0)) {
+        fprintf(stderr, "Couldn't write file %s\n", filename);
+        if (tmpname) {
+            unlink(tmpname);
+        }
+        free(tmpname);
+        free(target);
+        return 1;
     }
+    free(tmpname);
+    free(target);
 
+    buf->saved_bytes = w.num_bytes;
+    if (stat(filename, &st) == 0) {
+        buf->loaded_dev = st.st_dev;
+        buf->loaded_ino = st.st_ino;
+    }
+    buf->save_seconds = current_seconds() - start;
+    /* the file now holds the buffer, and every line ends with a newline */
+    buf->loaded_bytes = w.num_bytes;
+    buf->last_line_open = 0;
     return 0;
 }
 
-int textbuf_replace_line(TextBuffer *buf, TextLine *line, size_t pos)
+/* Returns how many bytes of a line of num_bytes bytes must be searched to
+ * find every match that begins before the byte end. */
+static size_t search_limit(const SearchPattern *pat, size_t num_bytes,
+                           size_t end)
 {
-    TextLine *tmp;
-
-    assert(buf != NULL);
-    assert(line != NULL);
-
-    if (buf->num_lines <= pos) {
-        fprintf(stderr,
-                "Can't replace line %zu because it doesn't exist!\n", pos+1);
-        return 1;
+    if (end >= num_bytes || num_bytes - end < pat->num_bytes - 1) {
+        return num_bytes;
     }
+    return end + pat->num_bytes - 1;
+}
 
-    tmp = textbuf_get_textline(buf, pos);
+/* Searches the lines first to last of a TextLine for a match that begins at
+ * or after the byte begin of the first line and before the byte end of the
+ * last line. Lines of a run are stored one after another, so they are
+ * searched as one block. The index of the line of the match in the TextLine
+ * and the byte where it begins are stored in *found and *byte, and the
+ * number of bytes looked at is added to *num_searched. Returns 0 if a match
+ * was found. */
+static int textline_search(TextLine *line, const SearchPattern *pat,
+                           int backward, size_t first, size_t begin,
+                           size_t last, size_t end, size_t *found,
+                           size_t *byte, size_t *num_searched)
+{
+    const char *text, *block, *block_end, *hit;
+    size_t num_bytes;
 
-    if (tmp->prev) {
-        tmp->prev->next = line;
+    text = textline_bytes(line, last, &num_bytes);
+    block_end = text + search_limit(pat, num_bytes, end);
+    if (line->source) {
+        block = textsource_line(line->source, line->source_line + first);
     } else {
-        buf->head = line;
+        block = text;
+    }
+    block += begin;
+    if (block >= block_end) {
+        return 1;
     }
 
-    if (tmp->next) {
-        tmp->next->prev = line;
+    if (backward) {
+        hit = search_backward(pat, block, block_end - block);
+        *num_searched += block_end - (hit ? hit : block);
     } else {
-        buf->tail = line;
+        hit = search_forward(pat, block, block_end - block);
+        *num_searched += (hit ? hit + pat->num_bytes : block_end) - block;
     }
-
-    textline_free(tmp);
-    return 0;
-}
-
-int textbuf_join_with_next_line(TextBuffer *buf, size_t pos)
-{
-    int old_num_chars;
-    TextLine *tmp;
-    TextLine *next;
-    if (pos >= (buf->num_lines - 1)) {
+    if (!hit) {
         return 1;
     }
 
-    tmp = textbuf_get_textline(buf, pos);
-    next = tmp->next;
-    old_num_chars = tmp->num_chars;
-    textline_insert(tmp, next->text, tmp->num_chars);
-    if (next->next) {
-        next->next->prev = tmp;
+    if (line->source) {
+        size_t k = textsource_line_at(line->source,
+                                      line->source_line + first,
+                                      line->source_line + last,
+                                      hit - line->source->data);
+        *found = k - line->source_line;
+        *byte = hit - textsource_line(line->source, k);
     } else {
-        buf->tail = tmp;
+        *found = 0;
+        *byte = hit - text;
     }
-    tmp->next = next->next;
-    textline_free(next);
-    buf->crow = pos;
-    buf->ccol = old_num_chars;
-    --buf->num_lines;
     return 0;
 }
 
-int textbuf_split_line(TextBuffer *buf, size_t line, size_t pos)
+/* Searches the lines first to last of the buffer for a match that begins at
+ * or after the byte begin of the first line and before the byte end of the
+ * last line. The line of the match and the byte where it begins are stored
+ * in *line and *byte. Returns 0 if a match was found. */
+static int textbuf_search_range(TextBuffer *buf, const SearchPattern *pat,
+                                int backward, size_t first, size_t begin,
+                                size_t last, size_t end, size_t *line,
+                                size_t *byte)
 {
-    size_t u8pos;
     TextLine *tmp;
-    
-    tmp = textbuf_get_textline(buf, line);
-    if (line >= buf->num_lines || pos > tmp->num_chars) {
-        return 1;
-    }
-
-    if (pos == tmp->num_bytes) {
-        return textbuf_insert_line(buf, textline_init(""), line+1);
-    } else {
-        if (u8_find_pos(tmp->text, pos, &u8pos)) {
-            return 1;
-        }
+    size_t start, found;
 
-        if (textbuf_insert_line(buf, textline_init(tmp->text+u8pos), line+1)) {
-            return 1;
+    tmp = textbuf_find_line(buf, backward ? last : first, &start);
+    while (tmp) {
+        size_t size = textline_size(tmp);
+        size_t a = first > start ? first - start : 0;
+        size_t b = last < start + size - 1 ? last - start : size - 1;
+
+        if (!textline_search(tmp, pat, backward, a,
+                             start + a == first ? begin : 0, b,
+                             start + b == last ? end : SIZE_MAX,
+                             &found, byte, &buf->searched_bytes)) {
+            *line = start + found;
+            return 0;
         }
 
-        if (textline_delete_to_eol(tmp, pos)) {
-            return 1;
+        if (backward) {
+            if (start <= first || !tmp->prev) {
+                break;
+            }
+            tmp = tmp->prev;
+            start -= textline_size(tmp);
+        } else {
+            if (start + size > last) {
+                break;
+            }
+            start += size;
+            tmp = tmp->next;
         }
     }
-
-    return 0;
+    return 1;
 }
 
-static void textbuf_load_lines_from_file(TextBuffer *buf, FILE *fp)
+/* Like textbuf_search_range, but only the lines that the search filter of
+ * the buffer allows are searched. */
+static int textbuf_search_lines(TextBuffer *buf, const SearchPattern *pat,
+                                int backward, size_t first, size_t begin,
+                                size_t last, size_t end, size_t *line,
+                                size_t *byte)
 {
-    assert(buf != NULL);
-    assert(fp != NULL);
+    size_t pos = backward ? last : first;
+    size_t from, to;
 
-    char *line = NULL;
-    size_t n = 0;
-    ssize_t num_chars = 0;
-    while ((num_chars = getline(&line, &n, fp)) != -1) {
-        char *newline;
-        if ((newline = strchr(line, '\n'))) {
-            *newline = '\0';
+    if (!buf->search_filter) {
+        return textbuf_search_range(buf, pat, backward, first, begin, last,
+                                    end, line, byte);
+    }
+
+    while (!buf->search_filter(buf->search_filter_data, buf, pat, backward,
+                               pos, &from, &to)) {
+        /* the group may begin before pos */
+        if (!backward && from < pos) {
+            from = pos;
+        } else if (backward && to > pos) {
+            to = pos;
+        }
+        if (from < first) {
+            from = first;
+        }
+        if (to > last) {
+            to = last;
+        }
+        if (backward ? to < first : from > last) {
+            break;
         }
-        textbuf_append_line(buf, textline_init(line));
-        free(line);
-        line = NULL;
-        n = 0;
+        if (!textbuf_search_range(buf, pat, backward,
+                                  from, from == first ? begin : 0,
+                                  to, to == last ? end : SIZE_MAX,
+                                  line, byte)) {
+            return 0;
+        }
+        if (backward ? from == first : to == last) {
+            break;
+        }
+        pos = backward ? from - 1 : to + 1;
     }
-    free(line);
+    return 1;
 }
 
-int textbuf_load_file(TextBuffer *buf, const char *filename)
+int textbuf_search(TextBuffer *buf, const SearchPattern *pat, int backward,
+                   size_t *line, size_t *col)
 {
+    TextLine *tmp;
+    const char *text;
+    size_t start, pos, num_bytes, found, byte;
+    size_t last = buf->num_lines - 1;
+    double started = current_seconds();
+    int result;
+
     assert(buf != NULL);
-    assert(filename != NULL);
+    assert(pat != NULL);
+    assert(line != NULL);
+    assert(col != NULL);
 
-    FILE *fp = fopen(filename, "r");
-    if (!fp) {
-        fprintf(stderr, "Couldn't open file %s for reading\n", filename);
+    buf->searched_bytes = 0;
+    buf->search_wrapped = 0;
+    if (!(tmp = textbuf_find_line(buf, *line, &start))) {
+        buf->search_seconds = 0;
         return 1;
     }
 
-    textbuf_delete_all_lines(buf);
-    textbuf_load_lines_from_file(buf, fp);
+    /* forward searches begin after the character at col and backward
+     * searches before it */
+    text = textline_bytes(tmp, *line - start, &num_bytes);
+    if (u8_find_pos_n(text, num_bytes, *col + !backward, &pos)) {
+        pos = num_bytes;
+    }
 
-    fclose(fp);
-    return 0;
+    if (!backward) {
+        result = textbuf_search_lines(buf, pat, 0, *line, pos, last,
+                                      SIZE_MAX, &found, &byte);
+        if (result) {
+            buf->search_wrapped = 1;
+            result = textbuf_search_lines(buf, pat, 0, 0, 0, *line,
+                                          SIZE_MAX, &found, &byte);
+        }
+    } else {
+        result = textbuf_search_lines(buf, pat, 1, 0, 0, *line, pos,
+                                      &found, &byte);
+        if (result) {
+            buf->search_wrapped = 1;
+            result = textbuf_search_lines(buf, pat, 1, *line, 0, last,
+                                          SIZE_MAX, &found, &byte);
+        }
+    }
+
+    if (!result) {
+        tmp = textbuf_find_line(buf, found, &start);
+        text = textline_bytes(tmp, found - start, &num_bytes);
+        *line = found;
+        *col = u8strnlen(text, byte);
+    }
+    buf->search_seconds = current_seconds() - started;
+    return result;
 }
 
-int textbuf_save_file(TextBuffer *buf, const char *filename)
+void textbuf_set_search_filter(TextBuffer *buf, TextSearchFilter fn,
+                               void *data)
 {
-    FILE *fp;
-    TextLine *tmp;
-
     assert(buf != NULL);
-    assert(filename != NULL);
-
-    fp = fopen(filename, "w");
-    if (!fp) {
-        fprintf(stderr, "Couldn't open file %s for writing\n", filename);
-        return 1;
-    }
-
-    tmp = buf->head;
-    while (tmp) {
-        fprintf(fp, "%s\n", tmp->text);
-        tmp = tmp->next;
-    }
 
-    fclose(fp);
-    return 0;
+    buf->search_filter = fn;
+    buf->search_filter_data = data;
 }
 
 void textbuf_move_cursor(TextBuffer *buf, int dy, int dx)
@@ -491,7 +2742,7 @@ void textbuf_move_cursor(TextBuffer *buf, int dy, int dx)
     if (dx == INT_MIN) {
         buf->ccol = 0;
     } else if (dx == INT_MAX) {
-        buf->ccol = textbuf_get_textline(buf, buf->crow)->num_chars;
+        buf->ccol = textbuf_line_length(buf, buf->crow);
     } else {
         buf->ccol += dx;
     }
@@ -504,8 +2755,8 @@ void textbuf_move_cursor(TextBuffer *buf, int dy, int dx)
 
     if (buf->ccol < 0) {
         buf->ccol = 0;
-    } else if (buf->ccol > textbuf_get_textline(buf, buf->crow)->num_chars) {
-        buf->ccol = textbuf_get_textline(buf, buf->crow)->num_chars;
+    } else if (buf->ccol > textbuf_line_length(buf, buf->crow)) {
+        buf->ccol = textbuf_line_length(buf, buf->crow);
     }
 }
 
@@ -521,13 +2772,9 @@ int textbuf_col_num(TextBuffer *buf)
 
 int textbuf_delete_char(TextBuffer *buf)
 {
-    /* First byte that should be deleted. Remember, UTF-8 characters can be
-     * more than one byte! */
-    size_t first_to_delete;
-    /* How many bytes must be deleted? */
-    size_t deleted_bytes;
-    size_t i;
     TextLine *tmp;
+    const char *removed = NULL;
+    size_t num_removed = 0;
 
     assert(buf != NULL);
 
@@ -540,45 +2787,318 @@ int textbuf_delete_char(TextBuffer *buf)
         return 0; /* cursor is one character past the end of the line */
     }
 
-    if (u8_find_pos(tmp->text, buf->ccol, &first_to_delete)) {
-        return 1;
+    /* Deleting a character only widens the gap over it, so its bytes stay
+     * where they are for the listeners. */
+    if (buf->listeners) {
+        textline_move_gap(&buf->arena, tmp, buf->ccol);
+        removed = textline_after_gap(tmp);
+        u8_find_pos_n(removed, tmp->num_bytes - tmp->gap_start, 1,
+                      &num_removed);
     }
 
-    deleted_bytes = u8_char_length(tmp->text[first_to_delete]);
-
-    if (deleted_bytes == -1) {
+    textbuf_damage_lines(buf, buf->crow, buf->crow);
+    if (textline_delete_in(&buf->arena, tmp, buf->ccol, 1)) {
         return 1;
     }
-
-    for (i = first_to_delete; i <= tmp->num_bytes - deleted_bytes; ++i) {
-        tmp->text[i] = tmp->text[i+deleted_bytes];
-    }
-
-    tmp->num_bytes -= deleted_bytes;
-    tmp->num_chars -= 1;
+    textbuf_notify(buf, TEXTEDIT_DELETE, buf->crow, buf->ccol, buf->crow,
+                   buf->ccol + 1, NULL, 0, removed, num_removed);
     return 0;
 }
 
 const char *textbuf_get_line(const TextBuffer *buf, size_t line)
 {
+    size_t start;
+    size_t num_bytes;
+    const char *text;
+    TextLine *tmp;
+    /* the copy is just a temporary buffer, so it can be changed even if the
+     * buffer is otherwise constant */
+    TextBuffer *mutable_buf = (TextBuffer *) buf;
+
     if (buf->num_lines <= line) {
         return NULL;
+    }
+
+    tmp = textbuf_find_line(buf, line, &start);
+    if (!tmp) {
+        return NULL;
+    }
+
+    text = textline_bytes(tmp, line - start, &num_bytes);
+    if (!tmp->source || !tmp->source->mapped) {
+        return text;
+    }
+
+    /* lines in a mapped file aren't null terminated, so make a copy */
+    if (buf->line_copy_size < num_bytes + 1) {
+        size_t new_size = buf->line_copy_size ? buf->line_copy_size : 64;
+        char *new_copy;
+        while (new_size < num_bytes + 1) {
+            new_size *= 2;
+        }
+        if (!(new_copy = realloc(buf->line_copy, new_size))) {
+            return NULL;
+        }
+        mutable_buf->line_copy = new_copy;
+        mutable_buf->line_copy_size = new_size;
+    }
+    memcpy(buf->line_copy, text, num_bytes);
+    buf->line_copy[num_bytes] = '\0';
+    return buf->line_copy;
+}
+
+int textbuf_get_line_spans(const TextBuffer *buf, size_t line,
+                           TextSpan spans[2])
+{
+    size_t start;
+    TextLine *tmp;
+
+    assert(buf != NULL);
+    assert(spans != NULL);
+
+    if (!(tmp = textbuf_find_line(buf, line, &start))) {
+        return 1;
+    }
+
+    if (tmp->source) {
+        spans[0].text = textsource_line(tmp->source,
+                                        tmp->source_line + line - start);
+        spans[0].num_bytes = textsource_line_length(tmp->source,
+                                                    tmp->source_line
+                                                    + line - start);
+        spans[1].text = spans[0].text + spans[0].num_bytes;
+        spans[1].num_bytes = 0;
     } else {
-        TextLine *tmp = textbuf_get_textline(buf, line);
-        if (!tmp) {
+        spans[0].text = tmp->text;
+        spans[0].num_bytes = tmp->gap_start;
+        spans[1].text = textline_after_gap(tmp);
+        spans[1].num_bytes = tmp->num_bytes - tmp->gap_start;
+    }
+    return 0;
+}
+
+/* Returns the byte offset of the character pos in the text of two spans. */
+static size_t spans_find_pos(const TextSpan spans[2], size_t pos)
+{
+    size_t offset;
+
+    if (!u8_find_pos_n(spans[0].text, spans[0].num_bytes, pos, &offset)) {
+        return offset;
+    }
+    pos -= u8strnlen(spans[0].text, spans[0].num_bytes);
+    u8_find_pos_n(spans[1].text, spans[1].num_bytes, pos, &offset);
+    return spans[0].num_bytes + offset;
+}
+
+size_t textbuf_get_text(const TextBuffer *buf, size_t line1, size_t col1,
+                        size_t line2, size_t col2, char *dest, size_t size)
+{
+    TextSpan spans[2];
+    size_t total = 0;
+    size_t line;
+    int i;
+
+    assert(buf != NULL);
+    assert(dest != NULL || size == 0);
+
+    if (line2 >= buf->num_lines || line1 > line2
+        || (line1 == line2 && col1 > col2)) {
+        return 0;
+    }
+
+    for (line = line1; line <= line2; ++line) {
+        size_t begin = 0;
+        size_t end;
+
+        textbuf_get_line_spans(buf, line, spans);
+        end = spans[0].num_bytes + spans[1].num_bytes;
+        if (line == line1) {
+            begin = spans_find_pos(spans, col1);
+        }
+        if (line == line2) {
+            end = spans_find_pos(spans, col2);
+        }
+
+        /* copy the part of [begin, end) that is in each span */
+        for (i = 0; i < 2; ++i) {
+            size_t n = spans[i].num_bytes;
+            if (begin < end && begin < n) {
+                size_t len = (end < n ? end : n) - begin;
+                if (total < size) {
+                    memcpy(dest + total, spans[i].text + begin,
+                           len < size - total ? len : size - total);
+                }
+                total += len;
+            }
+            begin = begin > n ? begin - n : 0;
+            end = end > n ? end - n : 0;
+        }
+
+        if (line < line2) {
+            if (total < size) {
+                dest[total] = '\n';
+            }
+            ++total;
+        }
+    }
+    return total;
+}
+
+/* Adds a new empty block to the end of an array of size *size. Returns NULL
+ * in case of error. */
+static TextBlock *textbuf_add_block(TextBlock **blocks, size_t *num_blocks,
+                                    size_t *size)
+{
+    TextBlock *block;
+
+    if (*num_blocks == *size) {
+        size_t new_size = *size ? *size * 2 : 16;
+        TextBlock *new_blocks = realloc(*blocks,
+                                        new_size * sizeof(*new_blocks));
+        if (!new_blocks) {
             return NULL;
+        }
+        *blocks = new_blocks;
+        *size = new_size;
+    }
+
+    block = &(*blocks)[(*num_blocks)++];
+    memset(block, 0, sizeof(*block));
+    return block;
+}
+
+/* Copies the text of at most max_lines modified lines starting from *line
+ * into a block. *line is moved to the first line after them. Returns 0 on
+ * success. */
+static int textbuf_copy_block(TextBlock *block, TextLine **line,
+                              size_t max_lines)
+{
+    TextLine *tmp;
+    size_t num_bytes = 0;
+    size_t n = 0;
+    size_t i;
+
+    for (tmp = *line; tmp && !tmp->source && n < max_lines; tmp = tmp->next) {
+        num_bytes += tmp->num_bytes + 1;
+        ++n;
+    }
+    if (!(block->line_starts = malloc((n + 1) * sizeof(size_t)))
+        || !(block->copy = malloc(num_bytes))) {
+        return 1;
+    }
+
+    num_bytes = 0;
+    for (i = 0, tmp = *line; i < n; ++i, tmp = tmp->next) {
+        block->line_starts[i] = num_bytes;
+        memcpy(block->copy + num_bytes, textline_contiguous(tmp),
+               tmp->num_bytes);
+        num_bytes += tmp->num_bytes;
+        block->copy[num_bytes++] = '\0';
+    }
+    block->line_starts[n] = num_bytes;
+    block->text = block->copy;
+    block->num_lines = n;
+    *line = tmp;
+    return 0;
+}
+
+int textbuf_get_blocks(TextBuffer *buf, size_t first, size_t num_lines,
+                       size_t max_lines, TextBlock **blocks,
+                       size_t *num_blocks)
+{
+    TextLine *tmp;
+    size_t size = 0;
+    size_t pos = first;
+    size_t done; /* lines of the current run that are in blocks */
+
+    assert(buf != NULL);
+    assert(max_lines > 0);
+    assert(blocks != NULL);
+    assert(num_blocks != NULL);
+
+    *blocks = NULL;
+    *num_blocks = 0;
+    if (!(tmp = textbuf_find_line(buf, first, &done))) {
+        return 0;
+    }
+    done = first - done;
+    if (num_lines > buf->num_lines - first) {
+        num_lines = buf->num_lines - first;
+    }
+
+    while (tmp && pos < first + num_lines) {
+        size_t limit = first + num_lines - pos;
+        TextBlock *block = textbuf_add_block(blocks, num_blocks, &size);
+        if (!block) {
+            goto fail;
+        }
+        block->first_line = pos;
+        if (limit > max_lines) {
+            limit = max_lines;
+        }
+
+        if (!tmp->source) {
+            if (textbuf_copy_block(block, &tmp, limit)) {
+                goto fail;
+            }
         } else {
-            return tmp->text;
+            const size_t *starts = tmp->source->line_starts
+                                   + tmp->source_line + done;
+            size_t n = tmp->run_length - done;
+            if (n > limit) {
+                n = limit;
+            }
+            if (!(block->line_starts = malloc((n + 1) * sizeof(size_t)))) {
+                goto fail;
+            }
+            memcpy(block->line_starts, starts, (n + 1) * sizeof(size_t));
+            block->text = tmp->source->data;
+            block->num_lines = n;
+            done += n;
+            if (done == tmp->run_length) {
+                done = 0;
+                tmp = tmp->next;
+            }
         }
+        pos += block->num_lines;
     }
+    return 0;
+
+fail:
+    textbuf_free_blocks(*blocks, *num_blocks);
+    *blocks = NULL;
+    *num_blocks = 0;
+    return 1;
 }
 
-const char *textbuf_current_line(const TextBuffer *buf)
+void textbuf_free_blocks(TextBlock *blocks, size_t num_blocks)
 {
-    TextLine *tmp = textbuf_get_textline(buf, buf->crow);
-    if (!tmp) {
-        return NULL;
-    } else {
-        return tmp->text;
+    size_t i;
+
+    for (i = 0; i < num_blocks; ++i) {
+        free(blocks[i].line_starts);
+        free(blocks[i].copy);
     }
+    free(blocks);
+}
+
+void textbuf_take_damage(TextBuffer *buf, TextDamage *damage)
+{
+    assert(buf != NULL);
+    assert(damage != NULL);
+
+    *damage = buf->damage;
+    textbuf_clear_damage(buf);
+}
+
+const ArenaStats *textbuf_alloc_stats(const TextBuffer *buf)
+{
+    assert(buf != NULL);
+
+    return &buf->arena.stats;
+}
+
+const char *textbuf_current_line(const TextBuffer *buf)
+{
+    return textbuf_get_line(buf, buf->crow);
 }
@@ -12,29 +12,293 @@
 #pragma once
 
 #include <stddef.h>
+#include <stdint.h>
+
+#include <sys/types.h>
+
+#include "arena.h"
+#include "search.h"
+#include "textsource.h"
 
 /**
  * Represents one line of text.
+ *
+ * Inside a TextBuffer, a TextLine may also stand for a run of lines that
+ * haven't been modified since they were loaded. Such a TextLine has no text
+ * of its own; the lines are read directly from a TextSource instead. A line
+ * is copied into a TextLine of its own when it's modified for the first
+ * time.
+ *
+ * The text of a short line is stored right after its TextLine, in the same
+ * block of memory, which is only as big as the text needs. The text moves
+ * to a block of its own if it grows too long. A TextLine must not be copied
+ * while its text is stored after it.
  */
 typedef struct TextLine
 {
-    /** the text of the line, excluding the final newline */
-    char *text;
-    /** size of the text array */
-    size_t textbuf_size;
+    /** the TextSource of a run of unmodified lines, or NULL */
+    TextSource *source;
+    union
+    {
+        /* only lines with text of their own use these */
+        struct
+        {
+            /**
+             * The text of the line, excluding the final newline. The text
+             * is stored in a gap buffer: the bytes before gap_start are at
+             * the start of the array and the rest of the bytes are at the
+             * end of the array. Inserting and deleting text next to the gap
+             * doesn't move any other text.
+             */
+            char *text;
+            /**
+             * Byte offsets of every CHECKPOINT_INTERVAL:th character of a
+             * long line, or NULL. They are built when they are first needed
+             * and the ones after an edit are dropped, so that finding a
+             * character never has to scan more than one interval.
+             */
+            struct LineCheckpoints *checkpoints;
+        };
+        /* only runs use these */
+        struct
+        {
+            /** index of the first line of the run in source */
+            size_t source_line;
+            /** number of lines in the run */
+            size_t run_length;
+        };
+    };
+    /** size of the text array; a line can't be longer than 2 GB */
+    uint32_t textbuf_size;
     /** number of characters in the text array */
-    size_t num_chars;
+    uint32_t num_chars;
     /**
      * Number of bytes in the text array. Not the same as the number of
      * characters if there are any multibyte characters.
      */
-    size_t num_bytes;
+    uint32_t num_bytes;
+    /** number of bytes before the gap */
+    uint32_t gap_start;
+    /** number of characters before the gap */
+    uint32_t gap_chars;
     /** previous line in the buffer */
     struct TextLine *prev;
     /** next line in the buffer */
     struct TextLine *next;
+    /** left child in the line index */
+    struct TextLine *left;
+    /** right child in the line index */
+    struct TextLine *right;
+    /** number of lines in the line index subtree rooted at this line */
+    size_t subtree_size;
+    /** heap priority in the line index */
+    unsigned int priority;
+    /**
+     * non-zero if the memory of the line comes from the arena of its
+     * TextBuffer, zero if it comes from malloc
+     */
+    unsigned char in_arena;
+    /**
+     * size of the memory of the TextLine in ARENA_CLASS_STEPs, including
+     * the room for text after it
+     */
+    unsigned char node_size;
 } TextLine;
 
+/**
+ * Finds lines by their line number. See lineindex.h.
+ */
+typedef struct LineIndex
+{
+    /** root of the tree */
+    TextLine *root;
+    /** state of the random number generator used for priorities */
+    unsigned int seed;
+} LineIndex;
+
+/**
+ * A piece of text that isn't necessarily null terminated.
+ */
+typedef struct TextSpan
+{
+    /** the first byte of the text */
+    const char *text;
+    /** number of bytes */
+    size_t num_bytes;
+} TextSpan;
+
+/**
+ * Consecutive lines of a buffer in a form that other threads can read while
+ * the buffer is used and edited. Unmodified lines aren't copied: the block
+ * refers to the TextSource where they are stored, which stays valid until
+ * the buffer is loaded again or freed. Only their offsets are copied.
+ */
+typedef struct TextBlock
+{
+    /** index of the first line in the buffer */
+    size_t first_line;
+    /** number of lines */
+    size_t num_lines;
+    /** the text of the lines */
+    const char *text;
+    /**
+     * Offsets of the lines in text, and one more after them, so that the
+     * length of line i is line_starts[i+1] - line_starts[i] - 1 like in a
+     * TextSource. Lines aren't necessarily null terminated.
+     */
+    size_t *line_starts;
+    /** copy of the text of modified lines, or NULL */
+    char *copy;
+} TextBlock;
+
+/**
+ * Remembers the most recently used line. Lines near it can be found by
+ * following the prev and next pointers, which is faster than searching the
+ * line index.
+ */
+typedef struct LineFinger
+{
+    /** the line, or NULL if the finger doesn't point anywhere */
+    TextLine *line;
+    /** index of the (first) line of the TextLine */
+    size_t pos;
+} LineFinger;
+
+/**
+ * Describes which lines of a buffer have changed since the buffer was last
+ * drawn. Line numbers refer to the buffer as it is now.
+ */
+typedef struct TextDamage
+{
+    /** first changed line */
+    size_t first;
+    /** last changed line; no lines have changed if last < first */
+    size_t last;
+    /** where lines were inserted or deleted, if shift isn't 0 */
+    size_t shift_pos;
+    /**
+     * Number of lines inserted (positive) or deleted (negative) before
+     * shift_pos. The lines after them are unchanged apart from their line
+     * numbers.
+     */
+    long shift;
+    /** non-zero if everything may have changed */
+    int all;
+} TextDamage;
+
+/**
+ * Kinds of changes that the functions which edit a TextBuffer report to its
+ * listeners. Each kind belongs to one function, and calling that function
+ * again with the same arguments on the buffer as it was before the change
+ * makes the same change. Loading a file or appending to it isn't reported.
+ */
+typedef enum TextEditType
+{
+    /** textbuf_insert_text: text was inserted at (line, col) */
+    TEXTEDIT_INSERT,
+    /** textbuf_delete_text: (line, col) to (end_line, end_col) was deleted */
+    TEXTEDIT_DELETE,
+    /** textbuf_split_line: line was split before col */
+    TEXTEDIT_SPLIT,
+    /**
+     * textbuf_join_with_next_line: line was joined with the next line, which
+     * began at col
+     */
+    TEXTEDIT_JOIN,
+    /** textbuf_insert_line: a line with the text was added before line */
+    TEXTEDIT_INSERT_LINE,
+    /** textbuf_delete_line: line was deleted */
+    TEXTEDIT_DELETE_LINE,
+    /** textbuf_replace_line: the text of line was replaced with text */
+    TEXTEDIT_REPLACE_LINE
+} TextEditType;
+
+/**
+ * A change made to a TextBuffer. Only the fields that the type uses are set.
+ */
+typedef struct TextEdit
+{
+    TextEditType type;
+    /** the line where the change begins */
+    size_t line;
+    /** the character where the change begins */
+    size_t col;
+    /** the line where a deleted region ends */
+    size_t end_line;
+    /** the first character after a deleted region */
+    size_t end_col;
+    /**
+     * the text that was inserted, which may contain newlines; it's only
+     * valid during the call
+     */
+    const char *text;
+    /** length of text in bytes */
+    size_t num_bytes;
+    /**
+     * the text that was deleted or replaced, with newlines between lines;
+     * it's only valid during the call
+     */
+    const char *removed;
+    /** length of removed in bytes */
+    size_t num_removed;
+} TextEdit;
+
+struct TextBuffer;
+
+/**
+ * A function that is called after each change made to a buffer.
+ *
+ * @param data the pointer given to textbuf_add_listener
+ * @param buf the buffer
+ * @param edit the change
+ */
+typedef void (*TextEditListener)(void *data, struct TextBuffer *buf,
+                                 const TextEdit *edit);
+
+/**
+ * A function that tells textbuf_search which lines may contain matches of a
+ * pattern, so that the other lines don't need to be searched. It finds the
+ * nearest group of consecutive lines that may contain matches, starting from
+ * a line and going forward or backward.
+ *
+ * @param data the pointer given to textbuf_set_search_filter
+ * @param buf the buffer
+ * @param pat the pattern
+ * @param backward non-zero if the group should be at or before line instead
+ * of at or after it
+ * @param line the line to start from
+ * @param first the first line of the group is stored here; it may be before
+ * line
+ * @param last the last line of the group is stored here; it may be after
+ * line
+ * @return 0 if a group was found, non-zero if none of the lines in that
+ * direction can contain a match
+ */
+typedef int (*TextSearchFilter)(void *data, struct TextBuffer *buf,
+                                const SearchPattern *pat, int backward,
+                                size_t line, size_t *first, size_t *last);
+
+/**
+ * Ways to store the lines of a file that is loaded into a TextBuffer.
+ */
+typedef enum TextBufLoadMode
+{
+    /** every line is copied into a TextLine of its own */
+    TEXTBUF_LOAD_LINES,
+    /**
+     * The file is read into one TextSource and lines are copied only when
+     * they are modified. Text that is added later goes to separate
+     * append-only TextSources. Together these work like a piece table.
+     */
+    TEXTBUF_LOAD_PIECES,
+    /**
+     * Like TEXTBUF_LOAD_PIECES, but the file is mapped into memory instead of
+     * being read. Opening a file only finds the offsets of the lines, and
+     * unmodified lines are read directly from the mapping.
+     */
+    TEXTBUF_LOAD_MMAP
+} TextBufLoadMode;
+
 /**
  * Represents a complete file.
  */
@@ -44,8 +308,69 @@ typedef struct TextBuffer
     TextLine *head;
     /** last line in the buffer */
     TextLine *tail;
+    /** all lines in the buffer, indexed by line number */
+    LineIndex index;
+    /** the most recently used line */
+    LineFinger finger;
+    /** all TextSources that lines in the buffer may refer to */
+    TextSource *sources;
+    /** the TextSource where new text is appended, or NULL */
+    TextSource *add;
+    /** memory for the TextLines created by the buffer itself */
+    Arena arena;
+    /** number of lines in the buffer that weren't allocated from arena */
+    size_t num_foreign_lines;
+    /** how textbuf_load_file stores the lines */
+    TextBufLoadMode load_mode;
+    /** number of threads used to find lines when loading, 0 for one per CPU */
+    int load_threads;
+    /** non-zero if textbuf_save_file flushes the file to disk */
+    int save_sync;
+    /** the loader that is still adding lines to the buffer, or NULL */
+    struct TextLoader *loader;
+    /** the TextSource that the file is being loaded into, or NULL */
+    TextSource *load_source;
+    /** file descriptor of the file or stream being loaded, or -1 */
+    int load_fd;
+    /** number of lines of load_source that have been added to the buffer */
+    size_t load_lines;
+    /** non-zero if the last file couldn't be loaded completely */
+    int load_failed;
+    /** device of the file that was loaded */
+    dev_t loaded_dev;
+    /** inode of the file that was loaded, to notice when it's replaced */
+    ino_t loaded_ino;
+    /** number of bytes of the file or stream that have been loaded */
+    size_t loaded_bytes;
+    /**
+     * non-zero if the file didn't end with a newline, so text that is added
+     * to the file later continues its last line
+     */
+    int last_line_open;
+    /** number of bytes written by the last successful save */
+    size_t saved_bytes;
+    /** how many seconds the last successful save took */
+    double save_seconds;
+    /** number of bytes looked at by the last search */
+    size_t searched_bytes;
+    /** how many seconds the last search took */
+    double search_seconds;
+    /** non-zero if the last search continued from the other end */
+    int search_wrapped;
+    /** tells which lines textbuf_search can skip, or NULL */
+    TextSearchFilter search_filter;
+    /** the pointer given to search_filter */
+    void *search_filter_data;
+    /** the functions that are told about changes, see TextEditListener */
+    struct TextListener *listeners;
+    /** null terminated copy of a mapped line made by textbuf_get_line */
+    char *line_copy;
+    /** size of the line_copy array */
+    size_t line_copy_size;
     /** number of lines in the buffer */
     size_t num_lines;
+    /** changes that haven't been drawn yet */
+    TextDamage damage;
     /** row number of cursor (first row is 0) */
     int crow;
     /** column number of cursor (first column is 0) */
@@ -54,16 +379,29 @@ typedef struct TextBuffer
 
 /*
  * TextLine functions
+ *
+ * These are for lines that haven't been given to a TextBuffer. The lines of
+ * a TextBuffer are edited with the TextBuffer functions.
  */
 
 /**
  * Creates a new TextLine with the given text.
  *
- * @param text the text on the line (it will be copied)
+ * @param text the text on the line (it will be copied up to the first newline)
  * @return pointer to a dynamically allocated TextLine, or NULL in case of error
  */
 TextLine *textline_init(const char *text);
 
+/**
+ * Creates a new TextLine from text of known length. The text may contain
+ * null characters, but it must not contain newlines.
+ *
+ * @param text the text on the line (it will be copied)
+ * @param num_bytes length of text in bytes
+ * @return pointer to a dynamically allocated TextLine, or NULL in case of error
+ */
+TextLine *textline_init_len(const char *text, size_t num_bytes);
+
 /**
  * Destroys a TextLine.
  *
@@ -83,6 +421,32 @@ void textline_free(TextLine *line);
  */
 int textline_insert(TextLine *line, const char *text, size_t pos);
 
+/**
+ * Inserts text of known length in a TextLine. Only the inserted text is
+ * scanned, so the cost doesn't depend on the length of the line.
+ *
+ * @param line
+ * @param text the text to be inserted (will be copied); it may contain null
+ * characters
+ * @param num_bytes length of text in bytes
+ * @param pos the position where the new text should be inserted; see
+ * textline_insert()
+ * @return 0 on success, non-zero otherwise
+ */
+int textline_insert_len(TextLine *line, const char *text, size_t num_bytes,
+                        size_t pos);
+
+/**
+ * Deletes characters from a TextLine.
+ *
+ * @param line
+ * @param pos the first character to be deleted
+ * @param n number of characters to delete. pos + n must not be greater than
+ * the number of characters on the line.
+ * @return 0 on success, non-zero otherwise
+ */
+int textline_delete(TextLine *line, size_t pos, size_t n);
+
 /**
  * Deletes all text starting from the given position.
  *
@@ -93,6 +457,17 @@ int textline_insert(TextLine *line, const char *text, size_t pos);
  */
 int textline_delete_to_eol(TextLine *line, size_t pos);
 
+/**
+ * Finds the byte offset of a character. The offset doesn't count the gap, so
+ * it is the same as the offset in the text of the line when it is in one
+ * piece.
+ *
+ * @param line
+ * @param pos index of the character; may be one past the last character
+ * @return offset of the first byte of the character
+ */
+size_t textline_byte_offset(TextLine *line, size_t pos);
+
 /*
  * TextBuffer functions
  */
@@ -114,7 +489,29 @@ TextBuffer *textbuf_init(void);
 void textbuf_free(TextBuffer *buf);
 
 /**
- * Adds a new line at the end of a TextBuffer.
+ * Starts telling a function about the changes made to a buffer.
+ *
+ * @param buf
+ * @param fn the function
+ * @param data pointer that is passed to the function
+ * @return 0 on success, non-zero otherwise
+ */
+int textbuf_add_listener(TextBuffer *buf, TextEditListener fn, void *data);
+
+/**
+ * Stops telling a function about changes. It must have been added with the
+ * same data.
+ *
+ * @param buf
+ * @param fn the function
+ * @param data pointer that was given to textbuf_add_listener
+ */
+void textbuf_remove_listener(TextBuffer *buf, TextEditListener fn,
+                             void *data);
+
+/**
+ * Adds a new line at the end of a TextBuffer. This is meant for building a
+ * buffer, so it isn't reported to listeners.
  *
  * @param buf
  * @param line the line to be added (it won't be copied)
@@ -142,6 +539,34 @@ int textbuf_insert_line(TextBuffer *buf, TextLine *line, size_t pos);
  */
 int textbuf_insert_at_cursor(TextBuffer *buf, const char *text);
 
+/**
+ * Inserts text of known length at the cursor and moves the cursor past the
+ * new text. See textbuf_insert_text().
+ *
+ * @param buf
+ * @param text the text to be inserted (it will be copied)
+ * @param num_bytes length of text in bytes
+ * @return 0 on success, non-zero otherwise
+ */
+int textbuf_insert_len_at_cursor(TextBuffer *buf, const char *text,
+                                 size_t num_bytes);
+
+/**
+ * Inserts a block of text that may contain newlines. The line is split at
+ * the given position and the lines of the text are added between the two
+ * halves in one go, so inserting a big block doesn't cost more than adding
+ * its lines. The cursor isn't moved.
+ *
+ * @param buf
+ * @param line the line where the text begins
+ * @param col the character before which the text is inserted
+ * @param text the text to be inserted (it will be copied)
+ * @param num_bytes length of text in bytes
+ * @return 0 on success, non-zero otherwise
+ */
+int textbuf_insert_text(TextBuffer *buf, size_t line, size_t col,
+                        const char *text, size_t num_bytes);
+
 /**
  * Deletes a line from a buffer.
  *
@@ -151,6 +576,23 @@ int textbuf_insert_at_cursor(TextBuffer *buf, const char *text);
  */
 int textbuf_delete_line(TextBuffer *buf, size_t pos);
 
+/**
+ * Deletes the text between two positions. The lines between them are removed
+ * in one go and the text after the end is joined to the start, so the cost
+ * depends on the size of the deleted region and not on the size of the
+ * buffer. A cursor after the region moves with the text; one inside it moves
+ * to the start.
+ *
+ * @param buf
+ * @param line1 the line where the region begins
+ * @param col1 the first character to be deleted
+ * @param line2 the line where the region ends
+ * @param col2 the first character after the region
+ * @return 0 on success, non-zero otherwise
+ */
+int textbuf_delete_text(TextBuffer *buf, size_t line1, size_t col1,
+                        size_t line2, size_t col2);
+
 /**
  * Replaces a line with another line. The old line will be deleted.
  *
@@ -180,6 +622,24 @@ int textbuf_join_with_next_line(TextBuffer *buf, size_t line);
  */
 int textbuf_split_line(TextBuffer *buf, size_t line, size_t pos);
 
+/**
+ * Chooses how textbuf_load_file stores the lines of a file.
+ *
+ * @param buf
+ * @param mode the new load mode
+ */
+void textbuf_set_load_mode(TextBuffer *buf, TextBufLoadMode mode);
+
+/**
+ * Chooses how many threads textbuf_load_file uses to find the lines of a
+ * file. This only matters if the file is loaded into a TextSource (see
+ * TextBufLoadMode).
+ *
+ * @param buf
+ * @param num_threads number of threads, or 0 to use one thread per CPU
+ */
+void textbuf_set_load_threads(TextBuffer *buf, int num_threads);
+
 /**
  * Loads a file into a TextBuffer.
  *
@@ -190,7 +650,97 @@ int textbuf_split_line(TextBuffer *buf, size_t line, size_t pos);
 int textbuf_load_file(TextBuffer *buf, const char *filename);
 
 /**
- * Saves a TextBuffer into a file.
+ * Starts loading a file into a TextBuffer in the background. This returns
+ * as soon as the first lines have been loaded, and textbuf_poll_load adds
+ * the rest as they are found. The buffer must not be modified until the
+ * whole file has been loaded, but its lines can be read. Files that aren't
+ * regular files are loaded with textbuf_load_file instead.
+ *
+ * @param buf
+ * @param filename name of the file to load
+ * @return 0 on success, non-zero otherwise
+ */
+int textbuf_load_file_async(TextBuffer *buf, const char *filename);
+
+/**
+ * Starts reading a stream, such as a pipe, into a TextBuffer. The buffer is
+ * emptied, and textbuf_poll_load reads the text that is available each time
+ * it's called, so that the lines that have come so far can be looked at
+ * while the rest is still coming. As with textbuf_load_file_async, the
+ * buffer must not be modified until the whole stream has been read.
+ *
+ * @param buf
+ * @param fd file descriptor of the stream; the buffer closes it when the
+ * stream ends
+ * @return 0 on success, non-zero otherwise
+ */
+int textbuf_load_stream(TextBuffer *buf, int fd);
+
+/**
+ * Adds the lines that have been loaded in the background, or that can be
+ * read from the stream being loaded, since the last call to a buffer.
+ *
+ * @param buf
+ * @param wait non-zero to wait for more lines if there aren't any yet
+ * @return 0 if the whole file has been loaded, 1 if the file is still being
+ * loaded, or 2 if there are loaded lines that could be added right away
+ */
+int textbuf_poll_load(TextBuffer *buf, int wait);
+
+/**
+ * Adds text to the end of a buffer as if it was appended to the file that
+ * was loaded: it continues the last line if the file didn't end with a
+ * newline, and a newline at its end doesn't start a new line.
+ *
+ * @param buf
+ * @param text the text, which doesn't need to be null terminated
+ * @param num_bytes length of the text in bytes
+ * @return 0 on success, non-zero otherwise
+ */
+int textbuf_append_text(TextBuffer *buf, const char *text, size_t num_bytes);
+
+/**
+ * Adds the text that has been appended to a file since it was loaded (or
+ * since the last call) to the end of the buffer. Only the new bytes are
+ * read. This is meant for following files that grow, such as logs.
+ *
+ * @param buf
+ * @param filename name of the file that was loaded into the buffer
+ * @return 0 on success or if the file doesn't exist right now, 2 if the file
+ * has been replaced or has become shorter than what has been loaded so that
+ * it must be loaded again, or 1 in case of another error
+ */
+int textbuf_append_from_file(TextBuffer *buf, const char *filename);
+
+/**
+ * Returns how much of the file that is being loaded in the background has
+ * been added to the buffer.
+ *
+ * @param buf
+ * @return a number between 0 and 1, which is 1 if nothing is being loaded
+ * and 0 while a stream is being read
+ */
+double textbuf_load_progress(const TextBuffer *buf);
+
+/**
+ * Chooses whether textbuf_save_file waits until the file is on disk before
+ * it replaces the old file. Without this a crash of the whole system soon
+ * after saving may leave an empty file behind on some file systems.
+ *
+ * @param buf
+ * @param sync non-zero to call fsync
+ */
+void textbuf_set_save_sync(TextBuffer *buf, int sync);
+
+/**
+ * Saves a TextBuffer into a file. The text is written to a temporary file in
+ * the same directory, which is then renamed over the old file, so the old
+ * file is either replaced completely or not at all. A symbolic link is
+ * followed, and the owner, group and permissions of the file are kept; a file
+ * with other hard links, or whose owner can't be kept, is overwritten in
+ * place instead. Unmodified lines are
+ * written straight from where they are stored, many at a time. The size of
+ * the file and the time it took are stored in saved_bytes and save_seconds.
  *
  * @param buf
  * @param filename name of the file to save
@@ -198,6 +748,36 @@ int textbuf_load_file(TextBuffer *buf, const char *filename);
  */
 int textbuf_save_file(TextBuffer *buf, const char *filename);
 
+/**
+ * Finds the next match of a pattern after a position, or the previous one
+ * before it. If there is none before the end of the buffer, the search
+ * continues from the other end. Lines are searched where they are stored, so
+ * a run of unmodified lines is searched as one block. The number of bytes
+ * looked at and the time it took are stored in searched_bytes and
+ * search_seconds, and search_wrapped tells whether the search went past the
+ * end.
+ *
+ * @param buf
+ * @param pat the pattern
+ * @param backward non-zero to search backward
+ * @param line the line to start from; the line of the match is stored here
+ * @param col the character to start from; the character where the match
+ * begins is stored here
+ * @return 0 if a match was found, non-zero otherwise
+ */
+int textbuf_search(TextBuffer *buf, const SearchPattern *pat, int backward,
+                   size_t *line, size_t *col);
+
+/**
+ * Sets the function that tells textbuf_search which lines it can skip.
+ *
+ * @param buf
+ * @param fn the function, or NULL to search every line
+ * @param data a pointer that is passed to fn
+ */
+void textbuf_set_search_filter(TextBuffer *buf, TextSearchFilter fn,
+                               void *data);
+
 /**
  * Moves the cursor in a buffer.
  *
@@ -227,6 +807,15 @@ int textbuf_line_num(TextBuffer *buf);
  */
 int textbuf_col_num(TextBuffer *buf);
 
+/**
+ * Returns the number of characters on a line.
+ *
+ * @param buf
+ * @param pos index of the line, which must exist
+ * @return number of characters
+ */
+size_t textbuf_line_length(const TextBuffer *buf, size_t pos);
+
 /**
  * Deletes the character under the cursor.
  *
@@ -236,7 +825,10 @@ int textbuf_col_num(TextBuffer *buf);
 int textbuf_delete_char(TextBuffer *buf);
 
 /**
- * Returns a pointer to a char array that represents the given line.
+ * Returns a pointer to a char array that represents the given line. If the
+ * line is split by a gap, the gap is moved to the end of the line first.
+ * Unmodified lines of a mapped file are copied to a temporary array that is
+ * reused by the next call; use textbuf_get_line_spans to avoid the copy.
  *
  * @param buf
  * @param line line number
@@ -244,6 +836,80 @@ int textbuf_delete_char(TextBuffer *buf);
  */
 const char *textbuf_get_line(const TextBuffer *buf, size_t line);
 
+/**
+ * Returns the text of a line without copying or moving it. The text is
+ * returned in two parts because lines that are being edited are split in two
+ * by a gap. The second part is empty if the line is in one piece.
+ *
+ * @param buf
+ * @param line line number
+ * @param spans the parts of the line are stored here
+ * @return 0 on success, non-zero if the line doesn't exist
+ */
+int textbuf_get_line_spans(const TextBuffer *buf, size_t line,
+                           TextSpan spans[2]);
+
+/**
+ * Copies the text between two positions to dest. Lines are separated with
+ * newlines and the text isn't null terminated. At most size bytes are
+ * copied, but the whole length is returned, so a caller can find out how big
+ * a buffer it needs by passing a size of 0.
+ *
+ * @param buf
+ * @param line1 the line where the region begins
+ * @param col1 the first character of the region
+ * @param line2 the line where the region ends
+ * @param col2 the first character after the region
+ * @param dest where the text is copied (may be NULL if size is 0)
+ * @param size size of dest in bytes
+ * @return length of the text in bytes, or 0 if the region is invalid
+ */
+size_t textbuf_get_text(const TextBuffer *buf, size_t line1, size_t col1,
+                        size_t line2, size_t col2, char *dest, size_t size);
+
+/**
+ * Divides lines of a buffer into TextBlocks of at most max_lines lines. A run
+ * of unmodified lines costs only its offsets, but modified lines are copied.
+ *
+ * @param buf
+ * @param first the first line
+ * @param num_lines number of lines; it's reduced if there are fewer lines
+ * after first
+ * @param max_lines maximum number of lines in a block
+ * @param blocks a dynamically allocated array of the blocks is stored here
+ * @param num_blocks number of blocks is stored here
+ * @return 0 on success, non-zero in case of error
+ */
+int textbuf_get_blocks(TextBuffer *buf, size_t first, size_t num_lines,
+                       size_t max_lines, TextBlock **blocks,
+                       size_t *num_blocks);
+
+/**
+ * Frees blocks made by textbuf_get_blocks.
+ *
+ * @param blocks
+ * @param num_blocks
+ */
+void textbuf_free_blocks(TextBlock *blocks, size_t num_blocks);
+
+/**
+ * Returns the changes made to a buffer since the last call and forgets them.
+ * Every function that modifies the buffer records what it changed.
+ *
+ * @param buf
+ * @param damage where the changes are stored
+ */
+void textbuf_take_damage(TextBuffer *buf, TextDamage *damage);
+
+/**
+ * Returns statistics about the memory that the buffer has allocated for its
+ * lines.
+ *
+ * @param buf
+ * @return the statistics; they are updated as the buffer changes
+ */
+const ArenaStats *textbuf_alloc_stats(const TextBuffer *buf);
+
 /**
  * Returns a pointer to a char array that represents the current line.
  *
@@ -0,0 +1,253 @@
+/*
+ * textloader.c
+ *
+ * Loading files in the background. See textloader.h.
+ */
+
+#include "textloader.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+/* The first block is small so that the first screen is ready quickly. Each
+ * block after it is twice as big up to the maximum. */
+#define FIRST_BLOCK_SIZE (1 << 16)
+#define MAX_BLOCK_SIZE (1 << 24)
+
+struct TextLoader
+{
+    /** the TextSource being loaded */
+    TextSource *src;
+    /** the file being loaded */
+    int fd;
+    /** maximum number of threads used to find lines */
+    int num_threads;
+    pthread_t thread;
+    /** protects everything below */
+    pthread_mutex_t lock;
+    /** signaled when new lines have been found or the loader is done */
+    pthread_cond_t cond;
+    /** offsets of lines that haven't been taken yet */
+    size_t *pending;
+    /** number of offsets in pending */
+    size_t num_pending;
+    /** size of the pending array */
+    size_t pending_size;
+    /** non-zero when the thread has stopped */
+    int done;
+    /** non-zero if the file couldn't be read */
+    int failed;
+    /** non-zero if the thread should stop */
+    int cancel;
+};
+
+/* Adds n offsets to the lines that are waiting to be taken. The lock must be
+ * held. Returns 0 on success. */
+static int textloader_add_pending(TextLoader *loader, const size_t *starts,
+                                  size_t n)
+{
+    if (loader->num_pending + n > loader->pending_size) {
+        size_t new_size = loader->pending_size ? loader->pending_size : 1024;
+        size_t *new_pending;
+        while (new_size < loader->num_pending + n) {
+            new_size *= 2;
+        }
+        new_pending = realloc(loader->pending,
+                              new_size * sizeof(*new_pending));
+        if (!new_pending) {
+            return 1;
+        }
+        loader->pending = new_pending;
+        loader->pending_size = new_size;
+    }
+
+    memcpy(loader->pending + loader->num_pending, starts, n * sizeof(*starts));
+    loader->num_pending += n;
+    return 0;
+}
+
+/* Reads the bytes from begin to end into the TextSource. Returns the offset
+ * where reading stopped, which is before end if the file has become shorter,
+ * or (size_t) -1 in case of error. */
+static size_t textloader_read(TextLoader *loader, size_t begin, size_t end)
+{
+    while (begin < end) {
+        ssize_t n = pread(loader->fd, loader->src->data + begin, end - begin,
+                          begin);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n < 0) {
+            return (size_t) -1;
+        } else if (n == 0) {
+            break;
+        }
+        begin += n;
+    }
+    return begin;
+}
+
+/* The loader thread. */
+static void *textloader_run(void *arg)
+{
+    TextLoader *loader = arg;
+    TextSource *src = loader->src;
+    size_t size = src->size;
+    size_t pos = 0;
+    size_t block = FIRST_BLOCK_SIZE;
+    size_t last_start = 0;
+    int failed = 0;
+
+    while (pos < size) {
+        size_t end = size - pos < block ? size : pos + block;
+        size_t *starts;
+        size_t n;
+        int cancel;
+
+        pthread_mutex_lock(&loader->lock);
+        cancel = loader->cancel;
+        pthread_mutex_unlock(&loader->lock);
+        if (cancel) {
+            break;
+        }
+
+        if (!src->mapped) {
+            size_t read_end = textloader_read(loader, pos, end);
+            if (read_end == (size_t) -1) {
+                failed = 1;
+                break;
+            } else if (read_end < end) {
+                size = end = read_end;
+            }
+        }
+
+        if (!(starts = textsource_scan_lines(src, pos, end,
+                                             loader->num_threads, &n))) {
+            failed = 1;
+            break;
+        }
+        if (n > 0) {
+            last_start = starts[n-1];
+        }
+
+        /* the last line doesn't need to end with a newline */
+        if (end == size && last_start < size) {
+            if (!src->mapped) {
+                src->data[size] = '\0';
+            }
+            src->unterminated = 1;
+            starts[n++] = size + 1;
+        }
+
+        pthread_mutex_lock(&loader->lock);
+        failed = textloader_add_pending(loader, starts, n);
+        pthread_cond_signal(&loader->cond);
+        pthread_mutex_unlock(&loader->lock);
+        free(starts);
+        if (failed) {
+            break;
+        }
+
+        pos = end;
+        if (block < MAX_BLOCK_SIZE) {
+            block *= 2;
+        }
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    loader->done = 1;
+    loader->failed |= failed;
+    pthread_cond_signal(&loader->cond);
+    pthread_mutex_unlock(&loader->lock);
+    return NULL;
+}
+
+TextLoader *textloader_start(TextSource *src, int fd, int num_threads)
+{
+    TextLoader *loader;
+
+    assert(src != NULL);
+
+    if (!(loader = calloc(1, sizeof(*loader)))) {
+        return NULL;
+    }
+    loader->src = src;
+    loader->fd = fd;
+    loader->num_threads = num_threads;
+    pthread_mutex_init(&loader->lock, NULL);
+    pthread_cond_init(&loader->cond, NULL);
+
+    if (pthread_create(&loader->thread, NULL, textloader_run, loader)) {
+        pthread_mutex_destroy(&loader->lock);
+        pthread_cond_destroy(&loader->cond);
+        free(loader);
+        return NULL;
+    }
+    return loader;
+}
+
+size_t textloader_take_lines(TextLoader *loader, int wait)
+{
+    size_t n;
+
+    assert(loader != NULL);
+
+    pthread_mutex_lock(&loader->lock);
+    while (wait && loader->num_pending == 0 && !loader->done) {
+        pthread_cond_wait(&loader->cond, &loader->lock);
+    }
+
+    n = loader->num_pending;
+    if (textsource_add_lines(loader->src, loader->pending, n)) {
+        loader->failed = 1;
+        n = 0;
+    }
+    loader->num_pending = 0;
+    pthread_mutex_unlock(&loader->lock);
+    return n;
+}
+
+int textloader_done(TextLoader *loader)
+{
+    int done;
+
+    assert(loader != NULL);
+
+    pthread_mutex_lock(&loader->lock);
+    done = loader->done;
+    pthread_mutex_unlock(&loader->lock);
+    return done;
+}
+
+int textloader_failed(TextLoader *loader)
+{
+    int failed;
+
+    assert(loader != NULL);
+
+    pthread_mutex_lock(&loader->lock);
+    failed = loader->failed;
+    pthread_mutex_unlock(&loader->lock);
+    return failed;
+}
+
+void textloader_free(TextLoader *loader)
+{
+    if (!loader) {
+        return;
+    }
+
+    pthread_mutex_lock(&loader->lock);
+    loader->cancel = 1;
+    pthread_mutex_unlock(&loader->lock);
+    pthread_join(loader->thread, NULL);
+
+    pthread_mutex_destroy(&loader->lock);
+    pthread_cond_destroy(&loader->cond);
+    free(loader->pending);
+    free(loader);
+}
@@ -0,0 +1,69 @@
+/**
+ * @file textloader.h
+ * @author dreamyeyed
+ *
+ * A TextLoader loads a file into a TextSource in a background thread, so
+ * that the lines at the start of the file can be shown and used while the
+ * rest is still being read. The thread reads the file in blocks that grow
+ * from small to big and finds the lines of each block. The lines it has
+ * found are handed over with textloader_take_lines, which is the only time
+ * the TextSource is changed; the thread itself only writes to the part of
+ * the TextSource's data that no line refers to yet, and to its unterminated
+ * flag before it's done.
+ */
+#pragma once
+
+#include <stddef.h>
+
+#include "textsource.h"
+
+typedef struct TextLoader TextLoader;
+
+/**
+ * Starts loading a file into a TextSource made by textsource_open_file.
+ *
+ * @param src the TextSource; it must not be freed before the loader
+ * @param fd a file descriptor of the file, which must stay open until the
+ * loader is freed
+ * @param num_threads maximum number of threads used to find the lines of a
+ * block, or 0 to use one thread per CPU
+ * @return pointer to a dynamically allocated TextLoader, or NULL in case of
+ * error
+ */
+TextLoader *textloader_start(TextSource *src, int fd, int num_threads);
+
+/**
+ * Adds the lines that the loader has found since the last call to its
+ * TextSource.
+ *
+ * @param loader
+ * @param wait non-zero to wait until there are new lines or the loader is
+ * done, if there aren't any yet
+ * @return number of lines added
+ */
+size_t textloader_take_lines(TextLoader *loader, int wait);
+
+/**
+ * Tells whether the whole file has been loaded. Lines may still be waiting
+ * for textloader_take_lines after that.
+ *
+ * @param loader
+ * @return non-zero if the loader has finished or failed
+ */
+int textloader_done(TextLoader *loader);
+
+/**
+ * Tells whether loading failed. The lines that were added before that are
+ * still usable.
+ *
+ * @param loader
+ * @return non-zero if the file couldn't be read
+ */
+int textloader_failed(TextLoader *loader);
+
+/**
+ * Stops a loader and frees it. Lines that haven't been taken are lost.
+ *
+ * @param loader
+ */
+void textloader_free(TextLoader *loader);
@@ -0,0 +1,563 @@
+/*
+ * textsource.c
+ *
+ * Blocks of text that are shared by many lines. See textsource.h.
+ */
+
+#include "textsource.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/* smallest chunk of a file that is worth a thread of its own */
+#define MIN_CHUNK_SIZE (1 << 20)
+
+/* Makes room for at least n more line offsets. Returns 0 on success. */
+static int textsource_reserve_lines(TextSource *src, size_t n)
+{
+    size_t new_size = src->line_starts_size;
+    size_t *new_starts;
+
+    while (new_size < src->num_lines + 1 + n) {
+        new_size *= 2;
+    }
+    if (new_size == src->line_starts_size) {
+        return 0;
+    }
+
+    new_starts = realloc(src->line_starts, new_size * sizeof(*new_starts));
+    if (!new_starts) {
+        return 1;
+    }
+    src->line_starts = new_starts;
+    src->line_starts_size = new_size;
+    return 0;
+}
+
+/* Work done by one thread while finding the lines of a TextSource. */
+typedef struct LineChunk
+{
+    /** the first byte of the chunk */
+    char *begin;
+    /** one past the last byte of the chunk */
+    char *end;
+    /** offset of begin in the data of the TextSource */
+    size_t offset;
+    /** non-zero if newlines should be replaced with null characters */
+    int terminate;
+    /** offsets of the lines that start after a newline in the chunk */
+    size_t *line_starts;
+    /** number of offsets in line_starts */
+    size_t num_lines;
+    /** size of the line_starts array */
+    size_t line_starts_size;
+    /** where to copy line_starts when all chunks are done */
+    size_t *dest;
+    /** non-zero if the thread ran out of memory */
+    int failed;
+} LineChunk;
+
+/* Finds the newlines in one chunk. */
+static void *linechunk_find_lines(void *arg)
+{
+    LineChunk *chunk = arg;
+    char *p = chunk->begin;
+    char *newline;
+
+    while (p < chunk->end
+           && (newline = memchr(p, '\n', chunk->end - p))) {
+        if (chunk->num_lines == chunk->line_starts_size) {
+            size_t new_size = chunk->line_starts_size
+                              ? chunk->line_starts_size * 2 : 1024;
+            size_t *new_starts = realloc(chunk->line_starts,
+                                         new_size * sizeof(*new_starts));
+            if (!new_starts) {
+                chunk->failed = 1;
+                return NULL;
+            }
+            chunk->line_starts = new_starts;
+            chunk->line_starts_size = new_size;
+        }
+
+        if (chunk->terminate) {
+            *newline = '\0';
+        }
+        chunk->line_starts[chunk->num_lines++] = chunk->offset
+                                                 + (newline + 1 - chunk->begin);
+        p = newline + 1;
+    }
+    return NULL;
+}
+
+/* Copies the offsets of one chunk to their final place. */
+static void *linechunk_copy_lines(void *arg)
+{
+    LineChunk *chunk = arg;
+
+    if (chunk->num_lines == 0) {
+        return NULL;
+    }
+    memcpy(chunk->dest, chunk->line_starts,
+           chunk->num_lines * sizeof(*chunk->line_starts));
+    return NULL;
+}
+
+/* Runs fn for every chunk, each one in a thread of its own. The first chunk
+ * is done in the calling thread. */
+static void linechunk_run_all(LineChunk *chunks, size_t num_chunks,
+                              void *(*fn)(void *))
+{
+    pthread_t *threads = malloc(num_chunks * sizeof(*threads));
+    int *started = calloc(num_chunks, sizeof(*started));
+    size_t i;
+
+    for (i = 1; i < num_chunks; ++i) {
+        started[i] = threads && started
+                     && pthread_create(&threads[i], NULL, fn, &chunks[i]) == 0;
+        if (!started[i]) {
+            fn(&chunks[i]);
+        }
+    }
+    fn(&chunks[0]);
+    for (i = 1; i < num_chunks; ++i) {
+        if (started[i]) {
+            pthread_join(threads[i], NULL);
+        }
+    }
+
+    free(threads);
+    free(started);
+}
+
+/* Frees the chunks made by linechunk_find_all. */
+static void linechunk_free_all(LineChunk *chunks, size_t num_chunks)
+{
+    size_t i;
+
+    for (i = 0; i < num_chunks; ++i) {
+        free(chunks[i].line_starts);
+    }
+    free(chunks);
+}
+
+/* Finds the newlines in data between the offsets begin and end. The bytes
+ * are split into chunks that are searched by num_threads threads at the same
+ * time, and each chunk stores the offsets it finds in an array of its own.
+ * The number of chunks is stored in *num_chunks and the number of offsets in
+ * all of them in *total. Returns NULL in case of error. */
+static LineChunk *linechunk_find_all(char *data, size_t begin, size_t end,
+                                     int terminate, int num_threads,
+                                     size_t *num_chunks, size_t *total)
+{
+    LineChunk *chunks;
+    size_t size = end - begin;
+    size_t n;
+    size_t i;
+    int err = 0;
+
+    if (num_threads <= 0) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        num_threads = cpus > 0 ? cpus : 1;
+    }
+
+    /* threads aren't worth it for small files */
+    n = size / MIN_CHUNK_SIZE;
+    if (n > (size_t) num_threads) {
+        n = num_threads;
+    } else if (n == 0) {
+        n = 1;
+    }
+
+    if (!(chunks = calloc(n, sizeof(*chunks)))) {
+        return NULL;
+    }
+    for (i = 0; i < n; ++i) {
+        chunks[i].offset = begin + size / n * i;
+        chunks[i].begin = data + chunks[i].offset;
+        chunks[i].end = i + 1 < n ? data + begin + size / n * (i + 1)
+                                  : data + end;
+        chunks[i].terminate = terminate;
+    }
+
+    linechunk_run_all(chunks, n, linechunk_find_lines);
+
+    *total = 0;
+    for (i = 0; i < n; ++i) {
+        err |= chunks[i].failed;
+        *total += chunks[i].num_lines;
+    }
+    if (err) {
+        linechunk_free_all(chunks, n);
+        return NULL;
+    }
+
+    *num_chunks = n;
+    return chunks;
+}
+
+/* Finds the lines in the data of a TextSource. If terminate is non-zero, the
+ * newlines are replaced with null characters, and a null character is added
+ * after the last line if it doesn't end with a newline. That requires one
+ * byte of extra space at the end of data.
+ *
+ * The data is split into chunks that are searched by num_threads threads at
+ * the same time. Each thread stores the offsets it finds in an array of its
+ * own, and the arrays are joined when all threads are done. Returns 0 on
+ * success. */
+static int textsource_find_lines(TextSource *src, int terminate,
+                                 int num_threads)
+{
+    LineChunk *chunks;
+    size_t num_chunks;
+    size_t total;
+    size_t i;
+    int err = 0;
+
+    chunks = linechunk_find_all(src->data, 0, src->size, terminate,
+                                num_threads, &num_chunks, &total);
+    if (!chunks) {
+        return 1;
+    }
+
+    if (textsource_reserve_lines(src, total + 1) == 0) {
+        for (i = 0; i < num_chunks; ++i) {
+            chunks[i].dest = src->line_starts + src->num_lines + 1;
+            src->num_lines += chunks[i].num_lines;
+        }
+        linechunk_run_all(chunks, num_chunks, linechunk_copy_lines);
+
+        /* The last line doesn't end with a newline. Pretend that it does, so
+         * that the length of a line is computed the same way for all
+         * lines. */
+        if (src->line_starts[src->num_lines] < src->size) {
+            src->unterminated = 1;
+            src->line_starts[++src->num_lines] = src->size + 1;
+            if (terminate) {
+                src->data[src->size++] = '\0';
+            }
+        }
+    } else {
+        err = 1;
+    }
+
+    linechunk_free_all(chunks, num_chunks);
+    return err;
+}
+
+TextSource *textsource_init(size_t capacity)
+{
+    TextSource *src = malloc(sizeof(*src));
+    if (!src) {
+        return NULL;
+    }
+
+    src->data = capacity > 0 ? malloc(capacity) : NULL;
+    src->line_starts_size = 16;
+    src->line_starts = malloc(src->line_starts_size
+                              * sizeof(*src->line_starts));
+    if ((capacity > 0 && !src->data) || !src->line_starts) {
+        free(src->data);
+        free(src->line_starts);
+        free(src);
+        return NULL;
+    }
+
+    src->mapped = 0;
+    src->unterminated = 0;
+    src->fd = -1;
+    src->size = 0;
+    src->capacity = capacity;
+    src->line_starts[0] = 0;
+    src->num_lines = 0;
+    src->next = NULL;
+    return src;
+}
+
+TextSource *textsource_read_file(FILE *fp, int num_threads)
+{
+    TextSource *src;
+    size_t capacity = 1 << 16;
+    size_t n;
+
+    assert(fp != NULL);
+
+    if (!(src = textsource_init(capacity))) {
+        return NULL;
+    }
+
+    /* Read the whole file with as few copies as possible. The extra byte at
+     * the end is for the null character of the last line if the file doesn't
+     * end with a newline. */
+    while ((n = fread(src->data + src->size, 1,
+                      src->capacity - src->size - 1, fp)) > 0) {
+        src->size += n;
+        if (src->size + 1 == src->capacity) {
+            char *new_data = realloc(src->data, src->capacity * 2);
+            if (!new_data) {
+                textsource_free(src);
+                return NULL;
+            }
+            src->data = new_data;
+            src->capacity *= 2;
+        }
+    }
+    if (ferror(fp)) {
+        textsource_free(src);
+        return NULL;
+    }
+
+    /* turn newlines into null characters and remember where lines start */
+    if (textsource_find_lines(src, 1, num_threads)) {
+        textsource_free(src);
+        return NULL;
+    }
+
+    return src;
+}
+
+TextSource *textsource_map_file(int fd, int num_threads)
+{
+    TextSource *src;
+    struct stat st;
+    void *data = NULL;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+
+    /* empty files can't be mapped, but they don't have any lines either */
+    if (st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            return NULL;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    if (!(src = textsource_init(0))) {
+        if (data) {
+            munmap(data, st.st_size);
+        }
+        return NULL;
+    }
+    src->data = data;
+    src->mapped = 1;
+    src->size = st.st_size;
+    src->capacity = st.st_size;
+
+    if (textsource_find_lines(src, 0, num_threads)) {
+        textsource_free(src);
+        return NULL;
+    }
+
+    /* after indexing, lines are mostly read where the user happens to be */
+    if (data) {
+        madvise(data, st.st_size, MADV_RANDOM);
+    }
+    return src;
+}
+
+TextSource *textsource_open_file(int fd, int map)
+{
+    TextSource *src;
+    struct stat st;
+    char *data = NULL;
+
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        return NULL;
+    }
+
+    /* The whole file gets its place in memory at once, so lines that have
+     * been found stay where they are while the rest is loaded. */
+    if (map && st.st_size > 0) {
+        data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (data == MAP_FAILED) {
+            return NULL;
+        }
+        madvise(data, st.st_size, MADV_SEQUENTIAL);
+    } else if (!map && !(data = malloc(st.st_size + 1))) {
+        return NULL;
+    }
+
+    if (!(src = textsource_init(0))) {
+        if (map && data) {
+            munmap(data, st.st_size);
+        } else if (!map) {
+            free(data);
+        }
+        return NULL;
+    }
+    src->data = data;
+    src->mapped = map;
+    src->size = st.st_size;
+    src->capacity = map ? st.st_size : st.st_size + 1;
+    return src;
+}
+
+size_t *textsource_scan_lines(TextSource *src, size_t begin, size_t end,
+                              int num_threads, size_t *num_found)
+{
+    LineChunk *chunks;
+    size_t num_chunks;
+    size_t total;
+    size_t *starts;
+    size_t i;
+
+    assert(src != NULL);
+    assert(num_found != NULL);
+    assert(begin <= end && end <= src->capacity);
+
+    chunks = linechunk_find_all(src->data, begin, end, !src->mapped,
+                                num_threads, &num_chunks, &total);
+    if (!chunks) {
+        return NULL;
+    }
+
+    /* one extra offset is allowed for the caller, and it makes sure that
+     * malloc isn't asked for 0 bytes */
+    if ((starts = malloc((total + 1) * sizeof(*starts)))) {
+        size_t n = 0;
+        for (i = 0; i < num_chunks; ++i) {
+            chunks[i].dest = starts + n;
+            n += chunks[i].num_lines;
+        }
+        linechunk_run_all(chunks, num_chunks, linechunk_copy_lines);
+        *num_found = total;
+    }
+
+    linechunk_free_all(chunks, num_chunks);
+    return starts;
+}
+
+int textsource_add_lines(TextSource *src, const size_t *starts, size_t n)
+{
+    assert(src != NULL);
+    assert(starts != NULL || n == 0);
+
+    if (textsource_reserve_lines(src, n)) {
+        return 1;
+    }
+    memcpy(src->line_starts + src->num_lines + 1, starts,
+           n * sizeof(*starts));
+    src->num_lines += n;
+    return 0;
+}
+
+void textsource_free(TextSource *src)
+{
+    if (!src) {
+        return;
+    }
+
+    if (src->mapped) {
+        if (src->data) {
+            munmap(src->data, src->capacity);
+        }
+    } else {
+        free(src->data);
+    }
+    if (src->fd != -1) {
+        close(src->fd);
+    }
+    free(src->line_starts);
+    free(src);
+}
+
+long textsource_append_line(TextSource *src, const char *text,
+                            size_t num_bytes)
+{
+    assert(src != NULL);
+    assert(text != NULL);
+
+    if (src->capacity - src->size < num_bytes + 1) {
+        return -1;
+    }
+    if (textsource_reserve_lines(src, 1)) {
+        return -1;
+    }
+
+    memcpy(src->data + src->size, text, num_bytes);
+    src->size += num_bytes;
+    src->data[src->size++] = '\0';
+    src->line_starts[++src->num_lines] = src->size;
+    return src->num_lines - 1;
+}
+
+const char *textsource_line(const TextSource *src, size_t line)
+{
+    assert(src != NULL);
+    assert(line < src->num_lines);
+
+    return src->data + src->line_starts[line];
+}
+
+size_t textsource_line_length(const TextSource *src, size_t line)
+{
+    assert(src != NULL);
+    assert(line < src->num_lines);
+
+    return src->line_starts[line+1] - src->line_starts[line] - 1;
+}
+
+size_t textsource_line_offset(const TextSource *src, size_t line)
+{
+    assert(src != NULL);
+    assert(line <= src->num_lines);
+
+    return src->line_starts[line];
+}
+
+size_t textsource_line_at(const TextSource *src, size_t first,
+                          size_t last, size_t offset)
+{
+    assert(src != NULL);
+    assert(first <= last && last < src->num_lines);
+
+    /* the last line in [first, last] that starts at or before offset */
+    while (first < last) {
+        size_t mid = first + (last - first + 1) / 2;
+        if (src->line_starts[mid] <= offset) {
+            first = mid;
+        } else {
+            last = mid - 1;
+        }
+    }
+    return first;
+}
+
+int textsource_attach_file(TextSource *src, int fd)
+{
+    int new_fd;
+
+    assert(src != NULL);
+    assert(src->fd == -1);
+
+    if ((new_fd = dup(fd)) == -1) {
+        return 1;
+    }
+    if (fstat(new_fd, &src->file_stat) || !S_ISREG(src->file_stat.st_mode)) {
+        close(new_fd);
+        return 1;
+    }
+    src->fd = new_fd;
+    return 0;
+}
+
+int textsource_file_unchanged(const TextSource *src)
+{
+    struct stat st;
+
+    assert(src != NULL);
+
+    return src->fd != -1 && fstat(src->fd, &st) == 0
+           && st.st_size == src->file_stat.st_size
+           && st.st_mtim.tv_sec == src->file_stat.st_mtim.tv_sec
+           && st.st_mtim.tv_nsec == src->file_stat.st_mtim.tv_nsec;
+}
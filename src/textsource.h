@@ -0,0 +1,221 @@
+/**
+ * @file textsource.h
+ * @author dreamyeyed
+ *
+ * A TextSource is a block of text that lines in a TextBuffer can refer to
+ * without copying it. The contents of a file are loaded into one TextSource
+ * that is never modified after that, and text added while editing is
+ * appended to other TextSources. Text that has been added is never changed or
+ * removed, so pointers to it stay valid until the TextSource is freed.
+ *
+ * Every line in a TextSource is terminated with a null character in place of
+ * the newline, so the lines can be used as normal C strings. The exception
+ * is a TextSource that maps a file into memory: the mapping is read-only, so
+ * its lines still end with a newline (or the end of the file).
+ */
+#pragma once
+
+#include <stddef.h>
+#include <stdio.h>
+
+#include <sys/stat.h>
+
+typedef struct TextSource
+{
+    /** the text of all lines, each one followed by a null character */
+    char *data;
+    /**
+     * non-zero if data is a read-only mapping of a file, in which case the
+     * lines are followed by newlines instead of null characters
+     */
+    int mapped;
+    /** number of bytes used in data */
+    size_t size;
+    /** size of the data array */
+    size_t capacity;
+    /**
+     * Offsets of the first byte of each line. There is one extra offset at
+     * the end, so that the length of line i is always
+     * line_starts[i+1] - line_starts[i] - 1.
+     */
+    size_t *line_starts;
+    /** number of lines */
+    size_t num_lines;
+    /** size of the line_starts array */
+    size_t line_starts_size;
+    /** non-zero if the last line didn't end with a newline */
+    int unterminated;
+    /**
+     * A file descriptor of the file that the text was loaded from, or -1.
+     * The offset of a line in data is also its offset in the file.
+     */
+    int fd;
+    /** the state of the file when it was loaded */
+    struct stat file_stat;
+    /** next TextSource in the same buffer */
+    struct TextSource *next;
+} TextSource;
+
+/**
+ * Creates an empty TextSource that text can be appended to.
+ *
+ * @param capacity number of bytes that can be appended
+ * @return pointer to a dynamically allocated TextSource, or NULL in case of
+ * error
+ */
+TextSource *textsource_init(size_t capacity);
+
+/**
+ * Reads a complete file into a new TextSource.
+ *
+ * Big files are searched for lines by several threads at the same time,
+ * each one working on its own part of the file.
+ *
+ * @param fp the file to read
+ * @param num_threads maximum number of threads used to find the lines, or 0
+ * to use one thread per CPU
+ * @return pointer to a dynamically allocated TextSource, or NULL in case of
+ * error
+ */
+TextSource *textsource_read_file(FILE *fp, int num_threads);
+
+/**
+ * Maps a complete file into memory and finds the lines in it. Nothing is
+ * copied; only the offsets of the lines are stored. The file must not be
+ * truncated while the TextSource exists.
+ *
+ * @param fd a file descriptor of a regular file that is open for reading
+ * @param num_threads maximum number of threads used to find the lines, or 0
+ * to use one thread per CPU
+ * @return pointer to a dynamically allocated TextSource, or NULL in case of
+ * error
+ */
+TextSource *textsource_map_file(int fd, int num_threads);
+
+/**
+ * Makes room for the whole contents of a regular file in a new TextSource
+ * without loading anything yet. The file is either mapped or a buffer big
+ * enough for it is allocated. No lines are known until textsource_scan_lines
+ * has found them and they have been added with textsource_add_lines, so the
+ * file can be loaded piece by piece while the lines that have already been
+ * added are used.
+ *
+ * @param fd a file descriptor of a regular file that is open for reading
+ * @param map non-zero to map the file, zero to read it into memory later
+ * @return pointer to a dynamically allocated TextSource, or NULL if the file
+ * isn't a regular file or in case of error
+ */
+TextSource *textsource_open_file(int fd, int map);
+
+/**
+ * Finds the lines that start after the newlines between two offsets of a
+ * TextSource made by textsource_open_file. Unless the TextSource is mapped,
+ * the newlines are replaced with null characters. Nothing else in the
+ * TextSource is changed, so this can be done in another thread while the
+ * lines that have already been added are used.
+ *
+ * @param src
+ * @param begin offset of the first byte to search
+ * @param end offset of the byte after the last one
+ * @param num_threads maximum number of threads used to search, or 0 to use
+ * one thread per CPU
+ * @param num_found the number of offsets found is stored here
+ * @return a dynamically allocated array of offsets with space for one more,
+ * or NULL in case of error
+ */
+size_t *textsource_scan_lines(TextSource *src, size_t begin, size_t end,
+                              int num_threads, size_t *num_found);
+
+/**
+ * Adds lines found by textsource_scan_lines to a TextSource. Every offset is
+ * the start of a line after a newline, so each one completes the line before
+ * it.
+ *
+ * @param src
+ * @param starts offsets of the lines
+ * @param n number of offsets
+ * @return 0 on success, non-zero if there wasn't enough memory
+ */
+int textsource_add_lines(TextSource *src, const size_t *starts, size_t n);
+
+/**
+ * Destroys a TextSource.
+ *
+ * @param src
+ */
+void textsource_free(TextSource *src);
+
+/**
+ * Appends a line to a TextSource.
+ *
+ * @param src
+ * @param text the text of the line (it will be copied)
+ * @param num_bytes length of text in bytes
+ * @return index of the new line, or -1 if there isn't enough space left
+ */
+long textsource_append_line(TextSource *src, const char *text,
+                            size_t num_bytes);
+
+/**
+ * Returns the text of a line.
+ *
+ * @param src
+ * @param line index of the line
+ * @return pointer to the text of the line, which is null terminated unless
+ * the TextSource is mapped
+ */
+const char *textsource_line(const TextSource *src, size_t line);
+
+/**
+ * Returns the length of a line in bytes.
+ *
+ * @param src
+ * @param line index of the line
+ * @return number of bytes on the line, excluding the null character
+ */
+size_t textsource_line_length(const TextSource *src, size_t line);
+
+/**
+ * Returns the offset of a line from the start of the TextSource. If the
+ * TextSource was loaded from a file, this is also the offset of the line in
+ * the file.
+ *
+ * @param src
+ * @param line index of the line, or the number of lines for the end of the
+ * last line
+ * @return offset of the first byte of the line
+ */
+size_t textsource_line_offset(const TextSource *src, size_t line);
+
+/**
+ * Finds the line that contains an offset, looking only at the lines from
+ * first to last.
+ *
+ * @param src
+ * @param first index of the first line to consider
+ * @param last index of the last line to consider
+ * @param offset an offset from the start of the TextSource
+ * @return index of the line
+ */
+size_t textsource_line_at(const TextSource *src, size_t first,
+                          size_t last, size_t offset);
+
+/**
+ * Remembers the file that a TextSource was loaded from, so that the text can
+ * later be copied from the file directly. The TextSource keeps a duplicate of
+ * the file descriptor until it's freed.
+ *
+ * @param src
+ * @param fd a file descriptor of the file that the text was loaded from
+ * @return 0 on success, non-zero otherwise
+ */
+int textsource_attach_file(TextSource *src, int fd);
+
+/**
+ * Checks whether the file that a TextSource was loaded from still has the
+ * same text. Only the size and the modification time are compared.
+ *
+ * @param src
+ * @return non-zero if the text can be copied from the file
+ */
+int textsource_file_unchanged(const TextSource *src);
@@ -0,0 +1,756 @@
+/*
+ * trigram.c
+ *
+ * Indexing the trigrams of a buffer. See trigram.h.
+ */
+
+#include "trigram.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+
+/* Number of lines in a new block. Blocks that grow to twice this are split
+ * again. */
+#define TRIGRAM_BLOCK_LINES 4096
+/* Trigrams are hashed to this many bits. */
+#define TRIGRAM_BITS 16
+/* Number of 64-bit words in the bitmap of a block. */
+#define TRIGRAM_WORDS ((1 << TRIGRAM_BITS) / 64)
+/* At most this many trigrams of a pattern are looked up. */
+#define TRIGRAM_MAX_LOOKUPS 32
+/* Number of blocks whose lines are copied before the thread needs them. */
+#define TRIGRAM_QUEUE 16
+
+typedef struct TrigramBlock
+{
+    /** number of lines in the block */
+    size_t num_lines;
+    /**
+     * A number that no other block has had. It changes whenever the block
+     * changes, so that the thread can tell whether the lines it indexed are
+     * still the lines of the block.
+     */
+    unsigned long version;
+    /** which trigram hashes occur in the block, or NULL if not indexed */
+    uint64_t *bits;
+} TrigramBlock;
+
+/* A block that the thread indexes next. */
+typedef struct TrigramJob
+{
+    size_t block;
+    unsigned long version;
+    /** copy of the lines of the block, freed when they have been indexed */
+    TextBlock *text;
+    size_t num_text;
+} TrigramJob;
+
+struct TrigramIndex
+{
+    TextBuffer *buf;
+    /** protects the blocks and everything below them */
+    pthread_mutex_t lock;
+    TrigramBlock *blocks;
+    size_t num_blocks;
+    /** size of the blocks array */
+    size_t blocks_size;
+    /** number of lines in all blocks */
+    size_t num_lines;
+    /** loaded_bytes of the buffer when the index last looked at it */
+    size_t loaded_bytes;
+    /** the version that the next changed block gets */
+    unsigned long next_version;
+    /** a block and its first line, where finding a line starts */
+    size_t hint_block;
+    size_t hint_start;
+    /** the indexing thread, if started is non-zero */
+    pthread_t thread;
+    int started;
+    /** non-zero when the thread has finished */
+    int done;
+    /** non-zero if the thread should stop */
+    int cancel;
+    /** signalled when jobs are queued or the thread should stop */
+    pthread_cond_t fed;
+    /** a ring of the jobs that the thread takes next */
+    TrigramJob queue[TRIGRAM_QUEUE];
+    size_t queue_head;
+    size_t queue_count;
+    /** where trigram_feed looks for the next block to index */
+    size_t feed_block;
+    /** non-zero when every block to index has been queued */
+    int fed_all;
+    /** bytes used by the copies of lines that the thread hasn't freed */
+    size_t copy_bytes;
+};
+
+/* Returns the hash of a trigram. ASCII letters are hashed in lower case. */
+static unsigned int trigram_hash(unsigned char a, unsigned char b,
+                                 unsigned char c)
+{
+    uint32_t t;
+
+    a = a >= 'A' && a <= 'Z' ? a - 'A' + 'a' : a;
+    b = b >= 'A' && b <= 'Z' ? b - 'A' + 'a' : b;
+    c = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    t = (uint32_t) a << 16 | (uint32_t) b << 8 | c;
+    return (uint32_t) (t * 2654435761u) >> (32 - TRIGRAM_BITS);
+}
+
+/* Finds the block that contains a line. Its first line is stored in *start.
+ * Returns num_blocks if the line is past the last block. */
+static size_t trigram_find_block(TrigramIndex *index, size_t line,
+                                 size_t *start)
+{
+    size_t k = 0;
+    size_t pos = 0;
+
+    if (index->hint_block < index->num_blocks && index->hint_start <= line) {
+        k = index->hint_block;
+        pos = index->hint_start;
+    }
+    while (k < index->num_blocks && pos + index->blocks[k].num_lines <= line) {
+        pos += index->blocks[k].num_lines;
+        ++k;
+    }
+
+    index->hint_block = k;
+    index->hint_start = pos;
+    *start = pos;
+    return k;
+}
+
+/* Marks a block as changed, so that it's searched normally until it has
+ * been indexed again. */
+static void trigram_invalidate(TrigramIndex *index, size_t k)
+{
+    TrigramBlock *block = &index->blocks[k];
+
+    block->version = index->next_version++;
+    free(block->bits);
+    block->bits = NULL;
+}
+
+/* Adds n new blocks before the block k. Returns 0 on success. */
+static int trigram_add_blocks(TrigramIndex *index, size_t k, size_t n)
+{
+    size_t i;
+
+    if (index->num_blocks + n > index->blocks_size) {
+        size_t new_size = index->blocks_size ? index->blocks_size : 64;
+        TrigramBlock *new_blocks;
+        while (new_size < index->num_blocks + n) {
+            new_size *= 2;
+        }
+        new_blocks = realloc(index->blocks, new_size * sizeof(*new_blocks));
+        if (!new_blocks) {
+            return 1;
+        }
+        index->blocks = new_blocks;
+        index->blocks_size = new_size;
+    }
+
+    memmove(index->blocks + k + n, index->blocks + k,
+            (index->num_blocks - k) * sizeof(*index->blocks));
+    for (i = k; i < k + n; ++i) {
+        index->blocks[i].num_lines = 0;
+        index->blocks[i].version = index->next_version++;
+        index->blocks[i].bits = NULL;
+    }
+    index->num_blocks += n;
+    /* the blocks after k have moved */
+    index->hint_block = 0;
+    index->hint_start = 0;
+    return 0;
+}
+
+/* Splits a block that has grown too big into blocks of normal size. Its
+ * lines aren't indexed, so the new blocks aren't either. */
+static void trigram_split(TrigramIndex *index, size_t k)
+{
+    size_t num_lines = index->blocks[k].num_lines;
+    size_t n = (num_lines - 1) / TRIGRAM_BLOCK_LINES;
+    size_t i;
+
+    if (num_lines < 2 * TRIGRAM_BLOCK_LINES
+        || trigram_add_blocks(index, k + 1, n)) {
+        return;
+    }
+    for (i = k; i < k + n; ++i) {
+        index->blocks[i].num_lines = TRIGRAM_BLOCK_LINES;
+    }
+    index->blocks[k+n].num_lines = num_lines - n * TRIGRAM_BLOCK_LINES;
+}
+
+/* Tells the index that n lines were added before the line pos. */
+static void trigram_insert_lines(TrigramIndex *index, size_t pos, size_t n)
+{
+    size_t start;
+    size_t k = trigram_find_block(index, pos, &start);
+
+    if (k == index->num_blocks) {
+        /* The lines were added at the end. If there's no memory for a new
+         * block, the last one grows instead, and if there isn't one, the
+         * lines stay unknown and nothing is skipped. */
+        if ((k == 0 || index->blocks[k-1].num_lines >= TRIGRAM_BLOCK_LINES)
+            && trigram_add_blocks(index, k, 1)) {
+            if (k == 0) {
+                return;
+            }
+            --k;
+        } else if (k > 0 && index->blocks[k-1].num_lines
+                            < TRIGRAM_BLOCK_LINES) {
+            --k;
+        }
+    }
+
+    index->blocks[k].num_lines += n;
+    index->num_lines += n;
+    trigram_invalidate(index, k);
+    trigram_split(index, k);
+}
+
+/* Tells the index that n lines were removed starting from the line pos. */
+static void trigram_remove_lines(TrigramIndex *index, size_t pos, size_t n)
+{
+    size_t start;
+    size_t k = trigram_find_block(index, pos, &start);
+
+    /* The bitmaps of the blocks still have the trigrams of the lines that
+     * were removed, but that only makes them find more blocks. */
+    while (n > 0 && k < index->num_blocks) {
+        TrigramBlock *block = &index->blocks[k];
+        size_t m = block->num_lines - (pos > start ? pos - start : 0);
+        if (m > n) {
+            m = n;
+        }
+        block->num_lines -= m;
+        index->num_lines -= m;
+        n -= m;
+        if (block->num_lines == 0) {
+            free(block->bits);
+            memmove(block, block + 1,
+                    (index->num_blocks - k - 1) * sizeof(*block));
+            --index->num_blocks;
+        } else {
+            start += block->num_lines;
+            ++k;
+        }
+    }
+    index->hint_block = 0;
+    index->hint_start = 0;
+}
+
+/* Tells the index that a line was changed. */
+static void trigram_touch(TrigramIndex *index, size_t line)
+{
+    size_t start;
+    size_t k = trigram_find_block(index, line, &start);
+
+    if (k < index->num_blocks) {
+        trigram_invalidate(index, k);
+    }
+}
+
+/* Updates the index for changes that the buffer doesn't report: lines
+ * added to the end by loading or following a file. The buffer has
+ * num_lines lines when these are counted. The lock must be held. */
+static void trigram_sync(TrigramIndex *index, size_t num_lines)
+{
+    TextBuffer *buf = index->buf;
+
+    /* the last line may have been continued */
+    if (buf->loaded_bytes != index->loaded_bytes) {
+        index->loaded_bytes = buf->loaded_bytes;
+        if (index->num_blocks > 0) {
+            trigram_invalidate(index, index->num_blocks - 1);
+        }
+    }
+
+    if (num_lines > index->num_lines) {
+        trigram_insert_lines(index, index->num_lines,
+                             num_lines - index->num_lines);
+    } else if (num_lines < index->num_lines) {
+        trigram_remove_lines(index, num_lines, index->num_lines - num_lines);
+    }
+}
+
+/* Counts the newlines in some text. */
+static size_t count_newlines(const char *text, size_t num_bytes)
+{
+    const char *end = text + num_bytes;
+    size_t n = 0;
+
+    while ((text = memchr(text, '\n', end - text))) {
+        ++text;
+        ++n;
+    }
+    return n;
+}
+
+/* Updates the index after each edit. */
+static void trigram_on_edit(void *data, TextBuffer *buf, const TextEdit *edit)
+{
+    TrigramIndex *index = data;
+    size_t added = 0, removed = 0;
+
+    pthread_mutex_lock(&index->lock);
+
+    if (edit->type == TEXTEDIT_INSERT) {
+        added = count_newlines(edit->text, edit->num_bytes);
+    } else if (edit->type == TEXTEDIT_DELETE) {
+        removed = edit->end_line - edit->line;
+    } else if (edit->type == TEXTEDIT_SPLIT
+               || edit->type == TEXTEDIT_INSERT_LINE) {
+        added = 1;
+    } else if (edit->type == TEXTEDIT_JOIN
+               || edit->type == TEXTEDIT_DELETE_LINE) {
+        removed = 1;
+    }
+    /* the lines before the edit are the ones the index knows about */
+    trigram_sync(index, buf->num_lines + removed - added);
+
+    switch (edit->type) {
+    case TEXTEDIT_INSERT:
+    case TEXTEDIT_SPLIT:
+        trigram_touch(index, edit->line);
+        if (added > 0) {
+            trigram_insert_lines(index, edit->line + 1, added);
+        }
+        break;
+    case TEXTEDIT_DELETE:
+    case TEXTEDIT_JOIN:
+        if (removed > 0) {
+            trigram_remove_lines(index, edit->line + 1, removed);
+        }
+        trigram_touch(index, edit->line);
+        break;
+    case TEXTEDIT_INSERT_LINE:
+        trigram_insert_lines(index, edit->line, 1);
+        break;
+    case TEXTEDIT_DELETE_LINE:
+        trigram_remove_lines(index, edit->line, 1);
+        break;
+    case TEXTEDIT_REPLACE_LINE:
+        trigram_touch(index, edit->line);
+        break;
+    }
+
+    pthread_mutex_unlock(&index->lock);
+}
+
+/* Tells whether the block k can contain the trigrams. */
+static int trigram_candidate(const TrigramIndex *index, size_t k,
+                             const unsigned int *hashes, size_t num_hashes)
+{
+    const TrigramBlock *block = &index->blocks[k];
+    size_t i;
+
+    if (block->num_lines == 0) {
+        return 0;
+    } else if (!block->bits) {
+        return 1;
+    }
+    for (i = 0; i < num_hashes; ++i) {
+        if (!(block->bits[hashes[i] / 64] & (uint64_t) 1 << hashes[i] % 64)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* The search filter of the buffer. See TextSearchFilter. */
+static int trigram_filter(void *data, TextBuffer *buf,
+                          const SearchPattern *pat, int backward,
+                          size_t line, size_t *first, size_t *last)
+{
+    TrigramIndex *index = data;
+    unsigned int hashes[TRIGRAM_MAX_LOOKUPS];
+    size_t num_hashes = 0;
+    size_t i, k, start;
+    size_t step = 1;
+    const unsigned char *text = (const unsigned char *) pat->text;
+    int result = 0;
+
+    if (buf->num_lines == 0) {
+        return 1;
+    } else if (line >= buf->num_lines) {
+        if (!backward) {
+            return 1;
+        }
+        line = buf->num_lines - 1;
+    }
+
+    /* long patterns are looked up with trigrams from all over them */
+    if (pat->num_bytes >= 3) {
+        size_t n = pat->num_bytes - 2;
+        step = (n + TRIGRAM_MAX_LOOKUPS - 1) / TRIGRAM_MAX_LOOKUPS;
+        for (i = 0; i < n; i += step) {
+            hashes[num_hashes++] = trigram_hash(text[i], text[i+1],
+                                                text[i+2]);
+        }
+    }
+
+    pthread_mutex_lock(&index->lock);
+    trigram_sync(index, buf->num_lines);
+
+    if (num_hashes == 0 || index->num_lines != buf->num_lines) {
+        /* nothing can be skipped */
+        *first = backward ? 0 : line;
+        *last = backward ? line : buf->num_lines - 1;
+    } else if (!backward) {
+        k = trigram_find_block(index, line, &start);
+        while (k < index->num_blocks
+               && !trigram_candidate(index, k, hashes, num_hashes)) {
+            start += index->blocks[k++].num_lines;
+        }
+        if (k == index->num_blocks) {
+            result = 1;
+        } else {
+            *first = start;
+            while (k < index->num_blocks
+                   && trigram_candidate(index, k, hashes, num_hashes)) {
+                start += index->blocks[k++].num_lines;
+            }
+            *last = start - 1;
+        }
+    } else {
+        k = trigram_find_block(index, line, &start);
+        while (!trigram_candidate(index, k, hashes, num_hashes)) {
+            if (k == 0) {
+                break;
+            }
+            start -= index->blocks[--k].num_lines;
+        }
+        if (!trigram_candidate(index, k, hashes, num_hashes)) {
+            result = 1;
+        } else {
+            *last = start + index->blocks[k].num_lines - 1;
+            while (k > 0
+                   && trigram_candidate(index, k - 1, hashes, num_hashes)) {
+                start -= index->blocks[--k].num_lines;
+            }
+            *first = start;
+        }
+    }
+
+    pthread_mutex_unlock(&index->lock);
+    return result;
+}
+
+/* Adds the trigrams of a line to a bitmap. */
+static void trigram_add_line(uint64_t *bits, const char *line,
+                             size_t num_bytes)
+{
+    const unsigned char *s = (const unsigned char *) line;
+    size_t i;
+
+    for (i = 0; i + 2 < num_bytes; ++i) {
+        unsigned int h = trigram_hash(s[i], s[i+1], s[i+2]);
+        bits[h / 64] |= (uint64_t) 1 << h % 64;
+    }
+}
+
+/* Returns how many bytes the copies of the lines of a job use. */
+static size_t trigram_job_size(const TrigramJob *job)
+{
+    size_t total = job->num_text * sizeof(*job->text);
+    size_t j;
+
+    for (j = 0; j < job->num_text; ++j) {
+        const TextBlock *text = &job->text[j];
+        total += (text->num_lines + 1) * sizeof(size_t);
+        if (text->copy) {
+            total += text->line_starts[text->num_lines]
+                     - text->line_starts[0];
+        }
+    }
+    return total;
+}
+
+/* The function that the indexing thread runs. */
+static void *trigram_run(void *arg)
+{
+    TrigramIndex *index = arg;
+    size_t j, k;
+
+    for (;;) {
+        TrigramJob job;
+        uint64_t *bits, *old = NULL;
+
+        pthread_mutex_lock(&index->lock);
+        while (!index->cancel && index->queue_count == 0
+               && !index->fed_all) {
+            pthread_cond_wait(&index->fed, &index->lock);
+        }
+        if (index->cancel || index->queue_count == 0) {
+            pthread_mutex_unlock(&index->lock);
+            break;
+        }
+        job = index->queue[index->queue_head];
+        index->queue_head = (index->queue_head + 1) % TRIGRAM_QUEUE;
+        --index->queue_count;
+        pthread_mutex_unlock(&index->lock);
+
+        if ((bits = calloc(TRIGRAM_WORDS, sizeof(*bits)))) {
+            for (j = 0; j < job.num_text; ++j) {
+                const TextBlock *text = &job.text[j];
+                for (k = 0; k < text->num_lines; ++k) {
+                    trigram_add_line(bits,
+                                     text->text + text->line_starts[k],
+                                     text->line_starts[k+1]
+                                     - text->line_starts[k] - 1);
+                }
+            }
+        }
+
+        /* the block may have changed while it was being indexed */
+        pthread_mutex_lock(&index->lock);
+        index->copy_bytes -= trigram_job_size(&job);
+        if (bits && job.block < index->num_blocks
+            && index->blocks[job.block].version == job.version) {
+            old = index->blocks[job.block].bits;
+            index->blocks[job.block].bits = bits;
+            bits = NULL;
+        }
+        pthread_mutex_unlock(&index->lock);
+        textbuf_free_blocks(job.text, job.num_text);
+        free(bits);
+        free(old);
+    }
+
+    pthread_mutex_lock(&index->lock);
+    index->done = 1;
+    pthread_mutex_unlock(&index->lock);
+    return NULL;
+}
+
+/* Copies the lines of the next blocks to index into the queue, so that the
+ * thread has some lines waiting but the buffer is never copied all at once.
+ * This runs on the thread that edits the buffer, which is the only one that
+ * changes the blocks, so they stay the same while the lock is released. */
+static void trigram_feed(TrigramIndex *index)
+{
+    pthread_mutex_lock(&index->lock);
+    while (!index->fed_all && !index->cancel && !index->done
+           && index->queue_count < TRIGRAM_QUEUE) {
+        TrigramJob job;
+        size_t k, start = 0, num_lines;
+        int err;
+
+        for (k = 0; k < index->feed_block && k < index->num_blocks; ++k) {
+            start += index->blocks[k].num_lines;
+        }
+        while (k < index->num_blocks && index->blocks[k].bits) {
+            start += index->blocks[k++].num_lines;
+        }
+        if (k == index->num_blocks) {
+            index->fed_all = 1;
+            break;
+        }
+        job.block = k;
+        job.version = index->blocks[k].version;
+        num_lines = index->blocks[k].num_lines;
+        pthread_mutex_unlock(&index->lock);
+
+        err = textbuf_get_blocks(index->buf, start, num_lines,
+                                 TRIGRAM_BLOCK_LINES * 2, &job.text,
+                                 &job.num_text);
+
+        pthread_mutex_lock(&index->lock);
+        if (err) {
+            /* tried again at the next call */
+            break;
+        }
+        index->queue[(index->queue_head + index->queue_count)
+                     % TRIGRAM_QUEUE] = job;
+        ++index->queue_count;
+        index->copy_bytes += trigram_job_size(&job);
+        index->feed_block = k + 1;
+    }
+    pthread_cond_broadcast(&index->fed);
+    pthread_mutex_unlock(&index->lock);
+}
+
+/* Frees the jobs that the thread didn't take. */
+static void trigram_free_jobs(TrigramIndex *index)
+{
+    while (index->queue_count > 0) {
+        TrigramJob *job = &index->queue[index->queue_head];
+        textbuf_free_blocks(job->text, job->num_text);
+        index->queue_head = (index->queue_head + 1) % TRIGRAM_QUEUE;
+        --index->queue_count;
+    }
+    index->queue_head = 0;
+    index->copy_bytes = 0;
+}
+
+/* Waits for the thread to finish. */
+static void trigram_join(TrigramIndex *index)
+{
+    if (!index->started) {
+        return;
+    }
+    pthread_join(index->thread, NULL);
+    trigram_free_jobs(index);
+    index->started = 0;
+}
+
+/* Tells the thread to stop and waits for it. */
+static void trigram_stop(TrigramIndex *index)
+{
+    pthread_mutex_lock(&index->lock);
+    index->cancel = 1;
+    pthread_cond_broadcast(&index->fed);
+    pthread_mutex_unlock(&index->lock);
+    trigram_join(index);
+    index->cancel = 0;
+}
+
+TrigramIndex *trigram_init(TextBuffer *buf)
+{
+    TrigramIndex *index;
+
+    assert(buf != NULL);
+
+    if (!(index = calloc(1, sizeof(*index)))) {
+        return NULL;
+    }
+    index->buf = buf;
+    index->loaded_bytes = buf->loaded_bytes;
+    pthread_mutex_init(&index->lock, NULL);
+    pthread_cond_init(&index->fed, NULL);
+
+    if (textbuf_add_listener(buf, trigram_on_edit, index)) {
+        pthread_cond_destroy(&index->fed);
+        pthread_mutex_destroy(&index->lock);
+        free(index);
+        return NULL;
+    }
+    textbuf_set_search_filter(buf, trigram_filter, index);
+    return index;
+}
+
+int trigram_refresh(TrigramIndex *index)
+{
+    int queued, failed;
+
+    assert(index != NULL);
+
+    if (trigram_building(index)) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&index->lock);
+    trigram_sync(index, index->buf->num_lines);
+    index->feed_block = 0;
+    index->fed_all = 0;
+    index->done = 0;
+    pthread_mutex_unlock(&index->lock);
+
+    /* the thread gets copies of the lines, since the buffer may change */
+    trigram_feed(index);
+    queued = index->queue_count > 0;
+    failed = !index->fed_all;
+    if (!queued) {
+        return failed;
+    }
+
+    if (pthread_create(&index->thread, NULL, trigram_run, index)) {
+        trigram_free_jobs(index);
+        return 1;
+    }
+    index->started = 1;
+    return 0;
+}
+
+int trigram_building(TrigramIndex *index)
+{
+    int done;
+
+    assert(index != NULL);
+
+    if (!index->started) {
+        return 0;
+    }
+    pthread_mutex_lock(&index->lock);
+    done = index->done;
+    pthread_mutex_unlock(&index->lock);
+    if (done) {
+        trigram_join(index);
+    } else {
+        trigram_feed(index);
+    }
+    return !done;
+}
+
+void trigram_clear(TrigramIndex *index)
+{
+    size_t k;
+
+    assert(index != NULL);
+
+    trigram_stop(index);
+    for (k = 0; k < index->num_blocks; ++k) {
+        free(index->blocks[k].bits);
+    }
+    index->num_blocks = 0;
+    index->num_lines = 0;
+    index->hint_block = 0;
+    index->hint_start = 0;
+}
+
+size_t trigram_memory(TrigramIndex *index)
+{
+    size_t total = sizeof(*index);
+    size_t k;
+
+    assert(index != NULL);
+
+    pthread_mutex_lock(&index->lock);
+    total += index->blocks_size * sizeof(*index->blocks);
+    total += index->copy_bytes;
+    for (k = 0; k < index->num_blocks; ++k) {
+        if (index->blocks[k].bits) {
+            total += TRIGRAM_WORDS * sizeof(uint64_t);
+        }
+    }
+    pthread_mutex_unlock(&index->lock);
+    return total;
+}
+
+size_t trigram_indexed_lines(TrigramIndex *index)
+{
+    size_t total = 0;
+    size_t k;
+
+    assert(index != NULL);
+
+    pthread_mutex_lock(&index->lock);
+    for (k = 0; k < index->num_blocks; ++k) {
+        if (index->blocks[k].bits) {
+            total += index->blocks[k].num_lines;
+        }
+    }
+    pthread_mutex_unlock(&index->lock);
+    return total;
+}
+
+void trigram_free(TrigramIndex *index)
+{
+    if (!index) {
+        return;
+    }
+
+    trigram_clear(index);
+    textbuf_set_search_filter(index->buf, NULL, NULL);
+    textbuf_remove_listener(index->buf, trigram_on_edit, index);
+    pthread_cond_destroy(&index->fed);
+    pthread_mutex_destroy(&index->lock);
+    free(index->blocks);
+    free(index);
+}
@@ -0,0 +1,87 @@
+/**
+ * @file trigram.h
+ * @author dreamyeyed
+ *
+ * A TrigramIndex lets textbuf_search skip the parts of a buffer that can't
+ * contain a pattern. The lines are divided into blocks, and for each block
+ * the index remembers which trigrams (three consecutive bytes of a line)
+ * occur in it, as a bitmap of hashed trigrams. A block can contain a pattern
+ * only if it has every trigram of the pattern. ASCII letters are indexed in
+ * lower case, so the index works for searches that ignore case too.
+ *
+ * The index is built by a background thread when asked to. The thread
+ * gets copies of the lines of a few blocks at a time, which trigram_building
+ * makes while it's polled. Edits are
+ * reported to the index by the buffer, and a block that is changed is
+ * searched normally until it has been indexed again. Lines added to a block
+ * make it longer, and only a block that grows too long is split, so an edit
+ * makes only the block it touches be indexed again.
+ */
+#pragma once
+
+#include <stddef.h>
+
+#include "textbuf.h"
+
+typedef struct TrigramIndex TrigramIndex;
+
+/**
+ * Creates an empty index for a buffer and makes textbuf_search use it.
+ * Nothing is indexed before trigram_refresh is called.
+ *
+ * @param buf the buffer; the index must be freed before it
+ * @return pointer to a dynamically allocated TrigramIndex, or NULL in case
+ * of error
+ */
+TrigramIndex *trigram_init(TextBuffer *buf);
+
+/**
+ * Starts indexing the blocks that aren't indexed in a background thread. If
+ * the thread is already running, this does nothing.
+ *
+ * @param index
+ * @return 0 on success, non-zero in case of error
+ */
+int trigram_refresh(TrigramIndex *index);
+
+/**
+ * Tells whether the background thread is still indexing, and copies the
+ * lines that it indexes next. The thread waits for them, so this should be
+ * called often while it returns non-zero.
+ *
+ * @param index
+ * @return non-zero if it is
+ */
+int trigram_building(TrigramIndex *index);
+
+/**
+ * Forgets everything. This must be done before a file is loaded into the
+ * buffer again, since the thread may be reading the old lines.
+ *
+ * @param index
+ */
+void trigram_clear(TrigramIndex *index);
+
+/**
+ * Returns how many bytes of memory the index uses, including the lines
+ * copied for the thread.
+ *
+ * @param index
+ * @return the number of bytes
+ */
+size_t trigram_memory(TrigramIndex *index);
+
+/**
+ * Returns how many lines are in blocks that have been indexed.
+ *
+ * @param index
+ * @return the number of lines
+ */
+size_t trigram_indexed_lines(TrigramIndex *index);
+
+/**
+ * Stops using the index and frees it.
+ *
+ * @param index
+ */
+void trigram_free(TrigramIndex *index);
@@ -0,0 +1,624 @@
+/*
+ * undo.c
+ *
+ * Undoing and redoing edits. See undo.h.
+ */
+
+#include "undo.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/* The text is compacted instead of being made bigger if at least this many
+ * bytes of it, and at least as many as are in use, belong to records that
+ * have been forgotten. */
+#define UNDO_MIN_GARBAGE (1 << 16)
+
+/* Types of records. Each is named after the edit that it makes. */
+enum
+{
+    /* insert the text at (line, col) */
+    UNDO_INSERT,
+    /* delete from (line, col) to (end_line, end_col) */
+    UNDO_DELETE,
+    /* replace the text of line */
+    UNDO_REPLACE
+};
+
+/* What the history does with the edits that it's told about. */
+enum
+{
+    /* they are new edits, so the steps that were undone are forgotten */
+    UNDO_RECORDING,
+    /* they undo a step, so they are recorded as a step to redo */
+    UNDO_UNDOING,
+    /* they redo a step, so they are recorded as a step to undo */
+    UNDO_REDOING
+};
+
+typedef struct UndoRecord
+{
+    unsigned char type;
+    /* non-zero if this is the first record of a step */
+    unsigned char first;
+    size_t line;
+    size_t col;
+    size_t end_line;
+    size_t end_col;
+    /* offset of the text in the text of the history */
+    size_t text;
+    size_t num_bytes;
+} UndoRecord;
+
+/* A stack of records. The bottom of the stack is records[begin], so that
+ * the oldest records can be forgotten without moving the others. */
+typedef struct UndoStack
+{
+    UndoRecord *records;
+    size_t begin;
+    size_t end;
+    size_t size;
+} UndoStack;
+
+struct UndoHistory
+{
+    /** the buffer whose edits are recorded */
+    TextBuffer *buf;
+    /** how many bytes undo_memory may return */
+    size_t limit;
+    /** steps that can be undone, the newest on top */
+    UndoStack undo;
+    /** steps that can be redone, the next one on top */
+    UndoStack redo;
+    /**
+     * The text of the records, which is only appended to. When a record is
+     * forgotten, its text stays until the text is compacted.
+     */
+    char *text;
+    /** number of bytes used in text */
+    size_t text_used;
+    /** size of text */
+    size_t text_size;
+    /** bytes of text that belong to records */
+    size_t live_bytes;
+    /** UNDO_RECORDING, UNDO_UNDOING or UNDO_REDOING */
+    int state;
+    /** non-zero if the next record begins a new step */
+    int new_step;
+    /** non-zero if the rest of the step isn't recorded because it was
+     * forgotten */
+    int dropping;
+};
+
+/* Returns the number of records in a stack. */
+static size_t undo_stack_count(const UndoStack *stack)
+{
+    return stack->end - stack->begin;
+}
+
+/* Adds a record to the top of a stack. Returns 0 on success. */
+static int undo_stack_push(UndoStack *stack, const UndoRecord *rec)
+{
+    if (stack->end == stack->size) {
+        if (stack->begin >= stack->size / 2 && stack->begin > 0) {
+            /* many records have been forgotten, so their room is reused */
+            memmove(stack->records, stack->records + stack->begin,
+                    undo_stack_count(stack) * sizeof(*rec));
+            stack->end -= stack->begin;
+            stack->begin = 0;
+        } else {
+            size_t new_size = stack->size ? stack->size * 2 : 64;
+            UndoRecord *new_records = realloc(stack->records,
+                                              new_size * sizeof(*rec));
+            if (!new_records) {
+                return 1;
+            }
+            stack->records = new_records;
+            stack->size = new_size;
+        }
+    }
+    stack->records[stack->end++] = *rec;
+    return 0;
+}
+
+/* Returns the stack where edits are recorded now. */
+static UndoStack *undo_target(UndoHistory *undo)
+{
+    return undo->state == UNDO_UNDOING ? &undo->redo : &undo->undo;
+}
+
+/* Returns the record that the last edit of the current step went to, or
+ * NULL if there isn't one. */
+static UndoRecord *undo_current(UndoHistory *undo)
+{
+    UndoStack *stack = undo_target(undo);
+
+    if (undo->new_step || stack->end == stack->begin) {
+        return NULL;
+    }
+    return &stack->records[stack->end - 1];
+}
+
+/* Forgets every record of a stack. */
+static void undo_forget_all(UndoHistory *undo, UndoStack *stack)
+{
+    size_t i;
+
+    for (i = stack->begin; i < stack->end; ++i) {
+        undo->live_bytes -= stack->records[i].num_bytes;
+    }
+    stack->begin = stack->end = 0;
+}
+
+/* Forgets the step at the bottom of a stack: the oldest step that can be
+ * undone, or the step that would be redone last. */
+static void undo_forget_oldest(UndoHistory *undo, UndoStack *stack)
+{
+    size_t i = stack->begin;
+
+    do {
+        undo->live_bytes -= stack->records[i].num_bytes;
+        ++i;
+    } while (i < stack->end && !stack->records[i].first);
+
+    stack->begin = i;
+    if (stack->begin == stack->end) {
+        stack->begin = stack->end = 0;
+    }
+}
+
+/* Copies the text of every record to a new block of size bytes, which must
+ * be at least live_bytes. Returns 0 on success. */
+static int undo_compact(UndoHistory *undo, size_t size)
+{
+    UndoStack *stacks[2];
+    char *text = NULL;
+    size_t used = 0;
+    size_t i;
+    int j;
+
+    if (size > 0 && !(text = malloc(size))) {
+        return 1;
+    }
+
+    stacks[0] = &undo->undo;
+    stacks[1] = &undo->redo;
+    for (j = 0; j < 2; ++j) {
+        for (i = stacks[j]->begin; i < stacks[j]->end; ++i) {
+            UndoRecord *rec = &stacks[j]->records[i];
+            if (rec->num_bytes > 0) {
+                memcpy(text + used, undo->text + rec->text, rec->num_bytes);
+            }
+            rec->text = used;
+            used += rec->num_bytes;
+        }
+    }
+
+    free(undo->text);
+    undo->text = text;
+    undo->text_used = used;
+    undo->text_size = size;
+    return 0;
+}
+
+/* Makes room for n more bytes of text. Returns 0 on success. */
+static int undo_reserve(UndoHistory *undo, size_t n)
+{
+    size_t garbage = undo->text_used - undo->live_bytes;
+    size_t new_size;
+    char *new_text;
+
+    if (undo->text_size - undo->text_used >= n) {
+        return 0;
+    }
+
+    if (garbage >= UNDO_MIN_GARBAGE && garbage >= undo->live_bytes) {
+        return undo_compact(undo, (undo->live_bytes + n) * 2);
+    }
+
+    new_size = undo->text_size ? undo->text_size * 2 : 4096;
+    while (new_size - undo->text_used < n) {
+        new_size *= 2;
+    }
+    if (!(new_text = realloc(undo->text, new_size))) {
+        return 1;
+    }
+    undo->text = new_text;
+    undo->text_size = new_size;
+    return 0;
+}
+
+/* Appends n bytes to the text. There must be room for them. */
+static void undo_put_text(UndoHistory *undo, const char *text, size_t n)
+{
+    if (n > 0) {
+        memcpy(undo->text + undo->text_used, text, n);
+        undo->text_used += n;
+        undo->live_bytes += n;
+    }
+}
+
+/* Forgets the oldest steps until the history uses well under its limit, so
+ * that this isn't needed again after every edit. */
+static void undo_enforce_limit(UndoHistory *undo)
+{
+    size_t target = undo->limit / 4 * 3;
+
+    if (undo_memory(undo) <= undo->limit) {
+        return;
+    }
+
+    while (undo_memory(undo) > target && undo_stack_count(&undo->undo) > 0) {
+        undo_forget_oldest(undo, &undo->undo);
+    }
+    while (undo_memory(undo) > target && undo_stack_count(&undo->redo) > 0) {
+        undo_forget_oldest(undo, &undo->redo);
+    }
+
+    /* a step that has been forgotten can't be continued */
+    if (undo->state == UNDO_RECORDING && !undo->new_step
+        && undo_stack_count(&undo->undo) == 0) {
+        undo->dropping = 1;
+    }
+    undo_compact(undo, undo->live_bytes);
+}
+
+/* Forgets everything after an error and the rest of the current step. */
+static void undo_fail(UndoHistory *undo)
+{
+    undo_clear(undo);
+    undo->dropping = 1;
+}
+
+/* Adds a record to the current step. */
+static void undo_push(UndoHistory *undo, int type, size_t line, size_t col,
+                      size_t end_line, size_t end_col, size_t text,
+                      size_t num_bytes)
+{
+    UndoRecord rec;
+
+    rec.type = type;
+    rec.first = undo->new_step;
+    rec.line = line;
+    rec.col = col;
+    rec.end_line = end_line;
+    rec.end_col = end_col;
+    rec.text = text;
+    rec.num_bytes = num_bytes;
+
+    if (undo_stack_push(undo_target(undo), &rec)) {
+        undo_fail(undo);
+        return;
+    }
+    undo->new_step = 0;
+    if (undo->state == UNDO_RECORDING) {
+        undo_enforce_limit(undo);
+    }
+}
+
+/* Records that text was inserted from (line, col) to (end_line, end_col).
+ * Text typed right after the text inserted before it extends the same
+ * record. */
+static void undo_inserted(UndoHistory *undo, size_t line, size_t col,
+                          size_t end_line, size_t end_col)
+{
+    UndoRecord *top = undo_current(undo);
+
+    if (line == end_line && col == end_col) {
+        return;
+    }
+
+    if (top && top->type == UNDO_DELETE && top->end_line == line
+        && top->end_col == col) {
+        top->end_line = end_line;
+        top->end_col = end_col;
+        return;
+    }
+    undo_push(undo, UNDO_DELETE, line, col, end_line, end_col, 0, 0);
+}
+
+/* Records that the text from (line, col) to (end_line, end_col) was
+ * deleted. The text is a followed by b. */
+static void undo_deleted(UndoHistory *undo, size_t line, size_t col,
+                         size_t end_line, size_t end_col,
+                         const char *a, size_t num_a,
+                         const char *b, size_t num_b)
+{
+    UndoRecord *top = undo_current(undo);
+    size_t start;
+
+    if (num_a + num_b == 0) {
+        return;
+    }
+
+    /* deleting the end of text that was just inserted means that less of
+     * it has to be deleted to undo the step */
+    if (top && top->type == UNDO_DELETE && top->end_line == end_line
+        && top->end_col == end_col
+        && (line > top->line || (line == top->line && col >= top->col))) {
+        top->end_line = line;
+        top->end_col = col;
+        if (top->line == line && top->col == col) {
+            --undo_target(undo)->end;
+            undo->new_step = top->first;
+        }
+        return;
+    }
+
+    if (undo_reserve(undo, num_a + num_b)) {
+        undo_fail(undo);
+        return;
+    }
+    start = undo->text_used;
+    undo_put_text(undo, a, num_a);
+    undo_put_text(undo, b, num_b);
+
+    /* the text after deleted text is deleted next when lines or characters
+     * are deleted one by one; its text continues the same record */
+    if (top && top->type == UNDO_INSERT && top->line == line
+        && top->col == col && top->text + top->num_bytes == start) {
+        top->num_bytes += num_a + num_b;
+        if (undo->state == UNDO_RECORDING) {
+            undo_enforce_limit(undo);
+        }
+        return;
+    }
+    undo_push(undo, UNDO_INSERT, line, col, line, col, start, num_a + num_b);
+}
+
+/* Records that the text of a line was replaced. Only the text that the
+ * line had first in a step is needed. */
+static void undo_replaced(UndoHistory *undo, size_t line, const char *text,
+                          size_t num_bytes)
+{
+    UndoRecord *top = undo_current(undo);
+    size_t start;
+
+    if (top && top->type == UNDO_REPLACE && top->line == line) {
+        return;
+    }
+
+    if (undo_reserve(undo, num_bytes)) {
+        undo_fail(undo);
+        return;
+    }
+    start = undo->text_used;
+    undo_put_text(undo, text, num_bytes);
+    undo_push(undo, UNDO_REPLACE, line, 0, line, 0, start, num_bytes);
+}
+
+/* Moves (line, col) to the end of text. */
+static void undo_advance(const char *text, size_t num_bytes, size_t *line,
+                         size_t *col)
+{
+    const char *end = text + num_bytes;
+    const char *last = NULL;
+    const char *p;
+
+    for (p = text; (p = memchr(p, '\n', end - p)); ++p) {
+        ++*line;
+        last = p;
+    }
+    if (last) {
+        *col = u8strnlen(last + 1, end - last - 1);
+    } else {
+        *col += u8strnlen(text, num_bytes);
+    }
+}
+
+/* The listener that records the edits made to the buffer. Every edit is
+ * recorded as an insertion, a deletion or a replaced line. */
+static void undo_record_edit(void *data, TextBuffer *buf,
+                             const TextEdit *edit)
+{
+    UndoHistory *undo = data;
+    size_t line = edit->line;
+    size_t col = edit->col;
+    size_t end_line = line;
+    size_t end_col = col;
+
+    if (undo->dropping || (edit->type == TEXTEDIT_INSERT
+                           && edit->num_bytes == 0)
+        || (edit->type == TEXTEDIT_DELETE && edit->num_removed == 0)) {
+        return;
+    }
+    if (undo->state == UNDO_RECORDING) {
+        undo_forget_all(undo, &undo->redo);
+    }
+
+    switch (edit->type) {
+    case TEXTEDIT_INSERT:
+        undo_advance(edit->text, edit->num_bytes, &end_line, &end_col);
+        undo_inserted(undo, line, col, end_line, end_col);
+        break;
+    case TEXTEDIT_SPLIT:
+        undo_inserted(undo, line, col, line + 1, 0);
+        break;
+    case TEXTEDIT_INSERT_LINE:
+        /* the newline is before the line if it's the last one */
+        if (line + 1 < buf->num_lines) {
+            undo_inserted(undo, line, 0, line + 1, 0);
+        } else if (line > 0) {
+            undo_inserted(undo, line - 1, textbuf_line_length(buf, line - 1),
+                          line, u8strnlen(edit->text, edit->num_bytes));
+        } else {
+            undo_inserted(undo, 0, 0, 0,
+                          u8strnlen(edit->text, edit->num_bytes));
+        }
+        break;
+    case TEXTEDIT_DELETE:
+        undo_deleted(undo, line, col, edit->end_line, edit->end_col,
+                     edit->removed, edit->num_removed, NULL, 0);
+        break;
+    case TEXTEDIT_JOIN:
+        undo_deleted(undo, line, col, line + 1, 0, "\n", 1, NULL, 0);
+        break;
+    case TEXTEDIT_DELETE_LINE:
+        end_col = u8strnlen(edit->removed, edit->num_removed);
+        if (buf->num_lines == 0) {
+            /* the buffer gets an empty line in place of the last one */
+            undo_deleted(undo, 0, 0, 0, end_col, edit->removed,
+                         edit->num_removed, NULL, 0);
+        } else if (line < buf->num_lines) {
+            undo_deleted(undo, line, 0, line + 1, 0, edit->removed,
+                         edit->num_removed, "\n", 1);
+        } else {
+            undo_deleted(undo, line - 1, textbuf_line_length(buf, line - 1),
+                         line, end_col, "\n", 1, edit->removed,
+                         edit->num_removed);
+        }
+        break;
+    case TEXTEDIT_REPLACE_LINE:
+        undo_replaced(undo, line, edit->removed, edit->num_removed);
+        break;
+    }
+}
+
+/* Makes the edit that a record describes. Returns 0 on success. */
+static int undo_apply(UndoHistory *undo, const UndoRecord *rec)
+{
+    TextBuffer *buf = undo->buf;
+    TextLine *tmp;
+
+    switch (rec->type) {
+    case UNDO_INSERT:
+        return textbuf_insert_text(buf, rec->line, rec->col,
+                                   undo->text + rec->text, rec->num_bytes);
+    case UNDO_DELETE:
+        return textbuf_delete_text(buf, rec->line, rec->col, rec->end_line,
+                                   rec->end_col);
+    case UNDO_REPLACE:
+        tmp = textline_init_len(rec->num_bytes > 0 ? undo->text + rec->text
+                                                   : "", rec->num_bytes);
+        if (!tmp) {
+            return 1;
+        }
+        if (textbuf_replace_line(buf, tmp, rec->line)) {
+            textline_free(tmp);
+            return 1;
+        }
+        return 0;
+    }
+    return 1;
+}
+
+/* Makes the records of the step on top of a stack from the top down. The
+ * edits are recorded in the other stack. Returns 0 on success. */
+static int undo_apply_step(UndoHistory *undo, UndoStack *from, int state)
+{
+    int first = 0;
+    int err = 0;
+
+    if (undo_stack_count(from) == 0) {
+        return 1;
+    }
+
+    undo->state = state;
+    undo->new_step = 1;
+    undo->dropping = 0;
+    while (!first && !err && from->end > from->begin) {
+        UndoRecord rec = from->records[--from->end];
+        undo->live_bytes -= rec.num_bytes;
+        first = rec.first;
+
+        err = undo_apply(undo, &rec);
+        /* the cursor ends up where the earliest edit of the step was */
+        undo->buf->crow = rec.line;
+        undo->buf->ccol = rec.col;
+    }
+    if (from->end == from->begin) {
+        from->begin = from->end = 0;
+    }
+    undo->state = UNDO_RECORDING;
+    undo->new_step = 1;
+
+    if (err) {
+        /* the records don't match the buffer anymore */
+        undo_clear(undo);
+        return 1;
+    }
+    undo_enforce_limit(undo);
+    return 0;
+}
+
+UndoHistory *undo_init(TextBuffer *buf, size_t limit)
+{
+    UndoHistory *undo;
+
+    assert(buf != NULL);
+
+    if (!(undo = calloc(1, sizeof(*undo)))) {
+        return NULL;
+    }
+    undo->buf = buf;
+    undo->limit = limit;
+    undo->state = UNDO_RECORDING;
+    undo->new_step = 1;
+
+    if (textbuf_add_listener(buf, undo_record_edit, undo)) {
+        free(undo);
+        return NULL;
+    }
+    return undo;
+}
+
+void undo_new_step(UndoHistory *undo)
+{
+    assert(undo != NULL);
+
+    undo->new_step = 1;
+    undo->dropping = 0;
+}
+
+int undo_undo(UndoHistory *undo)
+{
+    assert(undo != NULL);
+
+    return undo_apply_step(undo, &undo->undo, UNDO_UNDOING);
+}
+
+int undo_redo(UndoHistory *undo)
+{
+    assert(undo != NULL);
+
+    return undo_apply_step(undo, &undo->redo, UNDO_REDOING);
+}
+
+void undo_clear(UndoHistory *undo)
+{
+    assert(undo != NULL);
+
+    undo->undo.begin = undo->undo.end = 0;
+    undo->redo.begin = undo->redo.end = 0;
+    free(undo->text);
+    undo->text = NULL;
+    undo->text_used = undo->text_size = 0;
+    undo->live_bytes = 0;
+    undo->new_step = 1;
+    undo->dropping = 0;
+}
+
+size_t undo_memory(const UndoHistory *undo)
+{
+    assert(undo != NULL);
+
+    return undo->live_bytes
+           + (undo_stack_count(&undo->undo) + undo_stack_count(&undo->redo))
+             * sizeof(UndoRecord);
+}
+
+void undo_free(UndoHistory *undo)
+{
+    if (!undo) {
+        return;
+    }
+
+    textbuf_remove_listener(undo->buf, undo_record_edit, undo);
+    free(undo->undo.records);
+    free(undo->redo.records);
+    free(undo->text);
+    free(undo);
+}
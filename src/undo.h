@@ -0,0 +1,87 @@
+/**
+ * @file undo.h
+ * @author dreamyeyed
+ *
+ * An UndoHistory remembers how to reverse the edits made to a buffer. It
+ * doesn't store copies of the buffer: every edit becomes a record of the
+ * edit that reverses it, which is made with the same functions that edit the
+ * buffer. Characters typed one after another become one record, and so do
+ * lines deleted one after another, so that reversing them is one edit no
+ * matter how many there were. Deleted text is kept in one block of memory
+ * that the records share, and when the history grows past its limit, the
+ * oldest records are forgotten first.
+ *
+ * Edits are undone in steps. A step is everything that was done between
+ * two calls to undo_new_step.
+ */
+#pragma once
+
+#include <stddef.h>
+
+#include "textbuf.h"
+
+typedef struct UndoHistory UndoHistory;
+
+/**
+ * Starts recording the edits made to a buffer.
+ *
+ * @param buf the buffer; the history must be freed before it
+ * @param limit how many bytes of memory the history may use for deleted
+ * text and records
+ * @return pointer to a dynamically allocated UndoHistory, or NULL in case of
+ * error
+ */
+UndoHistory *undo_init(TextBuffer *buf, size_t limit);
+
+/**
+ * Starts a new step. The edits made after this are undone separately from
+ * the ones before it.
+ *
+ * @param undo
+ */
+void undo_new_step(UndoHistory *undo);
+
+/**
+ * Reverses the last step that hasn't been undone and moves the cursor to
+ * where it was made.
+ *
+ * @param undo
+ * @return 0 on success, non-zero if there was nothing to undo or the buffer
+ * couldn't be changed
+ */
+int undo_undo(UndoHistory *undo);
+
+/**
+ * Makes the last step that was undone again. Steps that have been undone
+ * can be redone until the buffer is edited.
+ *
+ * @param undo
+ * @return 0 on success, non-zero if there was nothing to redo or the buffer
+ * couldn't be changed
+ */
+int undo_redo(UndoHistory *undo);
+
+/**
+ * Forgets everything. This must be done if the buffer is changed in a way
+ * that isn't reported to its listeners, such as when a file is loaded into
+ * it again.
+ *
+ * @param undo
+ */
+void undo_clear(UndoHistory *undo);
+
+/**
+ * Returns how many bytes of memory the history uses for deleted text and
+ * records.
+ *
+ * @param undo
+ * @return the number of bytes
+ */
+size_t undo_memory(const UndoHistory *undo);
+
+/**
+ * Stops recording edits and frees the history.
+ *
+ * @param undo
+ */
+void undo_free(UndoHistory *undo);
@@ -7,6 +7,13 @@
 #include "util.h"
 
 #include <assert.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HAVE_X86_SIMD 1
+#endif
 
 int is_u8_start_byte (char c)
 {
@@ -45,17 +52,174 @@ int u8_char_length(char c)
     }
 }
 
-size_t u8strlen (const char *s)
+/*
+ * Counting codepoints is the same as counting the bytes that are not
+ * continuation bytes. The functions below do that 16 or 32 bytes at a time
+ * when the CPU supports it. A continuation byte is 10xxxxxx, which is less
+ * than -64 as a signed byte, so one comparison finds all of them in a block.
+ */
+
+static size_t u8strnlen_portable(const char *s, size_t n)
+{
+    size_t count = 0;
+    while (n-- > 0) {
+        count += is_u8_start_byte(*s++);
+    }
+    return count;
+}
+
+static int u8_find_pos_n_portable(const char *s, size_t len, size_t n,
+                                  size_t *pos)
+{
+    size_t i;
+
+    for (i = 0; i < len; ++i) {
+        if (is_u8_start_byte(s[i])) {
+            if (n == 0) {
+                *pos = i;
+                return 0;
+            }
+            --n;
+        }
+    }
+
+    *pos = len;
+    return n != 0;
+}
+
+#ifdef HAVE_X86_SIMD
+/* Returns the index of the nth set bit in mask. mask must have more than n
+ * set bits. */
+static int nth_set_bit(unsigned int mask, size_t n)
+{
+    while (n-- > 0) {
+        mask &= mask - 1;
+    }
+    return __builtin_ctz(mask);
+}
+
+__attribute__((target("sse2")))
+static unsigned int start_bytes_sse2(const char *s)
 {
-    size_t n = 0;
-    for (; *s; ++s) {
-        n += is_u8_start_byte(*s);
+    __m128i v = _mm_loadu_si128((const __m128i *) s);
+    __m128i cont = _mm_cmplt_epi8(v, _mm_set1_epi8(-64));
+    return ~_mm_movemask_epi8(cont) & 0xffff;
+}
+
+__attribute__((target("sse2")))
+static size_t u8strnlen_sse2(const char *s, size_t n)
+{
+    size_t count = 0;
+
+    for (; n >= 16; s += 16, n -= 16) {
+        count += __builtin_popcount(start_bytes_sse2(s));
+    }
+    return count + u8strnlen_portable(s, n);
+}
+
+__attribute__((target("sse2")))
+static int u8_find_pos_n_sse2(const char *s, size_t len, size_t n,
+                              size_t *pos)
+{
+    size_t i;
+
+    for (i = 0; i + 16 <= len; i += 16) {
+        unsigned int mask = start_bytes_sse2(s + i);
+        size_t count = __builtin_popcount(mask);
+        if (count > n) {
+            *pos = i + nth_set_bit(mask, n);
+            return 0;
+        }
+        n -= count;
     }
-    return n;
+
+    if (u8_find_pos_n_portable(s + i, len - i, n, pos)) {
+        *pos = len;
+        return 1;
+    }
+    *pos += i;
+    return 0;
+}
+
+__attribute__((target("avx2,popcnt")))
+static unsigned int start_bytes_avx2(const char *s)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *) s);
+    __m256i cont = _mm256_cmpgt_epi8(_mm256_set1_epi8(-64), v);
+    return ~(unsigned int) _mm256_movemask_epi8(cont);
+}
+
+__attribute__((target("avx2,popcnt")))
+static size_t u8strnlen_avx2(const char *s, size_t n)
+{
+    size_t count = 0;
+
+    for (; n >= 32; s += 32, n -= 32) {
+        count += __builtin_popcount(start_bytes_avx2(s));
+    }
+    return count + u8strnlen_portable(s, n);
+}
+
+__attribute__((target("avx2,popcnt")))
+static int u8_find_pos_n_avx2(const char *s, size_t len, size_t n,
+                              size_t *pos)
+{
+    size_t i;
+
+    for (i = 0; i + 32 <= len; i += 32) {
+        unsigned int mask = start_bytes_avx2(s + i);
+        size_t count = __builtin_popcount(mask);
+        if (count > n) {
+            *pos = i + nth_set_bit(mask, n);
+            return 0;
+        }
+        n -= count;
+    }
+
+    if (u8_find_pos_n_portable(s + i, len - i, n, pos)) {
+        *pos = len;
+        return 1;
+    }
+    *pos += i;
+    return 0;
+}
+#endif
+
+/* The best implementations for this CPU. They are chosen before main()
+ * runs, so that every thread sees the same ones. */
+static size_t (*u8strnlen_impl)(const char *, size_t) = u8strnlen_portable;
+static int (*u8_find_pos_n_impl)(const char *, size_t, size_t, size_t *)
+    = u8_find_pos_n_portable;
+
+#ifdef HAVE_X86_SIMD
+__attribute__((constructor))
+static void u8_choose_impl(void)
+{
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        u8strnlen_impl = u8strnlen_avx2;
+        u8_find_pos_n_impl = u8_find_pos_n_avx2;
+    } else if (__builtin_cpu_supports("sse2")) {
+        u8strnlen_impl = u8strnlen_sse2;
+        u8_find_pos_n_impl = u8_find_pos_n_sse2;
+    }
+}
+#endif
+
+size_t u8strlen (const char *s)
+{
+    return u8strnlen_impl(s, strlen(s));
+}
+
+size_t u8strnlen(const char *s, size_t n)
+{
+    return u8strnlen_impl(s, n);
 }
 
 int u8_find_pos(const char *s, size_t n, size_t *pos)
 {
+    size_t len;
+
     assert(s != NULL);
     assert(pos != NULL);
 
@@ -63,11 +227,30 @@ int u8_find_pos(const char *s, size_t n, size_t *pos)
     if (n == 0) {
         return 0;
     }
-    for ((*pos) = 1; s[*pos] != '\0'; ++(*pos)) {
-        n -= is_u8_start_byte(s[*pos]);
-        if (n == 0) {
-            return 0;
-        }
+
+    /* The first byte always counts as the start of the first codepoint.
+     * The nth codepoint must start before the end of the string. */
+    len = strlen(s);
+    if (len <= 1 || u8_find_pos_n_impl(s + 1, len - 1, n - 1, pos)
+        || *pos == len - 1) {
+        return 1;
     }
-    return 1;
+    *pos += 1;
+    return 0;
+}
+
+int u8_find_pos_n(const char *s, size_t len, size_t n, size_t *pos)
+{
+    assert(s != NULL);
+    assert(pos != NULL);
+
+    return u8_find_pos_n_impl(s, len, n, pos);
+}
+
+unsigned long current_ms(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000ul + ts.tv_nsec / 1000000;
 }
@@ -48,6 +48,21 @@ int u8_char_length(char c);
  */
 size_t u8strlen (const char *s);
 
+/*
+ * The codepoint counting functions below use SSE2 or AVX2 instructions if the
+ * CPU has them. The right version is chosen at run time.
+ */
+
+/**
+ * Calculates the number of codepoints in the first n bytes of a UTF-8 encoded
+ * string. The string doesn't need to be null terminated.
+ *
+ * @param s an UTF-8 encoded string
+ * @param n number of bytes
+ * @return number of codepoints in the given bytes
+ */
+size_t u8strnlen(const char *s, size_t n);
+
 /**
  * Finds the nth codepoint in a UTF-8 encoded string.
  *
@@ -57,3 +72,24 @@ size_t u8strlen (const char *s);
  * @return 0 if successful, non-zero otherwise
  */
 int u8_find_pos(const char *s, size_t n, size_t *pos);
+
+/**
+ * Finds the nth codepoint in the first len bytes of a UTF-8 encoded string.
+ * The string doesn't need to be null terminated.
+ *
+ * @param s an UTF-8 encoded string that starts with a start byte
+ * @param len number of bytes in s
+ * @param n The codepoint to find (the first codepoint is 0). If n is the
+ * number of codepoints in s, the end of the string is found.
+ * @param pos an address where the position of the first byte of the codepoint
+ * is stored
+ * @return 0 if successful, non-zero if there are less than n codepoints
+ */
+int u8_find_pos_n(const char *s, size_t len, size_t n, size_t *pos);
+
+/**
+ * Returns the time in milliseconds from some fixed point.
+ *
+ * @return the time
+ */
+unsigned long current_ms(void);
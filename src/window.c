@@ -20,7 +20,18 @@ LoonyWindow *loonywin_init(TextBuffer *buf, WINDOW *win)
     window->buffer = buf;
     window->window = win;
     window->firstrow = 0;
-    window->redraw_needed = 0;
+    /* nothing has been drawn yet */
+    window->redraw_needed = 1;
+    window->scroll_delta = 0;
+    window->frame_interval = DEFAULT_FRAME_INTERVAL;
+    window->last_frame = 0;
+    window->key_timeout = -1;
+    window->wake_fd = -1;
+    window->wait_fn = NULL;
+    window->wait_data = NULL;
+    window->row_damage = NULL;
+    window->num_rows = 0;
+    window->statusbar_dirty = 1;
     window->statusbar_text[0] = '\0';
 
     return window;
@@ -28,13 +39,16 @@ LoonyWindow *loonywin_init(TextBuffer *buf, WINDOW *win)
 
 void loonywin_free(LoonyWindow *win)
 {
+    if (!win) {
+        return;
+    }
+
+    free(win->row_damage);
     free(win);
 }
 
 void loonywin_move_cursor(LoonyWindow *win, int dy, int dx)
 {
-    size_t win_h, win_w;
-
     assert(win != NULL);
     assert(win->buffer != NULL);
 
@@ -42,21 +56,73 @@ void loonywin_move_cursor(LoonyWindow *win, int dy, int dx)
         return;
     }
 
+    textbuf_move_cursor(win->buffer, dy, dx);
+    loonywin_follow_cursor(win);
+}
+
+void loonywin_follow_cursor(LoonyWindow *win)
+{
+    size_t win_h, win_w;
+
+    assert(win != NULL);
+    assert(win->buffer != NULL);
+
     getmaxyx(win->window, win_h, win_w);
     --win_h; /* save a line for the statusbar */
 
-    textbuf_move_cursor(win->buffer, dy, dx);
-
     /* scrolling required? */
     if (win->buffer->crow < win->firstrow) {
-        win->firstrow = win->buffer->crow;
+        loonywin_scroll(win, win->buffer->crow - win->firstrow);
     } else if (win->buffer->crow >= win->firstrow + win_h) {
-        win->firstrow = win->buffer->crow - win_h + 1;
+        loonywin_scroll(win, win->buffer->crow - (int) win_h + 1
+                             - win->firstrow);
     }
 }
 
+void loonywin_scroll(LoonyWindow *win, int n)
+{
+    assert(win != NULL);
+
+    win->firstrow += n;
+    win->scroll_delta += n;
+}
+
+void loonywin_set_frame_interval(LoonyWindow *win, unsigned long ms)
+{
+    assert(win != NULL);
+
+    win->frame_interval = ms;
+}
+
+void loonywin_set_key_timeout(LoonyWindow *win, int ms)
+{
+    assert(win != NULL);
+
+    win->key_timeout = ms;
+}
+
+void loonywin_set_wake_fd(LoonyWindow *win, int fd)
+{
+    assert(win != NULL);
+
+    win->wake_fd = fd;
+}
+
+void loonywin_set_wait_handler(LoonyWindow *win, LoonyWaitFn fn, void *data)
+{
+    assert(win != NULL);
+
+    win->wait_fn = fn;
+    win->wait_data = data;
+}
+
 void loonywin_set_statusbar(LoonyWindow *win, const char *text)
 {
+    if (strncmp(win->statusbar_text, text, STATUSBAR_LENGTH - 1) == 0) {
+        return;
+    }
+
+    win->statusbar_dirty = 1;
     strncpy(win->statusbar_text, text, STATUSBAR_LENGTH - 1);
     win->statusbar_text[STATUSBAR_LENGTH-1] = '\0';
 }
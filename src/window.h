@@ -15,6 +15,32 @@
 /** maximum length of statusbar text */
 #define STATUSBAR_LENGTH 256
 
+/** default for the longest time between two frames while input is pending */
+#define DEFAULT_FRAME_INTERVAL 50
+
+/**
+ * What needs to be drawn on one row of a window.
+ */
+typedef enum RowDamage
+{
+    /** the row is up to date */
+    ROW_CLEAN,
+    /** the text is right, but the line number next to it has changed */
+    ROW_GUTTER,
+    /** the whole row must be drawn again */
+    ROW_FULL
+} RowDamage;
+
+struct LoonyWindow;
+
+/**
+ * A function that insert mode calls before it waits for each key, so that
+ * what the main loop would do meanwhile still gets done. It may change the
+ * key timeout of the window; when get_key() gives up waiting, it's called
+ * again.
+ */
+typedef void (*LoonyWaitFn)(void *data, struct LoonyWindow *win);
+
 typedef struct LoonyWindow
 {
     /** the textbuffer that is visible in this window */
@@ -25,6 +51,37 @@ typedef struct LoonyWindow
     int firstrow;
     /** non-zero if the screen should be completely redrawn */
     int redraw_needed;
+    /**
+     * number of rows the window has scrolled down (or up, if negative) since
+     * it was last drawn
+     */
+    int scroll_delta;
+    /** what needs to be drawn on each row, used while drawing */
+    unsigned char *row_damage;
+    /** number of rows in row_damage, which is the height it was drawn at */
+    size_t num_rows;
+    /**
+     * Milliseconds that may pass between two frames while keys are still
+     * waiting to be handled. Until then, drawing is skipped.
+     */
+    unsigned long frame_interval;
+    /** time of the last frame in milliseconds, see get_key() */
+    unsigned long last_frame;
+    /**
+     * milliseconds get_key() waits for a key before it gives up, or -1 to
+     * wait forever
+     */
+    int key_timeout;
+    /**
+     * file descriptor that makes get_key() return ERR when it becomes
+     * readable, or -1
+     */
+    int wake_fd;
+    /** called before insert mode waits for a key, or NULL */
+    LoonyWaitFn wait_fn;
+    void *wait_data;
+    /** non-zero if the statusbar text has changed since it was drawn */
+    int statusbar_dirty;
     /** text on the statusbar */
     char statusbar_text[STATUSBAR_LENGTH];
 } LoonyWindow;
@@ -58,6 +115,58 @@ void loonywin_free(LoonyWindow *win);
  */
 void loonywin_move_cursor(LoonyWindow *win, int dy, int dx);
 
+/**
+ * Scrolls a window so that the cursor is visible.
+ *
+ * @param win
+ */
+void loonywin_follow_cursor(LoonyWindow *win);
+
+/**
+ * Scrolls a window without moving the cursor.
+ *
+ * @param win
+ * @param n number of rows to scroll down, or up if negative
+ */
+void loonywin_scroll(LoonyWindow *win, int n);
+
+/**
+ * Sets the longest time between two frames while keys are still waiting to
+ * be handled.
+ *
+ * @param win
+ * @param ms the time in milliseconds; 0 draws after every key
+ */
+void loonywin_set_frame_interval(LoonyWindow *win, unsigned long ms);
+
+/**
+ * Sets how long get_key() waits for a key. Something that changes the
+ * window without any keys being pressed needs a timeout, so that the window
+ * is drawn again.
+ *
+ * @param win
+ * @param ms the time in milliseconds, or -1 to wait forever
+ */
+void loonywin_set_key_timeout(LoonyWindow *win, int ms);
+
+/**
+ * Sets a file descriptor that stops get_key() from waiting for a key when
+ * it becomes readable, so that something else can be handled first.
+ *
+ * @param win
+ * @param fd the file descriptor, or -1 for none
+ */
+void loonywin_set_wake_fd(LoonyWindow *win, int fd);
+
+/**
+ * Sets the function that insert mode calls before it waits for a key.
+ *
+ * @param win
+ * @param fn the function, or NULL for none
+ * @param data passed to the function
+ */
+void loonywin_set_wait_handler(LoonyWindow *win, LoonyWaitFn fn, void *data);
+
 /**
  * Sets the text on the statusbar.
  *